@@ -0,0 +1,79 @@
+"""Compare switch and computed-goto dispatch in run().
+
+Builds three release binaries: one that counts dispatched instructions,
+one with the portable 'switch' loop and one with threaded dispatch. The
+instruction count of each program comes from the counting build, and the
+two other builds are timed on the same programs to get instructions/sec.
+
+Usage: python bench/dispatch.py [program.vnm ...]
+(defaults to the programs under bench/programs/)
+"""
+import statistics
+import subprocess
+import sys
+import time
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parent.parent
+BUILD = ROOT / "bench" / "build"
+REPETITIONS = 20
+
+VARIANTS = {
+    "count": "-O2 -Dvenom_count_instructions",
+    "switch": "-O2 -Dvenom_no_computed_goto",
+    "threaded": "-O2",
+}
+
+
+def build(name, flags):
+    out = BUILD / f"venom-{name}"
+    subprocess.run(
+        ["make", "-s", "release", f"RELEASE_CFLAGS={flags}", f"OUT={out}"],
+        cwd=ROOT,
+        check=True,
+    )
+    return out
+
+
+def count_instructions(binary, program, flags=()):
+    process = subprocess.run(
+        [binary, *flags, program], capture_output=True, text=True, check=True
+    )
+    for line in process.stderr.splitlines():
+        if line.startswith("instructions executed:"):
+            return int(line.split(":")[1])
+    raise RuntimeError(f"no instruction count for {program}")
+
+
+def median_time(binary, program):
+    timings = []
+    for _ in range(REPETITIONS):
+        start = time.perf_counter()
+        subprocess.run([binary, program], stdout=subprocess.DEVNULL, check=True)
+        timings.append(time.perf_counter() - start)
+    return statistics.median(timings)
+
+
+def main():
+    programs = [Path(p) for p in sys.argv[1:]]
+    if not programs:
+        programs = sorted((ROOT / "bench" / "programs").glob("*.vnm"))
+
+    BUILD.mkdir(exist_ok=True)
+    binaries = {name: build(name, flags) for name, flags in VARIANTS.items()}
+
+    print(f"{'program':<16}{'instructions':>14}{'switch Mi/s':>14}{'threaded Mi/s':>16}{'speedup':>10}")
+    for program in programs:
+        count = count_instructions(binaries["count"], program)
+        switch = median_time(binaries["switch"], program)
+        threaded = median_time(binaries["threaded"], program)
+        print(
+            f"{program.name:<16}{count:>14}"
+            f"{count / switch / 1e6:>14.2f}"
+            f"{count / threaded / 1e6:>16.2f}"
+            f"{switch / threaded:>9.2f}x"
+        )
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,439 @@
+/* Microbenchmarks for the pieces of the interpreter, each driven on
+ * its own with synthetic input of growing size, so that a slowdown in
+ * make bench can be pinned on one of them, and the growth of each can
+ * be read off its rows:
+ *
+ *   tokenizer          get_token over an N-megabyte script, per token
+ *   parser             parse over the same script, per top-level statement
+ *   optimizer          optimize over its AST, per statement
+ *   compiler/stack     compile over its optimized AST, per statement
+ *   compiler/registers compile_registers over the same, per statement
+ *   loops/stack        compile over N top-level while loops, per loop
+ *   loops/registers    compile_registers over the same
+ *   table/insert       table_insert of N interned keys into an empty table
+ *   table/get          table_get of the same N keys and of N missing ones
+ *   globals/stack      run over a loop updating N globals, per update
+ *   globals/registers  run_registers over the same
+ *   calls/stack        run over an N-deep chain of recursive calls, per call
+ *   calls/registers    run_registers over the same
+ *
+ * Each case runs ROUNDS times, only the step being measured on the
+ * clock, and the fastest round is reported in ns/op and allocs/op. The
+ * allocations are the calls to malloc, calloc and realloc made during
+ * the round, which are counted by linking with --wrap for each of
+ * them. Memory that is mapped instead, such as the VM stack, doesn't
+ * show up.
+ *
+ * Usage: make micro-bench [BENCH=name]
+ * runs only the benchmarks whose name starts with 'name'. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/compiler.h"
+#include "../src/gc.h"
+#include "../src/optimizer.h"
+#include "../src/parser.h"
+#include "../src/regcompiler.h"
+#include "../src/table.h"
+#include "../src/tokenizer.h"
+#include "../src/vm.h"
+
+#define ROUNDS 5
+
+static size_t allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    allocations++;
+    return __real_realloc(pointer, size);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* The fastest round of a case so far, and its allocations. */
+typedef struct {
+    double ns;
+    size_t allocations;
+} Timing;
+
+static double round_start;
+static size_t round_allocations;
+
+static void start_round(void) {
+    round_allocations = allocations;
+    round_start = now();
+}
+
+static void end_round(Timing *timing) {
+    double elapsed = now() - round_start;
+    size_t count = allocations - round_allocations;
+    if (timing->ns == 0 || elapsed < timing->ns) {
+        timing->ns = elapsed;
+        timing->allocations = count;
+    }
+}
+
+static const char *filter;
+
+static bool selected(const char *name) {
+    return filter == NULL || strncmp(name, filter, strlen(filter)) == 0;
+}
+
+static void report(const char *name, size_t size, const char *unit, size_t ops, const Timing *timing) {
+    printf("%-20s %8zu %-6s %10zu %12.2f %12.3f\n", name, size, unit, ops,
+        timing->ns / ops, (double)timing->allocations / ops);
+}
+
+static char *generate(size_t size, size_t *length) {
+    /* A script of about 'size' bytes made of rounds of six statements:
+     * a global, a function with a loop, an assignment, an if with
+     * strings, a call and a constant, each round with names of its own,
+     * so the whole script is valid and compiles. */
+    char *source = malloc(size + 512 + TOKENIZER_PADDING);
+    size_t count = 0;
+    for (size_t i = 0; count < size; i++) {
+        size_t id = i / 6;
+        switch (i % 6) {
+            case 0:
+                count += sprintf(source + count, "let g%zu = %zu;\n", id, i);
+                break;
+            case 1:
+                count += sprintf(source + count,
+                    "fn f%zu(a, b) {\n    let c = a * %zu.25 + b / 3;\n"
+                    "    while (c < 20) {\n        c = c + 1;\n    }\n"
+                    "    if (c > 10 && c != 20) {\n        return c - 1;\n    }\n    return c;\n}\n",
+                    id, i % 97);
+                break;
+            case 2:
+                count += sprintf(source + count, "g%zu = g%zu * 2 + %zu;\n", id, id, i % 50);
+                break;
+            case 3:
+                count += sprintf(source + count,
+                    "if (g%zu >= 10) {\n    print \"a string literal number %zu\";\n} else {\n    print null;\n}\n",
+                    id, i);
+                break;
+            case 4:
+                count += sprintf(source + count, "print f%zu(g%zu, 3.14159) %% 7;\n", id, id);
+                break;
+            case 5:
+                count += sprintf(source + count, "const k%zu = %zu;\n", id, i * 31);
+                break;
+        }
+    }
+    memset(source + count, '\0', TOKENIZER_PADDING);
+    *length = count;
+    return source;
+}
+
+static size_t parse_source(char *source, Ast *ast, Statement_DynArray *stmts) {
+    /* Parses and optimizes 'source', returning the number of top-level
+     * statements, which the benchmarks' input never fails to give. */
+    Parser parser;
+    Tokenizer tokenizer;
+    init_tokenizer(&tokenizer, source);
+    parse(&parser, &tokenizer, ast, stmts, BODY_PARSE);
+    Optimizer optimizer;
+    init_optimizer(&optimizer, ast);
+    optimize(&optimizer, stmts);
+    if (parser.had_error || optimizer.had_error) {
+        fprintf(stderr, "the generated source has errors\n");
+        exit(1);
+    }
+    free_optimizer(&optimizer);
+    return stmts->count;
+}
+
+static void compile_source(Ast *ast, Statement_DynArray *stmts, bool registers, BytecodeChunk *chunk) {
+    if (registers) {
+        RegCompiler compiler;
+        init_reg_compiler(&compiler, ast, &chunk->main);
+        for (size_t i = 0; i < stmts->count; i++) {
+            compile_registers(&compiler, chunk, stmts->data[i], false);
+        }
+        finish_reg_chunk(chunk, 0);
+    } else {
+        Compiler compiler;
+        init_compiler(&compiler, ast, &chunk->main);
+        for (size_t i = 0; i < stmts->count; i++) {
+            compile(&compiler, chunk, stmts->data[i], false);
+        }
+        finish_chunk(chunk, 0);
+    }
+}
+
+static void bench_tokenizer(char *source, size_t megabytes) {
+    Timing timing = {0};
+    size_t tokens = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        Tokenizer tokenizer;
+        init_tokenizer(&tokenizer, source);
+        size_t count = 0;
+        start_round();
+        while (get_token(&tokenizer).type != TOKEN_EOF) {
+            count++;
+        }
+        end_round(&timing);
+        tokens = count;
+    }
+    report("tokenizer", megabytes, "MB", tokens, &timing);
+}
+
+static void bench_parser(char *source, size_t megabytes) {
+    Timing timing = {0};
+    size_t statements = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        Ast ast;
+        init_ast(&ast);
+        Statement_DynArray stmts = {0};
+        Parser parser;
+        Tokenizer tokenizer;
+        init_tokenizer(&tokenizer, source);
+        start_round();
+        parse(&parser, &tokenizer, &ast, &stmts, BODY_PARSE);
+        end_round(&timing);
+        statements = stmts.count;
+        dynarray_free(&stmts);
+        free_ast(&ast);
+    }
+    report("parser", megabytes, "MB", statements, &timing);
+}
+
+static void bench_optimizer(char *source, size_t megabytes) {
+    Timing timing = {0};
+    size_t statements = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        Ast ast;
+        init_ast(&ast);
+        Statement_DynArray stmts = {0};
+        Parser parser;
+        Tokenizer tokenizer;
+        init_tokenizer(&tokenizer, source);
+        parse(&parser, &tokenizer, &ast, &stmts, BODY_PARSE);
+        Optimizer optimizer;
+        init_optimizer(&optimizer, &ast);
+        start_round();
+        optimize(&optimizer, &stmts);
+        end_round(&timing);
+        statements = stmts.count;
+        free_optimizer(&optimizer);
+        dynarray_free(&stmts);
+        free_ast(&ast);
+    }
+    report("optimizer", megabytes, "MB", statements, &timing);
+}
+
+static Timing time_compile(char *source, bool registers, size_t *statements) {
+    /* The optimizer folds the tree in place, so each round parses
+     * afresh, off the clock. */
+    Timing timing = {0};
+    for (int r = 0; r < ROUNDS; r++) {
+        Ast ast;
+        init_ast(&ast);
+        Statement_DynArray stmts = {0};
+        *statements = parse_source(source, &ast, &stmts);
+        Heap heap;
+        init_heap(&heap, &DEFAULT_GC_OPTIONS);
+        BytecodeChunk chunk;
+        init_chunk(&chunk, &heap);
+        start_round();
+        compile_source(&ast, &stmts, registers, &chunk);
+        end_round(&timing);
+        free_chunk(&chunk);
+        free_heap(&heap);
+        dynarray_free(&stmts);
+        free_ast(&ast);
+    }
+    return timing;
+}
+
+static void bench_compiler(char *source, size_t megabytes, bool registers) {
+    size_t statements;
+    Timing timing = time_compile(source, registers, &statements);
+    report(registers ? "compiler/registers" : "compiler/stack", megabytes, "MB", statements, &timing);
+}
+
+static void bench_loops(size_t count, bool registers) {
+    /* All of the loops are in the same code object, which the stack
+     * compiler's control-flow pass optimizes as a whole. */
+    char *source = malloc(count * 64 + TOKENIZER_PADDING);
+    char *end = source;
+    for (size_t i = 0; i < count; i++) {
+        end += sprintf(end, "let i%zu = 0;\nwhile (i%zu < 10) {\n    i%zu = i%zu + 1;\n}\n", i, i, i, i);
+    }
+    memset(end, '\0', TOKENIZER_PADDING);
+
+    size_t statements;
+    Timing timing = time_compile(source, registers, &statements);
+    report(registers ? "loops/registers" : "loops/stack", count, "loops", count, &timing);
+    free(source);
+}
+
+static void bench_table(size_t count) {
+    Heap heap;
+    init_heap(&heap, &DEFAULT_GC_OPTIONS);
+    String **hits = malloc(sizeof(String *) * count);
+    String **misses = malloc(sizeof(String *) * count);
+    for (size_t i = 0; i < count; i++) {
+        char key[32];
+        hits[i] = intern_string(&heap, key, snprintf(key, sizeof(key), "name%zu", i));
+        misses[i] = intern_string(&heap, key, snprintf(key, sizeof(key), "other%zu", i));
+    }
+
+    Timing insert = {0}, get = {0};
+    for (int r = 0; r < ROUNDS; r++) {
+        Table table = {0};
+        start_round();
+        for (size_t i = 0; i < count; i++) {
+            table_insert(&table, hits[i], AS_NUM(i));
+        }
+        end_round(&insert);
+
+        /* Counting the hits checks the table and keeps the lookups
+         * from being optimized away. */
+        size_t found = 0;
+        start_round();
+        for (size_t i = 0; i < count; i++) {
+            found += table_get(&table, hits[i]) != NULL;
+            found += table_get(&table, misses[i]) != NULL;
+        }
+        end_round(&get);
+        if (found != count) {
+            fprintf(stderr, "lookup mismatch with %zu keys\n", count);
+            exit(1);
+        }
+        table_free(&table);
+    }
+    if (selected("table/insert")) report("table/insert", count, "keys", count, &insert);
+    if (selected("table/get")) report("table/get", count, "keys", 2 * count, &get);
+
+    free(hits);
+    free(misses);
+    free_heap(&heap);
+}
+
+static Timing time_run(char *source, bool registers) {
+    /* Each round runs the program on a VM of its own, compiled off the
+     * clock. */
+    Timing timing = {0};
+    for (int r = 0; r < ROUNDS; r++) {
+        VMOptions options = DEFAULT_VM_OPTIONS;
+        VM vm;
+        init_vm(&vm, &options);
+        BytecodeChunk chunk;
+        init_chunk(&chunk, &vm.heap);
+        Ast ast;
+        init_ast(&ast);
+        Statement_DynArray stmts = {0};
+        parse_source(source, &ast, &stmts);
+        compile_source(&ast, &stmts, registers, &chunk);
+        dynarray_free(&stmts);
+        free_ast(&ast);
+
+        start_round();
+        bool ok = registers ? run_registers(&vm, &chunk, 0) : run(&vm, &chunk, 0);
+        end_round(&timing);
+        if (!ok) {
+            exit(1);
+        }
+        free_chunk(&chunk);
+        free_vm(&vm);
+    }
+    return timing;
+}
+
+static void bench_globals(size_t count, bool registers) {
+    /* Declares 'count' globals and updates each of them in a loop that
+     * makes about a million updates in all. */
+    size_t iterations = ((size_t)1 << 20) / count;
+    char *source = malloc(count * 48 + 256 + TOKENIZER_PADDING);
+    char *end = source;
+    for (size_t i = 0; i < count; i++) {
+        end += sprintf(end, "let g%zu = 0;\n", i);
+    }
+    end += sprintf(end, "let i = 0;\nwhile (i < %zu) {\n", iterations);
+    for (size_t i = 0; i < count; i++) {
+        end += sprintf(end, "    g%zu = g%zu + 1;\n", i, i);
+    }
+    end += sprintf(end, "    i = i + 1;\n}\n");
+    memset(end, '\0', TOKENIZER_PADDING);
+
+    Timing timing = time_run(source, registers);
+    report(registers ? "globals/registers" : "globals/stack", count, "slots", iterations * count, &timing);
+    free(source);
+}
+
+static void bench_calls(size_t depth, bool registers) {
+    /* Recurses 'depth' calls deep, over and over, for about a million
+     * calls in all. */
+    size_t repeats = ((size_t)1 << 20) / (depth + 1);
+    char source[512 + TOKENIZER_PADDING] = {0};
+    snprintf(source, 512,
+        "fn down(n) {\n    if (n == 0) {\n        return 0;\n    }\n    return down(n - 1) + 1;\n}\n"
+        "let i = 0;\nlet total = 0;\n"
+        "while (i < %zu) {\n    total = total + down(%zu);\n    i = i + 1;\n}\n",
+        repeats, depth);
+
+    Timing timing = time_run(source, registers);
+    report(registers ? "calls/registers" : "calls/stack", depth, "deep", repeats * (depth + 1), &timing);
+}
+
+int main(int argc, char *argv[]) {
+    filter = argc > 1 && argv[1][0] != '\0' ? argv[1] : NULL;
+    printf("%-20s %15s %10s %12s %12s\n", "benchmark", "size", "ops", "ns/op", "allocs/op");
+
+    size_t megabytes[] = { 1, 2, 4 };
+    for (size_t i = 0; i < sizeof(megabytes) / sizeof(megabytes[0]); i++) {
+        if (!selected("tokenizer") && !selected("parser") && !selected("optimizer") && !selected("compiler")) break;
+        size_t length;
+        char *source = generate(megabytes[i] << 20, &length);
+        if (selected("tokenizer")) bench_tokenizer(source, megabytes[i]);
+        if (selected("parser")) bench_parser(source, megabytes[i]);
+        if (selected("optimizer")) bench_optimizer(source, megabytes[i]);
+        if (selected("compiler/stack")) bench_compiler(source, megabytes[i], false);
+        if (selected("compiler/registers")) bench_compiler(source, megabytes[i], true);
+        free(source);
+    }
+
+    size_t loops[] = { 1000, 10000, 40000 };
+    for (size_t i = 0; i < sizeof(loops) / sizeof(loops[0]); i++) {
+        if (selected("loops/stack")) bench_loops(loops[i], false);
+        if (selected("loops/registers")) bench_loops(loops[i], true);
+    }
+
+    size_t keys[] = { 16, 256, 4096, 65536 };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        if (selected("table")) bench_table(keys[i]);
+    }
+
+    size_t globals[] = { 1, 16, 256, 4096, 65536 };
+    for (size_t i = 0; i < sizeof(globals) / sizeof(globals[0]); i++) {
+        if (selected("globals/stack")) bench_globals(globals[i], false);
+        if (selected("globals/registers")) bench_globals(globals[i], true);
+    }
+
+    size_t depths[] = { 1, 10, 100, 1000, 10000 };
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); i++) {
+        if (selected("calls/stack")) bench_calls(depths[i], false);
+        if (selected("calls/registers")) bench_calls(depths[i], true);
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,57 @@
+"""Measure how many lines per second OP_PRINT writes.
+
+Builds a release binary and times programs that print LINES lines of
+numbers, of strings and of both, with standard output going to a pipe
+that is drained as fast as possible. Reports the median of REPETITIONS
+runs in lines/sec for both backends.
+
+Usage: python bench/print.py [lines]
+"""
+import statistics
+import subprocess
+import sys
+import time
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parent.parent
+BUILD = ROOT / "bench" / "build"
+REPETITIONS = 5
+
+PROGRAMS = {
+    "numbers": "let i = 0;\nwhile (i < {lines}) {{\n    print i * 1.25;\n    i = i + 1;\n}}\n",
+    "strings": "let i = 0;\nwhile (i < {lines}) {{\n    print \"hello, world\";\n    i = i + 1;\n}}\n",
+    "mixed": "let i = 0;\nwhile (i < {lines}) {{\n    print i;\n    print \"x\";\n    i = i + 2;\n}}\n",
+}
+
+
+def build():
+    out = BUILD / "venom-print"
+    subprocess.run(["make", "-s", "release", f"OUT={out}"], cwd=ROOT, check=True)
+    return out
+
+
+def median_time(command):
+    timings = []
+    for _ in range(REPETITIONS):
+        start = time.perf_counter()
+        process = subprocess.run(command, stdout=subprocess.PIPE, check=True)
+        timings.append(time.perf_counter() - start)
+    return statistics.median(timings), process.stdout.count(b"\n")
+
+
+def main():
+    lines = int(sys.argv[1]) if len(sys.argv) > 1 else 1_000_000
+    BUILD.mkdir(exist_ok=True)
+    binary = build()
+
+    print(f"{'program':<12}{'backend':<12}{'lines':>10}{'Mlines/s':>12}")
+    for name, template in PROGRAMS.items():
+        program = BUILD / f"print-{name}.vnm"
+        program.write_text(template.format(lines=lines))
+        for backend, flags in (("stack", []), ("registers", ["--registers"])):
+            seconds, printed = median_time([binary, *flags, "--no-cache", program])
+            print(f"{name:<12}{backend:<12}{printed:>10}{printed / seconds / 1e6:>12.2f}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,40 @@
+/* Runs a command and prints its peak resident set size in kilobytes
+ * to stderr as "peak rss: N", exiting with the command's status.
+ *
+ * bench/run.py can't read this from the rusage of its own children:
+ * Linux carries the peak RSS of a process across fork and exec, so a
+ * child of the Python interpreter never reports less than the
+ * interpreter itself. The child forked here starts from this small
+ * process instead.
+ *
+ * Usage: rss command [args ...] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s command [args ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        execvp(argv[1], &argv[1]);
+        perror(argv[1]);
+        _exit(127);
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "peak rss: %ld\n", usage.ru_maxrss);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
\ No newline at end of file
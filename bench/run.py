@@ -0,0 +1,133 @@
+"""Time the programs under bench/programs/ and compare with a baseline.
+
+Every program is run with both backends from a release build: WARMUP
+times untimed, then REPETITIONS times, reporting the median wall time,
+the peak resident set size (measured by bench/rss.c), and
+instructions/sec, where the number of instructions comes from a build
+that counts them (see dispatch.py).
+The results are compared with bench/baseline.json, and a time or a
+peak RSS more than THRESHOLD above the baseline is flagged (the RSS
+only if it also grew by more than RSS_SLACK_KB, as it varies by a few
+pages from run to run). The
+baseline is only meaningful on the machine that recorded it.
+
+Usage: python bench/run.py [--update] [program.vnm ...]
+  --update  write the results to the baseline instead
+"""
+import json
+import os
+import statistics
+import subprocess
+import sys
+import time
+from pathlib import Path
+
+from dispatch import BUILD, ROOT, build, count_instructions
+
+BASELINE = ROOT / "bench" / "baseline.json"
+WARMUP = 2
+REPETITIONS = 10
+THRESHOLD = 0.10
+RSS_SLACK_KB = 512
+
+BACKENDS = {
+    "stack": [],
+    "registers": ["--registers"],
+}
+
+
+def build_rss():
+    out = BUILD / "rss"
+    subprocess.run(
+        ["cc", "-O2", ROOT / "bench" / "rss.c", "-o", out], check=True
+    )
+    return out
+
+
+def measure(rss, binary, flags, program):
+    # Returns the wall time in seconds and the peak RSS in kilobytes
+    # of one run, which writes its output to /dev/null.
+    start = time.perf_counter()
+    process = subprocess.run(
+        [rss, binary, *flags, "--no-cache", program],
+        stdout=subprocess.DEVNULL,
+        stderr=subprocess.PIPE,
+        text=True,
+    )
+    elapsed = time.perf_counter() - start
+    if process.returncode != 0:
+        sys.stderr.write(process.stderr)
+        raise RuntimeError(f"{program.name} failed with status {process.returncode}")
+    for line in process.stderr.splitlines():
+        if line.startswith("peak rss:"):
+            return elapsed, int(line.split(":")[1])
+    raise RuntimeError(f"no peak RSS for {program.name}")
+
+
+def benchmark(rss, binary, counter, flags, program):
+    for _ in range(WARMUP):
+        measure(rss, binary, flags, program)
+    runs = [measure(rss, binary, flags, program) for _ in range(REPETITIONS)]
+    seconds = statistics.median(run[0] for run in runs)
+    return {
+        "seconds": seconds,
+        "rss_kb": statistics.median_high(run[1] for run in runs),
+        "instructions": count_instructions(counter, program, [*flags, "--no-cache"]),
+    }
+
+
+def change(result, baseline, key, slack=0):
+    # The relative change from the baseline, as text, flagged if it is
+    # a regression.
+    if baseline is None or not baseline.get(key):
+        return "", False
+    ratio = result[key] / baseline[key] - 1
+    worse = ratio > THRESHOLD and result[key] - baseline[key] > slack
+    return f"{ratio:+.1%}", worse
+
+
+def main():
+    args = sys.argv[1:]
+    update = "--update" in args
+    programs = [Path(p) for p in args if p != "--update"]
+    if not programs:
+        programs = sorted((ROOT / "bench" / "programs").glob("*.vnm"))
+
+    BUILD.mkdir(exist_ok=True)
+    binary = build("bench", "-O2")
+    counter = build("count", "-O2 -Dvenom_count_instructions")
+    rss = build_rss()
+    baseline = json.loads(BASELINE.read_text()) if BASELINE.exists() else {}
+
+    results = {}
+    regressions = []
+    print(
+        f"{'program':<24}{'median ms':>10}{'change':>9}"
+        f"{'Mi/s':>9}{'peak RSS KB':>13}{'change':>9}"
+    )
+    for program in programs:
+        for backend, flags in BACKENDS.items():
+            name = f"{program.stem}/{backend}"
+            result = benchmark(rss, binary, counter, flags, program)
+            results[name] = result
+            time_change, slower = change(result, baseline.get(name), "seconds")
+            rss_change, bigger = change(result, baseline.get(name), "rss_kb", RSS_SLACK_KB)
+            if slower or bigger:
+                regressions.append(name)
+            print(
+                f"{name:<24}{result['seconds'] * 1000:>10.1f}{time_change:>9}"
+                f"{result['instructions'] / result['seconds'] / 1e6:>9.1f}"
+                f"{result['rss_kb']:>13}{rss_change:>9}"
+                + ("  REGRESSION" if slower or bigger else "")
+            )
+
+    if update:
+        baseline.update(results)
+        BASELINE.write_text(json.dumps(baseline, indent=2, sort_keys=True) + "\n")
+        print(f"wrote {BASELINE.relative_to(ROOT)}")
+    elif regressions:
+        print(f"{len(regressions)} regression(s) over {THRESHOLD:.0%}: {', '.join(regressions)}")
+
+
+if __name__ == "__main__":
+    main()
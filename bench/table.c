@@ -0,0 +1,188 @@
+/* Compares the open-addressing table in src/table.c with the chained
+ * table it replaced, which is reproduced below as it was: 1024 fixed
+ * buckets, a malloc'd node and an owned key per insert, and a full
+ * strcmp per node on lookup.
+ *
+ * For each table size, both tables get the same keys ("name0",
+ * "name1", ...) inserted once and then looked up ROUNDS times, half
+ * of the lookups hitting and half missing. Reports ns per insert
+ * and per lookup.
+ *
+ * The new table is keyed by interned strings, which the compiler
+ * interns once per name, so its keys are interned before the clock
+ * starts. The last column is the cost of that: interning a string
+ * that is already in the intern table.
+ *
+ * Usage: make table-bench */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../src/gc.h"
+#include "../src/table.h"
+
+#define ROUNDS 20
+
+typedef struct Bucket {
+    char *key;
+    Object obj;
+    struct Bucket *next;
+} Bucket;
+
+typedef struct {
+    Bucket *data[1024];
+} ChainedTable;
+
+static uint32_t chained_hash(const char *key, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static Object *chained_find(Bucket *head, const char *key) {
+    while (head != NULL) {
+        if (strcmp(head->key, key) == 0) return &head->obj;
+        head = head->next;
+    }
+    return NULL;
+}
+
+static void chained_insert(ChainedTable *table, const char *key, Object obj) {
+    char *k = malloc(strlen(key) + 1);
+    strcpy(k, key);
+    int index = chained_hash(k, strlen(k)) % 1024;
+    Object *existing = chained_find(table->data[index], k);
+    if (existing != NULL) {
+        *existing = obj;
+        free(k);
+        return;
+    }
+    Bucket *node = malloc(sizeof(Bucket));
+    node->key = k;
+    node->obj = obj;
+    node->next = NULL;
+    Bucket **tail = &table->data[index];
+    while (*tail != NULL) tail = &(*tail)->next;
+    *tail = node;
+}
+
+static Object *chained_get(ChainedTable *table, const char *key) {
+    int index = chained_hash(key, strlen(key)) % 1024;
+    return chained_find(table->data[index], key);
+}
+
+static void chained_free(ChainedTable *table) {
+    for (size_t i = 0; i < 1024; i++) {
+        Bucket *head = table->data[i];
+        while (head != NULL) {
+            Bucket *next = head->next;
+            free(head->key);
+            free(head);
+            head = next;
+        }
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char **make_keys(size_t count, const char *prefix) {
+    char **keys = malloc(sizeof(char *) * count);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = malloc(32);
+        snprintf(keys[i], 32, "%s%zu", prefix, i);
+    }
+    return keys;
+}
+
+static void free_keys(char **keys, size_t count) {
+    for (size_t i = 0; i < count; i++) free(keys[i]);
+    free(keys);
+}
+
+int main(void) {
+    size_t sizes[] = { 16, 256, 4096, 65536 };
+    printf("%8s %18s %18s %18s %18s %18s\n", "keys",
+        "chained insert ns", "open insert ns", "chained get ns", "open get ns", "intern ns");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t count = sizes[s];
+        char **hits = make_keys(count, "name");
+        char **misses = make_keys(count, "other");
+
+        ChainedTable *chained = calloc(1, sizeof(ChainedTable));
+        double start = now();
+        for (size_t i = 0; i < count; i++) chained_insert(chained, hits[i], AS_NUM(i));
+        double chained_insert_ns = (now() - start) / count;
+
+        /* Counting the hits checks the tables and keeps the lookups
+         * from being optimized away. */
+        size_t chained_found = 0;
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (size_t i = 0; i < count; i++) {
+                chained_found += chained_get(chained, hits[i]) != NULL;
+                chained_found += chained_get(chained, misses[i]) != NULL;
+            }
+        }
+        double chained_get_ns = (now() - start) / (2.0 * count * ROUNDS);
+
+        Heap heap;
+        init_heap(&heap, &DEFAULT_GC_OPTIONS);
+        String **hit_strings = malloc(sizeof(String *) * count);
+        String **miss_strings = malloc(sizeof(String *) * count);
+        for (size_t i = 0; i < count; i++) {
+            hit_strings[i] = intern_string(&heap, hits[i], strlen(hits[i]));
+            miss_strings[i] = intern_string(&heap, misses[i], strlen(misses[i]));
+        }
+
+        Table table = {0};
+        start = now();
+        for (size_t i = 0; i < count; i++) table_insert(&table, hit_strings[i], AS_NUM(i));
+        double open_insert_ns = (now() - start) / count;
+
+        size_t open_found = 0;
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (size_t i = 0; i < count; i++) {
+                open_found += table_get(&table, hit_strings[i]) != NULL;
+                open_found += table_get(&table, miss_strings[i]) != NULL;
+            }
+        }
+        double open_get_ns = (now() - start) / (2.0 * count * ROUNDS);
+
+        size_t interned = 0;
+        start = now();
+        for (int r = 0; r < ROUNDS; r++) {
+            for (size_t i = 0; i < count; i++) {
+                interned += intern_string(&heap, hits[i], strlen(hits[i])) == hit_strings[i];
+            }
+        }
+        double intern_ns = (now() - start) / ((double)count * ROUNDS);
+
+        if (chained_found != count * ROUNDS || open_found != count * ROUNDS || interned != count * ROUNDS) {
+            fprintf(stderr, "lookup mismatch with %zu keys\n", count);
+            return 1;
+        }
+
+        printf("%8zu %18.1f %18.1f %18.1f %18.1f %18.1f\n", count,
+            chained_insert_ns, open_insert_ns, chained_get_ns, open_get_ns, intern_ns);
+
+        chained_free(chained);
+        free(chained);
+        table_free(&table);
+        free_heap(&heap);
+        free(hit_strings);
+        free(miss_strings);
+        free_keys(hits, count);
+        free_keys(misses, count);
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+/* Measures the throughput of the tokenizer on a generated script.
+ *
+ * The script is built in memory by repeating a handful of statement
+ * templates (declarations, arithmetic, calls, loops, string literals)
+ * with varying names and numbers until it reaches the requested size,
+ * then tokenized ROUNDS times. Reports the best round in tokens per
+ * second and megabytes per second.
+ *
+ * Usage: make tokenizer-bench [MB=8] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/tokenizer.h"
+
+#define ROUNDS 5
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char *generate(size_t size, size_t *length) {
+    char *source = malloc(size + 256 + TOKENIZER_PADDING);
+    size_t count = 0;
+    for (size_t i = 0; count < size; i++) {
+        switch (i % 6) {
+            case 0:
+                count += sprintf(source + count, "let counter_%zu = %zu;\n", i % 1000, i);
+                break;
+            case 1:
+                count += sprintf(source + count,
+                    "fn helper_%zu(left, right) {\n    return left * %zu.25 + right / 3;\n}\n",
+                    i % 1000, i % 97);
+                break;
+            case 2:
+                count += sprintf(source + count,
+                    "while (counter_%zu < %zu) {\n    counter_%zu = counter_%zu + 1;\n}\n",
+                    i % 1000, i % 50, i % 1000, i % 1000);
+                break;
+            case 3:
+                count += sprintf(source + count,
+                    "if (counter_%zu >= 10 && counter_%zu != 20) {\n    print \"a string literal number %zu\";\n} else {\n    print null;\n}\n",
+                    i % 1000, i % 1000, i);
+                break;
+            case 4:
+                count += sprintf(source + count,
+                    "print helper_%zu(counter_%zu, 3.14159) %% 7;\n", i % 1000, i % 1000);
+                break;
+            case 5:
+                count += sprintf(source + count, "const limit_%zu = %zu;\n", i, i * 31);
+                break;
+        }
+    }
+    memset(source + count, '\0', TOKENIZER_PADDING);
+    *length = count;
+    return source;
+}
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+    size_t length;
+    char *source = generate(megabytes << 20, &length);
+
+    double best = 0;
+    size_t tokens = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        Tokenizer tokenizer;
+        init_tokenizer(&tokenizer, source);
+        size_t count = 0;
+        double start = now();
+        while (get_token(&tokenizer).type != TOKEN_EOF) {
+            count++;
+        }
+        double elapsed = now() - start;
+        if (r == 0 || elapsed < best) best = elapsed;
+        tokens = count;
+    }
+
+    printf("%.1f MB, %zu tokens\n", length / 1048576.0, tokens);
+    printf("%.2f ns/token, %.1f M tokens/s, %.1f MB/s\n",
+        best / tokens, tokens / best * 1e3, length / 1048576.0 / (best / 1e9));
+
+    free(source);
+    return 0;
+}
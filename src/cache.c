@@ -0,0 +1,362 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.h"
+#include "cfg.h"
+#include "gc.h"
+#include "regcompiler.h"
+
+_Static_assert(sizeof(CacheHeader) % sizeof(double) == 0, "the constant pools must be aligned");
+_Static_assert(sizeof(CacheCode) % sizeof(double) == 0, "the constant pools must be aligned");
+
+char *cache_path(const char *path, bool registers) {
+    const char *suffix = registers ? "rc" : "c";
+    size_t length = strlen(path);
+    char *cache = malloc(length + strlen(suffix) + 1);
+    memcpy(cache, path, length);
+    strcpy(cache + length, suffix);
+    return cache;
+}
+
+static uint64_t hash_bytes(const char *source, size_t length) {
+    /* FNV-1a over 8-byte words, with the high half folded into the
+     * low one after every step, since the multiplication only carries
+     * upwards. This only has to notice that a script or a cache has
+     * changed, and it runs over both of them on every start. */
+    uint64_t hash = 14695981039346656037u ^ length;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, source + i, 8);
+        hash = (hash ^ word) * 1099511628211u;
+        hash ^= hash >> 32;
+    }
+    for (; i < length; i++) {
+        hash = (hash ^ (uint8_t)source[i]) * 1099511628211u;
+    }
+    return hash;
+}
+
+CacheHeader cache_key(const char *source, size_t length, bool registers) {
+    return (CacheHeader){
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .registers = registers,
+        .source_hash = hash_bytes(source, length),
+        .source_length = length,
+    };
+}
+
+static String *read_string(Heap *heap, const char **cursor, const char *end) {
+    /* Returns NULL if the file ends first. */
+    uint32_t length;
+    if (end - *cursor < (long)sizeof(length)) return NULL;
+    memcpy(&length, *cursor, sizeof(length));
+    *cursor += sizeof(length);
+    if ((size_t)(end - *cursor) < length) return NULL;
+    String *string = intern_string(heap, *cursor, length);
+    *cursor += length;
+    return string;
+}
+
+static bool read_strings(Heap *heap, const char **cursor, const char *end, uint32_t count, String_DynArray *strings) {
+    for (uint32_t i = 0; i < count; i++) {
+        String *string = read_string(heap, cursor, end);
+        if (string == NULL) return false;
+        dynarray_insert(strings, string);
+    }
+    return true;
+}
+
+static CodeObject *code_object(const BytecodeChunk *chunk, size_t index) {
+    /* The code objects in the order the file has them. */
+    return index == 0 ? (CodeObject *)&chunk->main : chunk->functions.data[index-1];
+}
+
+static bool valid_operands(const BytecodeChunk *chunk, const CodeObject *code, const Instruction *instruction, bool registers) {
+    /* Whether the operands index into the tables that they refer to.
+     * Jumps are checked by the caller. */
+    const uint32_t *operands = instruction->operands;
+    uint32_t strings = chunk->sp.count;
+    uint32_t globals = chunk->global_names.count;
+    uint32_t caches = chunk->caches.count;
+    uint32_t functions = chunk->functions.count;
+    if (!registers) {
+        switch (instruction->op) {
+            case OP_CONST: return operands[0] < code->cp.count;
+            case OP_STR: return operands[0] < strings;
+            case OP_SET_GLOBAL:
+            case OP_GET_GLOBAL: return operands[0] < globals;
+            case OP_DEEP_SET:
+            case OP_DEEP_GET: return operands[0] < code->max_stack;
+            case OP_FUNC: return operands[0] < globals && operands[1] < functions;
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE: return operands[0] < globals && operands[2] < caches;
+            default: return true;
+        }
+    }
+
+    /* Every register has to be in the frame, which is what makes the
+     * VM reserve room for it. A call's other 'b' operands are the base
+     * and the count of its arguments, which may end the frame. */
+    const char *format = reg_operand_format(instruction->op);
+    bool call = instruction->op == ROP_CALL || instruction->op == ROP_TAILCALL;
+    for (int i = 0; !call && format[i] != '\0'; i++) {
+        if (format[i] == 'b' && operands[i] >= code->max_stack) {
+            return false;
+        }
+    }
+    switch (instruction->op) {
+        case ROP_LOADK: return operands[1] < code->cp.count;
+        case ROP_LOADS: return operands[1] < strings;
+        case ROP_GETG: return operands[1] < globals;
+        case ROP_SETG: return operands[0] < globals;
+        case ROP_FUNC: return operands[0] < globals && operands[1] < functions;
+        case ROP_CALL:
+            return operands[0] < code->max_stack && operands[1] < globals
+                && operands[2] + operands[3] <= code->max_stack && operands[4] < caches;
+        case ROP_TAILCALL:
+            return operands[0] < globals && operands[1] + operands[2] <= code->max_stack && operands[3] < caches;
+        default: return true;
+    }
+}
+
+static bool valid_code(const BytecodeChunk *chunk, const CodeObject *code, bool registers) {
+    /* Whether the code only has whole instructions with valid operands,
+     * jumps only to the start of an instruction, and ends with one that
+     * doesn't fall through, so the VM can run it without bounds checks. */
+    uint8_t wide = registers ? ROP_WIDE : OP_WIDE;
+    uint8_t last = registers ? ROP_EXIT : OP_EXIT;
+    size_t length = code->code.count;
+    if (length == 0 || code->paramcount > code->max_stack) {
+        return false;
+    }
+    bool *starts = calloc(length + 1, sizeof(bool));
+    long *targets = malloc(sizeof(long) * length);
+    size_t target_count = 0;
+    Instruction instruction = {0};
+    bool ok = true;
+    for (size_t offset = 0; ok && offset < length;) {
+        const uint8_t *ip = &code->code.data[offset];
+        starts[offset] = true;
+        instruction.wide = ip[0] == wide;
+        int prefix = instruction.wide ? 1 : 0;
+        if (offset + prefix >= length || ip[prefix] > last || ip[prefix] == wide) {
+            ok = false;
+            break;
+        }
+        instruction.op = ip[prefix];
+        const char *format = registers ? reg_operand_format(instruction.op) : operand_format(instruction.op);
+        size_t size = prefix + 1 + operands_length(format, instruction.wide);
+        if (size > length - offset) {
+            ok = false;
+            break;
+        }
+        read_operands(format, instruction.wide, &ip[prefix + 1], instruction.operands);
+        offset += size;
+        ok = valid_operands(chunk, code, &instruction, registers);
+
+        /* Jump offsets are relative to the end of the jump. */
+        const char *jump = strchr(format, 'j');
+        if (jump != NULL) {
+            targets[target_count++] = (long)offset + (int32_t)instruction.operands[jump - format];
+        }
+    }
+    for (size_t i = 0; ok && i < target_count; i++) {
+        ok = targets[i] >= 0 && targets[i] < (long)length && starts[targets[i]];
+    }
+    if (ok) {
+        ok = registers
+            ? instruction.op == ROP_EXIT || instruction.op == ROP_RET
+                || instruction.op == ROP_JMP || instruction.op == ROP_TAILCALL
+            : instruction.op == OP_EXIT || instruction.op == OP_RET
+                || instruction.op == OP_JMP || instruction.op == OP_TAIL_INVOKE;
+    }
+    free(targets);
+    free(starts);
+    return ok;
+}
+
+bool load_cache(const char *path, const CacheHeader *key, bool verify, BytecodeChunk *chunk) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    char *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+
+    /* A stale cache is told apart by its header, and a damaged one
+     * by the hash of the rest. */
+    CacheHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    size_t count = (size_t)header.function_count + 1;
+    if (header.magic != key->magic
+            || header.version != key->version
+            || header.registers != key->registers
+            || header.source_hash != key->source_hash
+            || header.source_length != key->source_length
+            || (size - sizeof(header)) / sizeof(CacheCode) < count
+            || hash_bytes(mapping + sizeof(header), size - sizeof(header)) != header.payload_hash) {
+        munmap(mapping, size);
+        return false;
+    }
+    const CacheCode *records = (const CacheCode *)(mapping + sizeof(header));
+    size_t fixed = sizeof(header) + count * sizeof(CacheCode);
+    for (size_t i = 0; i < count; i++) {
+        fixed += (size_t)records[i].constant_count * sizeof(double) + records[i].code_length;
+    }
+    if (fixed > size) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    /* The code and the constants are used where they are. Only the
+     * strings need fixing up, since they have to be interned, and the
+     * inline caches, which the VM writes to. */
+    chunk->mapping = mapping;
+    chunk->mapping_size = size;
+    for (size_t i = 1; i < count; i++) {
+        add_function(chunk, NULL, 0);
+    }
+    const char *cursor = (const char *)&records[count];
+    for (size_t i = 0; i < count; i++) {
+        CodeObject *code = code_object(chunk, i);
+        code->paramcount = records[i].paramcount;
+        code->max_stack = records[i].max_stack;
+        code->cp.data = (double *)cursor;
+        code->cp.count = code->cp.capacity = records[i].constant_count;
+        cursor += (size_t)records[i].constant_count * sizeof(double);
+    }
+    for (size_t i = 0; i < count; i++) {
+        CodeObject *code = code_object(chunk, i);
+        code->code.data = (uint8_t *)cursor;
+        code->code.count = code->code.capacity = records[i].code_length;
+        cursor += records[i].code_length;
+    }
+
+    const char *end = mapping + size;
+    bool ok = read_strings(chunk->heap, &cursor, end, header.string_count, &chunk->sp)
+        && read_strings(chunk->heap, &cursor, end, header.global_count, &chunk->global_names);
+    for (size_t i = 1; ok && i < count; i++) {
+        code_object(chunk, i)->name = read_string(chunk->heap, &cursor, end);
+        ok = code_object(chunk, i)->name != NULL;
+    }
+    for (uint32_t i = 0; ok && i < header.cache_count; i++) {
+        add_cache(chunk);
+    }
+    /* The hash does not stop a file that was made to match it, so the
+     * operands are always checked against the tables and pools they
+     * index. Working out how deep the stack gets is the slow part, so
+     * that is only done when asked for. */
+    for (size_t i = 0; ok && i < count; i++) {
+        ok = valid_code(chunk, code_object(chunk, i), key->registers)
+            && (!verify || key->registers || check_stack(code_object(chunk, i)));
+    }
+    if (!ok) {
+        Heap *heap = chunk->heap;
+        free_chunk(chunk);
+        init_chunk(chunk, heap);
+        return false;
+    }
+    return true;
+}
+
+/* The cache is put together in memory, so that the hash of the part
+ * after the header can go into the header before it is written. */
+typedef DynArray(char) Buffer;
+
+static void append(Buffer *buffer, const void *data, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (buffer->count + length > buffer->capacity) {
+        buffer->capacity = (buffer->count + length) * 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->count, data, length);
+    buffer->count += length;
+}
+
+static void append_string(Buffer *buffer, const String *string) {
+    uint32_t length = string->length;
+    append(buffer, &length, sizeof(length));
+    append(buffer, string->chars, length);
+}
+
+static void append_strings(Buffer *buffer, const String_DynArray *strings) {
+    for (size_t i = 0; i < strings->count; i++) {
+        append_string(buffer, strings->data[i]);
+    }
+}
+
+static void append_code_objects(Buffer *buffer, const BytecodeChunk *chunk) {
+    /* The descriptions of all of them first, then their constants,
+     * then their code. */
+    size_t count = chunk->functions.count + 1;
+    for (size_t i = 0; i < count; i++) {
+        const CodeObject *code = code_object(chunk, i);
+        CacheCode record = {
+            .code_length = code->code.count,
+            .constant_count = code->cp.count,
+            .paramcount = code->paramcount,
+            .max_stack = code->max_stack,
+        };
+        append(buffer, &record, sizeof(record));
+    }
+    for (size_t i = 0; i < count; i++) {
+        const CodeObject *code = code_object(chunk, i);
+        append(buffer, code->cp.data, sizeof(double) * code->cp.count);
+    }
+    for (size_t i = 0; i < count; i++) {
+        const CodeObject *code = code_object(chunk, i);
+        append(buffer, code->code.data, code->code.count);
+    }
+}
+
+void write_cache(const char *path, const CacheHeader *key, const BytecodeChunk *chunk) {
+    CacheHeader header = *key;
+    header.function_count = chunk->functions.count;
+    header.string_count = chunk->sp.count;
+    header.global_count = chunk->global_names.count;
+    header.cache_count = chunk->caches.count;
+
+    Buffer buffer = {0};
+    append(&buffer, &header, sizeof(header));
+    append_code_objects(&buffer, chunk);
+    append_strings(&buffer, &chunk->sp);
+    append_strings(&buffer, &chunk->global_names);
+    for (size_t i = 0; i < chunk->functions.count; i++) {
+        append_string(&buffer, chunk->functions.data[i]->name);
+    }
+    header.payload_hash = hash_bytes(buffer.data + sizeof(header), buffer.count - sizeof(header));
+    memcpy(buffer.data, &header, sizeof(header));
+
+    /* The cache is written to a file of its own first, and then
+     * renamed over the old one. */
+    size_t length = strlen(path) + 32;
+    char *temporary = malloc(length);
+    snprintf(temporary, length, "%s.%ld", path, (long)getpid());
+    FILE *file = fopen(temporary, "wb");
+    if (file != NULL) {
+        bool ok = fwrite(buffer.data, 1, buffer.count, file) == buffer.count;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(temporary, path) != 0) {
+            remove(temporary);
+        }
+    }
+    free(temporary);
+    dynarray_free(&buffer);
+}
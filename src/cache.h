@@ -0,0 +1,72 @@
+#ifndef venom_cache_h
+#define venom_cache_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "compiler.h"
+
+/* A compiled script is cached next to it, in a file named after the
+ * script with a 'c' appended for stack bytecode (example.vnm ->
+ * example.vnmc) and 'rc' for register bytecode (example.vnmrc), so
+ * that later runs of either backend can skip the front end. The file is a CacheHeader, then a
+ * CacheCode for every code object (the top level first, and then the
+ * functions in order), then the constant pools of all of them, then
+ * their code, and then the characters of the strings in the string
+ * pool, the names of the globals and the names of the functions, each
+ * preceded by its 4-byte length. Everything is in the byte order of
+ * the machine that wrote it, which the magic number checks.
+ *
+ * A cache is only used for the source it was made from, as told by
+ * the hash and the length of the source, for the backend it was made
+ * for, and by a build that reads the same version of the format. The
+ * header also has a hash of everything after it, which is checked on
+ * every load, as is every operand of the code against the tables it
+ * indexes, so that a damaged cache is rebuilt rather than run. Checking
+ * that stack bytecode stays within the stack its code objects reserve
+ * is only done when asked for (--verify-cache). */
+#define CACHE_MAGIC 0x434d4e56  /* "VNMC" read as a little-endian word */
+#define CACHE_VERSION 3  /* bump this whenever the bytecode changes */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t registers;  /* register bytecode rather than stack bytecode */
+    uint32_t function_count;
+    uint64_t source_hash;
+    uint64_t source_length;
+    uint64_t payload_hash;
+    uint32_t string_count;
+    uint32_t global_count;
+    uint32_t cache_count;
+    uint32_t padding;  /* keeps the constants aligned */
+} CacheHeader;
+
+typedef struct {
+    uint32_t code_length;
+    uint32_t constant_count;
+    uint32_t paramcount;
+    uint32_t max_stack;
+} CacheCode;
+
+/* Returns the path of the cache for the script at 'path' and the
+ * given backend, which the caller frees. */
+char *cache_path(const char *path, bool registers);
+
+/* Returns the header that a cache of the given source has to have.
+ * The counts are filled in by write_cache. */
+CacheHeader cache_key(const char *source, size_t length, bool registers);
+
+/* Loads the chunk in the cache at 'path' into 'chunk', which must be
+ * empty, if the cache exists, matches 'key' and is intact, and, with
+ * 'verify', if its stack code stays within its stack. The code and
+ * the constants stay in the mapped file, which free_chunk unmaps.
+ * Returns false if there is no usable cache, leaving 'chunk' empty. */
+bool load_cache(const char *path, const CacheHeader *key, bool verify, BytecodeChunk *chunk);
+
+/* Writes 'chunk' to the cache at 'path', replacing any cache that is
+ * there in one step, so that a concurrent run never sees half a file.
+ * A cache that cannot be written is simply not written. */
+void write_cache(const char *path, const CacheHeader *key, const BytecodeChunk *chunk);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,479 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cfg.h"
+#include "compiler.h"
+#include "dynarray.h"
+
+/* The code is decoded into a list of instructions in which every
+ * jump refers to its target by the index of the target instruction
+ * rather than by a byte offset. That way, the
+ * instructions can be moved around and deleted freely, and the
+ * offsets are computed once, when the list is encoded again. */
+typedef struct {
+    Instruction instruction;
+    int target;  /* jump target, or -1 */
+    int sources;  /* how many jumps target it, kept up to date by invert_loops only */
+} Node;
+
+typedef DynArray(Node) Node_DynArray;
+
+static bool is_jump(uint8_t op) {
+    return op == OP_JMP || op == OP_JZ || op == OP_JNZ;
+}
+
+static bool falls_through(uint8_t op) {
+    return op != OP_JMP && op != OP_RET && op != OP_TAIL_INVOKE && op != OP_EXIT;
+}
+
+static Node jump(uint8_t op, int target) {
+    return (Node){ .instruction = { .op = op }, .target = target };
+}
+
+static int instruction_length(Instruction *instruction) {
+    int prefix = instruction->wide ? 1 : 0;
+    return prefix + 1 + operands_length(operand_format(instruction->op), instruction->wide);
+}
+
+static bool decode(CodeObject *bytecode, size_t start, Node_DynArray *code) {
+    /* Offsets below are relative to 'start'. */
+    size_t length = bytecode->code.count - start;
+    int *index_of = malloc(sizeof(int) * (length + 1));
+    for (size_t i = 0; i <= length; i++) {
+        index_of[i] = -1;
+    }
+
+    for (size_t offset = 0; offset < length;) {
+        Node node = { .target = -1 };
+        index_of[offset] = code->count;
+        offset += decode_instruction(&bytecode->code.data[start + offset], &node.instruction);
+        dynarray_insert(code, node);
+    }
+
+    /* Translate jump offsets (relative to the end of the jump) to
+     * instruction indices. */
+    bool ok = true;
+    size_t offset = 0;
+    for (size_t i = 0; i < code->count; i++) {
+        Instruction *instruction = &code->data[i].instruction;
+        offset += instruction_length(instruction);
+        if (!is_jump(instruction->op)) {
+            continue;
+        }
+        long target = (long)offset + (int32_t)instruction->operands[0];
+        if (target < 0 || target > (long)length || index_of[target] == -1) {
+            ok = false;
+        } else {
+            code->data[i].target = index_of[target];
+            code->data[index_of[target]].sources++;
+        }
+    }
+
+    free(index_of);
+    return ok;
+}
+
+static void encode(CodeObject *bytecode, size_t start, Node_DynArray *code) {
+    /* Every jump starts out in the narrow form, and the ones that turn
+     * out not to fit are widened, which moves the code after them,
+     * until the layout stops changing. Widening only ever makes the
+     * code longer, so this terminates. */
+    for (size_t i = 0; i < code->count; i++) {
+        if (is_jump(code->data[i].instruction.op)) {
+            code->data[i].instruction.wide = false;
+        }
+    }
+
+    int *offsets = malloc(sizeof(int) * (code->count + 1));
+    bool changed;
+    do {
+        offsets[0] = 0;
+        for (size_t i = 0; i < code->count; i++) {
+            offsets[i+1] = offsets[i] + instruction_length(&code->data[i].instruction);
+        }
+
+        changed = false;
+        for (size_t i = 0; i < code->count; i++) {
+            Instruction *instruction = &code->data[i].instruction;
+            if (!is_jump(instruction->op)) {
+                continue;
+            }
+            instruction->operands[0] = offsets[code->data[i].target] - offsets[i+1];
+            if (!instruction->wide && !operands_fit(operand_format(instruction->op), instruction->operands)) {
+                instruction->wide = true;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    bytecode->code.count = start;
+    for (size_t i = 0; i < code->count; i++) {
+        encode_instruction(&bytecode->code, &code->data[i].instruction);
+    }
+
+    free(offsets);
+}
+
+static bool invert_loop(Node_DynArray *code, int back_jump) {
+    /* The compiler emits a while loop as:
+     *
+     *     start: <condition>
+     *            OP_JZ exit
+     *            <body>
+     *            OP_JMP start
+     *     exit:
+     *
+     * which executes two jumps per iteration. We rotate it into:
+     *
+     *     start: OP_JMP test
+     *     body:  <body>
+     *     test:  <condition>
+     *            OP_JNZ body
+     *     exit:
+     *
+     * which has the same length and executes one. The condition must
+     * be straight-line code that nothing but the loop jumps into, and
+     * nothing outside of the loop may jump into the body, so that only
+     * the jumps inside of the loop have to be redirected. */
+    Node *data = code->data;
+    int start = data[back_jump].target;
+    int test_jump = -1;
+    for (int i = start; i < back_jump; i++) {
+        if (is_jump(data[i].instruction.op)) {
+            if (data[i].instruction.op == OP_JZ && data[i].target == back_jump + 1) {
+                test_jump = i;
+            }
+            break;
+        }
+    }
+    if (test_jump <= start) return false;
+    for (int i = start + 1; i <= test_jump; i++) {
+        if (data[i].sources > 0) return false;
+    }
+    int inner = 0, total = 0;
+    for (int i = start; i <= back_jump; i++) {
+        if (data[i].target > test_jump && data[i].target <= back_jump) inner++;
+        if (i > test_jump) total += data[i].sources;
+    }
+    if (inner != total) return false;
+
+    int condition_length = test_jump - start;
+    int body_length = back_jump - test_jump - 1;
+    int body = start + 1;
+    int test = body + body_length;
+
+    /* Redirect jumps into the loop before anything is moved: jumps
+     * to the start now enter through the new OP_JMP, and jumps to
+     * the old back jump (the end of the body) go to the test. The
+     * body keeps its own counts, as they move along with it. */
+    int entries = data[start].sources - 1;
+    int ends = data[back_jump].sources;
+    for (int i = start; i <= back_jump; i++) {
+        int target = data[i].target;
+        if (target > test_jump && target < back_jump) {
+            data[i].target = body + (target - test_jump - 1);
+        } else if (target == back_jump) {
+            data[i].target = test;
+        }
+    }
+
+    Node *condition = malloc(sizeof(Node) * condition_length);
+    memcpy(condition, &data[start], sizeof(Node) * condition_length);
+    memmove(&data[body], &data[test_jump + 1], sizeof(Node) * body_length);
+    memcpy(&data[test], condition, sizeof(Node) * condition_length);
+    free(condition);
+
+    data[start] = jump(OP_JMP, test);
+    data[start].sources = entries;
+    data[test].sources = ends + 1;
+    data[back_jump + 1].sources--;  /* the old OP_JZ is gone */
+    data[back_jump] = jump(OP_JNZ, body_length > 0 ? body : test);
+    data[data[back_jump].target].sources++;
+    return true;
+}
+
+static void invert_loops(Node_DynArray *code) {
+    /* An inner loop ends before the outer one, so it is rotated first,
+     * and rotating it doesn't move anything outside of it. */
+    for (int i = 0; i < (int)code->count; i++) {
+        if (code->data[i].instruction.op == OP_JMP && code->data[i].target < i) {
+            invert_loop(code, i);
+        }
+    }
+}
+
+static void thread_jumps(Node_DynArray *code) {
+    /* A jump to an unconditional jump can go straight to where that
+     * one leads. The hop limit guards against 'while (true) {}'. */
+    for (size_t i = 0; i < code->count; i++) {
+        if (!is_jump(code->data[i].instruction.op)) continue;
+        int target = code->data[i].target;
+        for (size_t hops = 0; code->data[target].instruction.op == OP_JMP && hops < code->count; hops++) {
+            target = code->data[target].target;
+        }
+        code->data[i].target = target;
+    }
+}
+
+static bool remove_dead_code(Node_DynArray *code) {
+    size_t count = code->count;
+    bool *live = calloc(count, sizeof(bool));
+    int *worklist = malloc(sizeof(int) * count);
+    int pending = 0;
+
+    /* Mark everything reachable from the start of the code. */
+    live[0] = true;
+    worklist[pending++] = 0;
+    while (pending > 0) {
+        int i = worklist[--pending];
+        int successors[2] = { -1, code->data[i].target };
+        if (falls_through(code->data[i].instruction.op) && i + 1 < (int)count) {
+            successors[0] = i + 1;
+        }
+        for (int j = 0; j < 2; j++) {
+            int s = successors[j];
+            if (s != -1 && !live[s]) {
+                live[s] = true;
+                worklist[pending++] = s;
+            }
+        }
+    }
+
+    /* A jump to the very next live instruction does nothing, except
+     * that a conditional one also pops the condition. */
+    for (size_t i = 0; i < count; i++) {
+        if (!live[i] || !is_jump(code->data[i].instruction.op)) continue;
+        size_t next = i + 1;
+        while (next < count && !live[next]) next++;
+        if ((size_t)code->data[i].target != next) continue;
+        if (code->data[i].instruction.op == OP_JMP) {
+            live[i] = false;
+        } else {
+            code->data[i] = (Node){ .instruction = { .op = OP_POP }, .target = -1 };
+        }
+    }
+
+    /* Number the surviving instructions. A deleted instruction is
+     * replaced by the first live one after it. */
+    int *index_of = malloc(sizeof(int) * (count + 1));
+    int kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (live[i]) kept++;
+    }
+    index_of[count] = kept;
+    for (size_t i = count; i > 0; i--) {
+        index_of[i-1] = live[i-1] ? --kept : index_of[i];
+    }
+
+    size_t j = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!live[i]) continue;
+        Node node = code->data[i];
+        if (node.target != -1) {
+            node.target = index_of[node.target];
+        }
+        code->data[j++] = node;
+    }
+    code->count = j;
+
+    free(index_of);
+    free(worklist);
+    free(live);
+    return j < count;
+}
+
+static int stack_effect(const Instruction *instruction) {
+    switch (instruction->op) {
+        case OP_CONST:
+        case OP_STR:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NULL:
+        case OP_GET_GLOBAL:
+        case OP_DEEP_GET:
+            return 1;
+        case OP_INVOKE:
+            return 1 - (int)instruction->operands[1];
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_JMP:
+        case OP_FUNC:
+        case OP_TAIL_INVOKE:
+        case OP_RET:
+        case OP_EXIT:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+static int stack_pops(const Instruction *instruction) {
+    /* How many values the instruction needs on the stack. */
+    switch (instruction->op) {
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return instruction->operands[1];
+        case OP_PRINT:
+        case OP_SET_GLOBAL:
+        case OP_DEEP_SET:
+        case OP_POP:
+        case OP_JZ:
+        case OP_JNZ:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_RET:
+            return 1;
+        default:
+            return stack_effect(instruction) == -1 ? 2 : 0;
+    }
+}
+
+/* Stops the depth of a loop that pushes more than it pops, which the
+ * search below would otherwise raise forever. */
+#define DEPTH_LIMIT 65535
+
+static uint32_t max_depth(Node_DynArray *code, uint32_t entry) {
+    /* Follows the control flow from the start of the code, where the
+     * arguments are on the stack already, recording the depth of the
+     * stack before each instruction. Where paths with different
+     * depths meet, the deeper one wins. */
+    size_t count = code->count;
+    long *depth = malloc(sizeof(long) * count);
+    bool *queued = calloc(count, sizeof(bool));
+    int *worklist = malloc(sizeof(int) * count);
+    int pending = 0;
+    for (size_t i = 0; i < count; i++) {
+        depth[i] = -1;
+    }
+
+    uint32_t max = entry;
+    if (count > 0) {
+        depth[0] = entry;
+        queued[0] = true;
+        worklist[pending++] = 0;
+    }
+    while (pending > 0) {
+        int i = worklist[--pending];
+        queued[i] = false;
+        long after = depth[i] + stack_effect(&code->data[i].instruction);
+        if (after < 0) after = 0;
+        if (after > DEPTH_LIMIT) after = DEPTH_LIMIT;
+        if (after > max) max = after;
+
+        int successors[2] = { -1, code->data[i].target };
+        if (falls_through(code->data[i].instruction.op) && i + 1 < (int)count) {
+            successors[0] = i + 1;
+        }
+        for (int j = 0; j < 2; j++) {
+            int s = successors[j];
+            if (s != -1 && after > depth[s]) {
+                depth[s] = after;
+                if (!queued[s]) {
+                    queued[s] = true;
+                    worklist[pending++] = s;
+                }
+            }
+        }
+    }
+
+    free(worklist);
+    free(queued);
+    free(depth);
+    return max;
+}
+
+void optimize_code(CodeObject *bytecode, size_t start) {
+    Node_DynArray code = {0};
+    if (decode(bytecode, start, &code)) {
+        invert_loops(&code);
+        /* Deleting a jump can turn the one before it into a jump to
+         * the next instruction, so we repeat until nothing changes. */
+        do {
+            thread_jumps(&code);
+        } while (remove_dead_code(&code));
+        encode(bytecode, start, &code);
+
+        uint32_t depth = max_depth(&code, bytecode->paramcount);
+        if (depth > bytecode->max_stack) {
+            bytecode->max_stack = depth;
+        }
+    }
+    dynarray_free(&code);
+}
+
+bool check_stack(CodeObject *bytecode) {
+    /* Like max_depth, but the depths before each instruction are kept
+     * as the range over all of the paths that reach it. The range only
+     * ever widens, and is bounded, so this terminates. */
+    Node_DynArray code = {0};
+    bool ok = decode(bytecode, 0, &code);
+    size_t count = code.count;
+    long *low = malloc(sizeof(long) * count);
+    long *high = malloc(sizeof(long) * count);
+    bool *queued = calloc(count, sizeof(bool));
+    int *worklist = malloc(sizeof(int) * count);
+    int pending = 0;
+    for (size_t i = 0; i < count; i++) {
+        low[i] = high[i] = -1;
+    }
+
+    if (ok && count > 0) {
+        low[0] = high[0] = bytecode->paramcount;
+        queued[0] = true;
+        worklist[pending++] = 0;
+    }
+    while (ok && pending > 0) {
+        int i = worklist[--pending];
+        queued[i] = false;
+        Instruction *instruction = &code.data[i].instruction;
+        int effect = stack_effect(instruction);
+        if (low[i] < stack_pops(instruction) || high[i] + effect > (long)bytecode->max_stack) {
+            ok = false;
+            break;
+        }
+
+        int successors[2] = { -1, code.data[i].target };
+        if (falls_through(instruction->op)) {
+            successors[0] = i + 1 < (int)count ? i + 1 : -1;
+            ok = i + 1 < (int)count;  /* it must not run off the end */
+        }
+        for (int j = 0; j < 2; j++) {
+            int s = successors[j];
+            if (s == -1) continue;
+            bool first = low[s] == -1;
+            bool changed = first || low[i] + effect < low[s] || high[i] + effect > high[s];
+            if (first || low[i] + effect < low[s]) low[s] = low[i] + effect;
+            if (first || high[i] + effect > high[s]) high[s] = high[i] + effect;
+            if (changed && !queued[s]) {
+                queued[s] = true;
+                worklist[pending++] = s;
+            }
+        }
+    }
+
+    free(worklist);
+    free(queued);
+    free(high);
+    free(low);
+    dynarray_free(&code);
+    return ok;
+}
+
+void remap_code(CodeObject *bytecode, OperandRemap remap, void *context) {
+    /* The passes above only look at the opcodes and the jumps, so
+     * remapping before or after them comes to the same code, once the
+     * widths of the instructions are chosen again. */
+    Node_DynArray code = {0};
+    if (decode(bytecode, 0, &code)) {
+        for (size_t i = 0; i < code.count; i++) {
+            Instruction *instruction = &code.data[i].instruction;
+            remap(instruction, context);
+            if (!is_jump(instruction->op)) {
+                instruction->wide = !operands_fit(operand_format(instruction->op), instruction->operands);
+            }
+        }
+        encode(bytecode, 0, &code);
+    }
+    dynarray_free(&code);
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef venom_cfg_h
+#define venom_cfg_h
+
+#include "compiler.h"
+
+/* Rewrites the control flow of a finished stack bytecode code object
+ * from offset 'start' on, which must not jump out of it: loops are
+ * inverted so that the condition is tested at the bottom, jumps to
+ * jumps are threaded, and jumps to the next instruction and unreachable
+ * code are removed. Then, the code is laid out again with every jump
+ * offset in the narrowest form it fits in. Finally, the deepest the
+ * new code takes the stack is folded into the code's max_stack. */
+void optimize_code(CodeObject *code, size_t start);
+
+/* Applies 'remap' to every instruction of a code object that has been
+ * optimized already, and lays it out again, exactly as optimize_code
+ * would have laid out the remapped code. */
+void remap_code(CodeObject *code, OperandRemap remap, void *context);
+
+/* Whether the code, whose jumps must all lead to the start of one of
+ * its instructions, never pops more than has been pushed in its frame
+ * nor goes deeper than its max_stack, on any path. That is what the
+ * compiler guarantees, and what code from elsewhere, such as a cache
+ * file, is checked for before it is run. */
+bool check_stack(CodeObject *code);
+
+#endif
\ No newline at end of file
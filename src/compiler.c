@@ -4,149 +4,364 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include "cfg.h"
 #include "compiler.h"
+#include "lazy.h"
 #include "vm.h"
 #include "util.h"
 
-#define venom_debug
-
-void init_compiler(Compiler *compiler) {
+void init_compiler(Compiler *compiler, Ast *ast, CodeObject *code) {
     memset(compiler, 0, sizeof(Compiler));
+    compiler->ast = ast;
+    compiler->code = code;
 }
 
-void init_chunk(BytecodeChunk *chunk) {
+void init_chunk(BytecodeChunk *chunk, Heap *heap) {
     memset(chunk, 0, sizeof(BytecodeChunk));
+    chunk->heap = heap;
+}
+
+static void free_code(BytecodeChunk *chunk, CodeObject *code) {
+    if (chunk->mapping == NULL) {
+        dynarray_free(&code->code);
+        dynarray_free(&code->cp);
+    }
+    free_constant_index(code);
+    free(code->op_counts);
 }
 
 void free_chunk(BytecodeChunk *chunk) {
-    dynarray_free(&chunk->code);
-    for (int i = 0; i < chunk->sp_count; i++) 
-        free(chunk->sp[i]);
+    free_code(chunk, &chunk->main);
+    for (size_t i = 0; i < chunk->functions.count; i++) {
+        free_code(chunk, chunk->functions.data[i]);
+        free(chunk->functions.data[i]);
+    }
+    dynarray_free(&chunk->functions);
+    if (chunk->mapping != NULL) {
+        munmap(chunk->mapping, chunk->mapping_size);
+    }
+    dynarray_free(&chunk->sp);
+    table_free(&chunk->sp_indices);
+    table_free(&chunk->globals);
+    dynarray_free(&chunk->global_names);
+    dynarray_free(&chunk->caches);
+}
+
+String *intern(BytecodeChunk *chunk, Slice string) {
+    /* Names and string literals point into the source, so this is
+     * the only place their characters are ever copied. */
+    return intern_string(chunk->heap, string.start, string.length);
 }
 
-static uint8_t add_string(BytecodeChunk *chunk, const char *string) {
+uint32_t add_string(BytecodeChunk *chunk, Slice string) {
     /* Check if the string is already present in the pool. */
-    for (uint8_t i = 0; i < chunk->sp_count; i++) {
+    String *s = intern(chunk, string);
+    Object *index = table_get(&chunk->sp_indices, s);
+    if (index != NULL) {
         /* If it is, return the index. */
-        if (strcmp(chunk->sp[i], string) == 0) {
-            return i;
+        return (uint32_t)NUM_VAL(*index);
+    }
+    /* Otherwise, insert the string into the pool and return
+     * the index. The string belongs to the heap. */
+    table_insert(&chunk->sp_indices, s, AS_NUM(chunk->sp.count));
+    dynarray_insert(&chunk->sp, s);
+    return chunk->sp.count - 1;
+}
+
+static uint64_t double_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static uint32_t *find_constant(const CodeObject *code, uint64_t bits) {
+    /* Returns the bucket of the constant with these bits, or the empty
+     * one where it would be inserted, probing linearly as in table.c.
+     * Constants are told apart by their bits rather than with '==',
+     * so that -0.0 and 0.0 stay apart. */
+    size_t mask = code->cp_index_capacity - 1;
+    uint64_t hash = bits ^ (bits >> 29) ^ (bits >> 47);
+    for (size_t index = hash & mask;; index = (index + 1) & mask) {
+        uint32_t *bucket = &code->cp_index[index];
+        if (*bucket == 0 || double_bits(code->cp.data[*bucket - 1]) == bits) {
+            return bucket;
+        }
+    }
+}
+
+static void grow_constant_index(CodeObject *code) {
+    /* The index is rebuilt from the pool, which is also how it is made
+     * for a pool that has none yet. */
+    free(code->cp_index);
+    size_t capacity = code->cp_index_capacity == 0 ? 8 : code->cp_index_capacity * 2;
+    while ((code->cp.count + 1) * 4 > capacity * 3) {
+        capacity *= 2;
+    }
+    code->cp_index_capacity = capacity;
+    code->cp_index = calloc(capacity, sizeof(uint32_t));
+    for (size_t i = 0; i < code->cp.count; i++) {
+        uint32_t *bucket = find_constant(code, double_bits(code->cp.data[i]));
+        if (*bucket == 0) {
+            *bucket = i + 1;
         }
     }
-    /* Otherwise, own the string, insert it into the pool
-     * and return the index. */
-    char *s = own_string(string);
-    chunk->sp[chunk->sp_count++] = s;
-    return chunk->sp_count - 1;
 }
 
-static uint8_t add_constant(BytecodeChunk *chunk, double constant) {
+uint32_t add_constant(CodeObject *code, double constant) {
+    if (code->cp_index == NULL || (code->cp.count + 1) * 4 > code->cp_index_capacity * 3) {
+        grow_constant_index(code);
+    }
     /* Check if the constant is already present in the pool. */
-    for (uint8_t i = 0; i < chunk->cp_count; i++) {
+    uint32_t *bucket = find_constant(code, double_bits(constant));
+    if (*bucket != 0) {
         /* If it is, return the index. */
-        if (chunk->cp[i] == constant) {
-            return i;
-        }
+        return *bucket - 1;
     }
     /* Otherwise, insert the constant into the pool
      * and return the index. */
-    chunk->cp[chunk->cp_count++] = constant;
-    return chunk->cp_count - 1;
+    dynarray_insert(&code->cp, constant);
+    *bucket = code->cp.count;
+    return code->cp.count - 1;
+}
+
+void free_constant_index(CodeObject *code) {
+    /* A finished function never gets new constants. */
+    free(code->cp_index);
+    code->cp_index = NULL;
+    code->cp_index_capacity = 0;
+}
+
+uint32_t resolve_global(BytecodeChunk *chunk, Slice name) {
+    /* Globals live in a flat array in the VM, so every global name
+     * is resolved to its index in that array at compile time. Names
+     * are numbered in order of first appearance. */
+    String *key = intern(chunk, name);
+    Object *slot = table_get(&chunk->globals, key);
+    if (slot != NULL) {
+        return (uint32_t)NUM_VAL(*slot);
+    }
+    table_insert(&chunk->globals, key, AS_NUM(chunk->global_names.count));
+    dynarray_insert(&chunk->global_names, key);
+    return chunk->global_names.count - 1;
+}
+
+uint32_t add_cache(BytecodeChunk *chunk) {
+    /* A boxed NULL function is never stored in a global, so an
+     * empty cache misses no matter what the global holds. */
+    InlineCache cache = { .callee = AS_FUNC(NULL), .function = NULL };
+    dynarray_insert(&chunk->caches, cache);
+    return chunk->caches.count - 1;
+}
+
+uint32_t add_function(BytecodeChunk *chunk, String *name, uint32_t paramcount) {
+    /* Code objects are allocated one by one, since the functions made
+     * from them point to them, and the list of them may move. */
+    CodeObject *code = calloc(1, sizeof(CodeObject));
+    code->name = name;
+    code->paramcount = paramcount;
+    dynarray_insert(&chunk->functions, code);
+    return chunk->functions.count - 1;
+}
+
+static int operand_width(char kind, bool wide) {
+    if (kind == 'b') return 1;
+    if (wide) return 4;
+    return kind == 'j' ? 2 : 1;
+}
+
+int operands_length(const char *format, bool wide) {
+    int length = 0;
+    for (int i = 0; format[i] != '\0'; i++) {
+        length += operand_width(format[i], wide);
+    }
+    return length;
+}
+
+bool operands_fit(const char *format, const uint32_t *operands) {
+    /* Can the operands be encoded in the narrow form? */
+    for (int i = 0; format[i] != '\0'; i++) {
+        if (format[i] == 'k' && operands[i] > UINT8_MAX) {
+            return false;
+        }
+        if (format[i] == 'j') {
+            int32_t offset = (int32_t)operands[i];
+            if (offset < INT16_MIN || offset > INT16_MAX) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void read_operands(const char *format, bool wide, const uint8_t *ip, uint32_t *operands) {
+    for (int i = 0; format[i] != '\0'; i++) {
+        int width = operand_width(format[i], wide);
+        if (width == 1) {
+            operands[i] = ip[0];
+        } else if (width == 2) {
+            operands[i] = (uint32_t)(int16_t)((ip[0] << 8) | ip[1]);
+        } else {
+            operands[i] = (uint32_t)ip[0] << 24 | ip[1] << 16 | ip[2] << 8 | ip[3];
+        }
+        ip += width;
+    }
+}
+
+void write_operands(Uint8DynArray *code, const char *format, bool wide, const uint32_t *operands) {
+    for (int i = 0; format[i] != '\0'; i++) {
+        for (int shift = (operand_width(format[i], wide) - 1) * 8; shift >= 0; shift -= 8) {
+            dynarray_insert(code, (operands[i] >> shift) & 0xFF);
+        }
+    }
+}
+
+const char *operand_format(Opcode op) {
+    switch (op) {
+        case OP_CONST:
+        case OP_STR:
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL:
+            return "k";
+        case OP_DEEP_SET:
+        case OP_DEEP_GET:
+            return "b";
+        case OP_JMP:
+        case OP_JZ:
+        case OP_JNZ:
+            return "j";
+        case OP_FUNC:  /* slot, function */
+            return "kk";
+        case OP_INVOKE:  /* slot, argcount, cache */
+        case OP_TAIL_INVOKE:
+            return "kbk";
+        default:
+            return "";
+    }
+}
+
+int decode_instruction(const uint8_t *ip, Instruction *instruction) {
+    /* Decodes the instruction at 'ip', including its OP_WIDE prefix
+     * if it has one, and returns its length in bytes. */
+    instruction->wide = ip[0] == OP_WIDE;
+    int prefix = instruction->wide ? 1 : 0;
+    instruction->op = ip[prefix];
+    const char *format = operand_format(instruction->op);
+    read_operands(format, instruction->wide, &ip[prefix + 1], instruction->operands);
+    return prefix + 1 + operands_length(format, instruction->wide);
+}
+
+void encode_instruction(Uint8DynArray *code, const Instruction *instruction) {
+    if (instruction->wide) {
+        dynarray_insert(code, OP_WIDE);
+    }
+    dynarray_insert(code, instruction->op);
+    write_operands(code, operand_format(instruction->op), instruction->wide, instruction->operands);
 }
 
-static void emit_byte(BytecodeChunk *chunk, uint8_t byte) {
-    dynarray_insert(&chunk->code, byte);
+static void emit_byte(CodeObject *code, uint8_t byte) {
+    dynarray_insert(&code->code, byte);
 }
 
-static void emit_bytes(BytecodeChunk *chunk, uint8_t n, ...) {
+static void emit_bytes(CodeObject *code, uint8_t n, ...) {
     va_list ap;
     va_start(ap, n);
     for (int i = 0; i < n; i++) {
         uint8_t byte = va_arg(ap, int);
-        emit_byte(chunk, byte);
+        emit_byte(code, byte);
     }
     va_end(ap);
 }
 
-static int emit_jump(BytecodeChunk *chunk, Opcode jump) {
-    emit_byte(chunk, jump);
-    emit_bytes(chunk, 2, 0xFF, 0xFF);
-    /* In this case, the jump is the last emitted instruction. 
-     *
-     * For example, if we have: [
-     *     OP_CONST, operand,
-     *     OP_CONST, operand,
-     *     OP_EQ, 
-     *     OP_JZ, operand, operand
-     * ]                             ^-- count
-     *
-     * the count will be 8. Because the indexing is zero-based,
-     * the count points to just beyond the two operands, so to
-     * get to OP_JZ, we need to subtract 3 (two operands plus
-     * one 'extra' slot to adjust for zero-based indexing). */
-    return chunk->code.count - 3;
-}
-
-static void patch_jump(BytecodeChunk *chunk, int jump) {
-    /* In this case, one or both branches have been compiled.
-     *
-     * For example, if we have: [
-     *     OP_CONST, operand,
-     *     OP_CONST, operand,
-     *     OP_EQ, 
-     *     OP_JZ, operand, operand,
-     *     OP_CONST, operand,
-     *     OP_PRINT,
-     * ]             ^-- count
-     *
-     * We first adjust for zero-based indexing by subtracting 1
-     * (such that count points to the last element. Then we take
-     * the index of OP_JZ (5 in this case) and add 2 because we
-     * need to adjust for the operands. The result of subtraction
-     * of these two is the number of emitted bytes after the jump,
-     * and we use that number to build a 16-bit offset that we use
-     * to patch the jump. */
-    int16_t bytes_emitted = (chunk->code.count - 1) - (jump + 2);
-    chunk->code.data[jump+1] = (bytes_emitted >> 8) & 0xFF;
-    chunk->code.data[jump+2] = bytes_emitted & 0xFF;
-}
-
-static void emit_loop(BytecodeChunk *chunk, int loop_start) {
-    /* In this case, the conditional expression has been compiled.
-     *
-     * For example, if we have: [
-     *     OP_STR_CONST @ 14 ('x')
-     *     OP_CONST @ 14 ('0.00')
-     *     OP_SET_GLOBAL
-     *     OP_GET_GLOBAL @ 14
-     *     OP_CONST @ 0 ('10.00')
-     *     OP_LT
-     *     OP_JZ
-     *     OP_GET_GLOBAL @ 14
-     *     OP_PRINT
-     *     OP_STR_CONST @ 14 ('x')
-     *     OP_GET_GLOBAL @ 14
-     *     OP_CONST @ 13 ('1.00')
-     *     OP_ADD
-     *     OP_SET_GLOBAL
-     *     OP_JMP
-     * ]            ^-- count
-     *
-     * In this case, the loop_start is at '5'. If the count points to
-     * one instruction beyond the end of the bytecode '23'), in order
-     * to get to the beginning of the loop, we need to go backwards 18
-     * instructions (chunk->code.count - loop_start = 23 - 5 = 18).
-     * However, we need to make sure we include the 2-byte operand for
-     * OP_JMP, so we add +2 to the offset.
-     */
-    emit_byte(chunk, OP_JMP);
-    int16_t offset = -(chunk->code.count - loop_start + 2);
-    emit_byte(chunk, (offset >> 8) & 0xFF);
-    emit_byte(chunk, offset & 0xFF);
-}
-
-static int resolve_local(Compiler *compiler, char *name) {
+static void emit_instruction(CodeObject *code, Opcode op, uint32_t a, uint32_t b, uint32_t c) {
+    /* Emits an instruction with up to three operands, in the narrow
+     * form unless one of them does not fit. */
+    Instruction instruction = { .op = op, .operands = { a, b, c } };
+    instruction.wide = !operands_fit(operand_format(op), instruction.operands);
+    encode_instruction(&code->code, &instruction);
+}
+
+/* Jump offsets depend on where things end up in the code, which is
+ * not known while it is being compiled, so they are always emitted
+ * in the wide form. The control-flow pass
+ * in cfg.c lays out the final code and narrows the ones that fit. */
+
+static int emit_wide(CodeObject *code, Opcode op, uint32_t a, uint32_t b, uint32_t c) {
+    /* Returns the index of the last (four-byte) operand. */
+    Instruction instruction = { .op = op, .wide = true, .operands = { a, b, c } };
+    encode_instruction(&code->code, &instruction);
+    return code->code.count - 4;
+}
+
+static void patch_operand(CodeObject *code, int operand, uint32_t value) {
+    code->code.data[operand] = (value >> 24) & 0xFF;
+    code->code.data[operand+1] = (value >> 16) & 0xFF;
+    code->code.data[operand+2] = (value >> 8) & 0xFF;
+    code->code.data[operand+3] = value & 0xFF;
+}
+
+static int emit_jump(CodeObject *code, Opcode jump) {
+    /* We don't know how much code we are going to jump over yet,
+     * so we emit a placeholder offset and backpatch it later. */
+    return emit_wide(code, jump, 0, 0, 0);
+}
+
+static void patch_jump(CodeObject *code, int jump) {
+    /* Jump offsets are relative to the end of the jump, which is
+     * where the VM's ip points after reading the offset. Here, we
+     * jump to the end of the code emitted so far. */
+    int32_t offset = code->code.count - (jump + 4);
+    patch_operand(code, jump, offset);
+}
+
+static void emit_loop(CodeObject *code, int loop_start) {
+    /* A backward jump: once emitted, the jump ends at the current
+     * end of the code, and we want to land on 'loop_start'. */
+    int jump = emit_jump(code, OP_JMP);
+    patch_operand(code, jump, loop_start - code->code.count);
+}
+
+static void compiler_error(Compiler *compiler, const char *format, ...) {
+    /* A function may be compiled while the program runs, or on another
+     * thread, so the error is only reported here and the caller of
+     * compile_function() gives up. The compiler carries on until then,
+     * and only the first error is reported, since every local after
+     * the 256th would report one of its own. */
+    if (compiler->had_error) {
+        return;
+    }
+    va_list ap;
+    va_start(ap, format);
+    compiler->had_error = true;
+    fprintf(stderr, "compile error: ");
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static void declare_local(Compiler *compiler, String *name) {
+    /* Locals are addressed by one-byte operands, so, as with registers
+     * in regcompiler.c, a function can have at most 256 of them. */
+    if (compiler->locals_count > UINT8_MAX) {
+        compiler_error(compiler, "code needs more than %d locals", UINT8_MAX + 1);
+        return;
+    }
+    compiler->locals[compiler->locals_count++] = name;
+}
+
+static uint32_t argument_count(Compiler *compiler, CallExpression *call) {
+    /* The argument count of a call is a one-byte operand. */
+    if (call->arguments.count > UINT8_MAX) {
+        compiler_error(compiler, "call with more than %d arguments", UINT8_MAX);
+        return 0;
+    }
+    return call->arguments.count;
+}
+
+static int resolve_local(Compiler *compiler, String *name) {
+    /* Names are interned, so they are compared by address. */
     for (int i = compiler->locals_count - 1; i >= 0; i--) {
-        if (strcmp(compiler->locals[i], name) == 0) {
+        if (compiler->locals[i] == name) {
             return i;
         }
     }
@@ -154,104 +369,117 @@ static int resolve_local(Compiler *compiler, char *name) {
 }
 
 static void compile_expression(Compiler *compiler, BytecodeChunk *chunk, Expression exp) {
+    Ast *ast = compiler->ast;
     switch (exp.kind) {
         case EXP_LITERAL: {
-            if (exp.as.expr_literal->specval == NULL) {
-                uint8_t const_index = add_constant(chunk, exp.as.expr_literal->dval);
-                emit_bytes(chunk, 2, OP_CONST, const_index);
+            LiteralExpression *literal = AST_NODE(ast, LiteralExpression, exp.index);
+            if (literal->specval == NULL) {
+                uint32_t const_index = add_constant(compiler->code, literal->dval);
+                emit_instruction(compiler->code, OP_CONST, const_index, 0, 0);
             } else {
-                if (strcmp(exp.as.expr_literal->specval, "true") == 0) {
-                    emit_byte(chunk, OP_TRUE);
-                } else if (strcmp(exp.as.expr_literal->specval, "false") == 0) {
-                    emit_bytes(chunk, 2, OP_TRUE, OP_NOT);
-                } else if (strcmp(exp.as.expr_literal->specval, "null") == 0) {
-                    emit_byte(chunk, OP_NULL);
+                if (strcmp(literal->specval, "true") == 0) {
+                    emit_byte(compiler->code, OP_TRUE);
+                } else if (strcmp(literal->specval, "false") == 0) {
+                    emit_byte(compiler->code, OP_FALSE);
+                } else if (strcmp(literal->specval, "null") == 0) {
+                    emit_byte(compiler->code, OP_NULL);
                 }
             }
             break;
         }
         case EXP_STRING: {
-            uint8_t const_index = add_string(chunk, exp.as.expr_string->str);
-            emit_bytes(chunk, 2, OP_STR, const_index);
+            uint32_t const_index = add_string(chunk, AST_NODE(ast, StringExpression, exp.index)->str);
+            emit_instruction(compiler->code, OP_STR, const_index, 0, 0);
             break;
         }
         case EXP_VARIABLE: {
-            int index = resolve_local(compiler, exp.as.expr_variable->name);
+            Slice name = AST_NODE(ast, VariableExpression, exp.index)->name;
+            int index = resolve_local(compiler, intern(chunk, name));
             if (index == -1) {
-                uint8_t name_index = add_string(chunk, exp.as.expr_variable->name);
-                emit_bytes(chunk, 2, OP_GET_GLOBAL, name_index);
+                uint32_t slot = resolve_global(chunk, name);
+                emit_instruction(compiler->code, OP_GET_GLOBAL, slot, 0, 0);
             } else {
-                emit_bytes(chunk, 2, OP_DEEP_GET, index);
+                emit_bytes(compiler->code, 2, OP_DEEP_GET, index);
             }
             break;
         }
         case EXP_UNARY: {
-            compile_expression(compiler, chunk, *exp.as.expr_unary->exp);
-            emit_byte(chunk, OP_NEGATE);
+            compile_expression(compiler, chunk, AST_NODE(ast, UnaryExpression, exp.index)->exp);
+            emit_byte(compiler->code, OP_NEGATE);
             break;
         }
         case EXP_BINARY: {
-            compile_expression(compiler, chunk, exp.as.expr_binary->lhs);
-            compile_expression(compiler, chunk, exp.as.expr_binary->rhs);
-
-            if (strcmp(exp.as.expr_binary->operator, "+") == 0) {
-                emit_byte(chunk, OP_ADD);
-            } else if (strcmp(exp.as.expr_binary->operator, "-") == 0) {
-                emit_byte(chunk, OP_SUB);                
-            } else if (strcmp(exp.as.expr_binary->operator, "*") == 0) {
-                emit_byte(chunk, OP_MUL);
-            } else if (strcmp(exp.as.expr_binary->operator, "/") == 0) {
-                emit_byte(chunk, OP_DIV);
-            } else if (strcmp(exp.as.expr_binary->operator, "%%") == 0) {
-                emit_byte(chunk, OP_MOD);
-            } else if (strcmp(exp.as.expr_binary->operator, ">") == 0) {
-                emit_byte(chunk, OP_GT);
-            } else if (strcmp(exp.as.expr_binary->operator, "<") == 0) {
-                emit_byte(chunk, OP_LT);
-            } else if (strcmp(exp.as.expr_binary->operator, ">=") == 0) {
-                emit_bytes(chunk, 2, OP_LT, OP_NOT);
-            } else if (strcmp(exp.as.expr_binary->operator, "<=") == 0) {
-                emit_bytes(chunk, 2, OP_GT, OP_NOT);
-            } else if (strcmp(exp.as.expr_binary->operator, "==") == 0) {
-                emit_byte(chunk, OP_EQ);
-            } else if (strcmp(exp.as.expr_binary->operator, "!=") == 0) {
-                emit_bytes(chunk, 2, OP_EQ, OP_NOT);
+            BinaryExpression *binary = AST_NODE(ast, BinaryExpression, exp.index);
+            compile_expression(compiler, chunk, binary->lhs);
+            compile_expression(compiler, chunk, binary->rhs);
+
+            if (strcmp(binary->operator, "+") == 0) {
+                emit_byte(compiler->code, OP_ADD);
+            } else if (strcmp(binary->operator, "-") == 0) {
+                emit_byte(compiler->code, OP_SUB);                
+            } else if (strcmp(binary->operator, "*") == 0) {
+                emit_byte(compiler->code, OP_MUL);
+            } else if (strcmp(binary->operator, "/") == 0) {
+                emit_byte(compiler->code, OP_DIV);
+            } else if (strcmp(binary->operator, "%%") == 0) {
+                emit_byte(compiler->code, OP_MOD);
+            } else if (strcmp(binary->operator, ">") == 0) {
+                emit_byte(compiler->code, OP_GT);
+            } else if (strcmp(binary->operator, "<") == 0) {
+                emit_byte(compiler->code, OP_LT);
+            } else if (strcmp(binary->operator, ">=") == 0) {
+                emit_bytes(compiler->code, 2, OP_LT, OP_NOT);
+            } else if (strcmp(binary->operator, "<=") == 0) {
+                emit_bytes(compiler->code, 2, OP_GT, OP_NOT);
+            } else if (strcmp(binary->operator, "==") == 0) {
+                emit_byte(compiler->code, OP_EQ);
+            } else if (strcmp(binary->operator, "!=") == 0) {
+                emit_bytes(compiler->code, 2, OP_EQ, OP_NOT);
             }
 
             break;
         }
         case EXP_CALL: {
-            for (size_t i = 0; i < exp.as.expr_call->arguments.count; i++) {
-                compile_expression(compiler, chunk, exp.as.expr_call->arguments.data[i]);
-            }
-            uint8_t funcname_index = add_string(chunk, exp.as.expr_call->var->name);
-            emit_bytes(chunk, 3, OP_INVOKE, funcname_index, exp.as.expr_call->arguments.count);
+            CallExpression *call = AST_NODE(ast, CallExpression, exp.index);
+            Expression *arguments = AST_LIST(ast, Expression, call->arguments);
+            for (size_t i = 0; i < call->arguments.count; i++) {
+                compile_expression(compiler, chunk, arguments[i]);
+            }
+            uint32_t slot = resolve_global(chunk, call->var.name);
+            emit_instruction(
+                compiler->code, OP_INVOKE, slot,
+                argument_count(compiler, call),
+                add_cache(chunk)
+            );
             break;
         }
         case EXP_ASSIGN: {
-            compile_expression(compiler, chunk, exp.as.expr_assign->rhs);
-            int index = resolve_local(compiler, exp.as.expr_assign->lhs.as.expr_variable->name);
+            AssignExpression *assign = AST_NODE(ast, AssignExpression, exp.index);
+            Slice name = AST_NODE(ast, VariableExpression, assign->lhs.index)->name;
+            compile_expression(compiler, chunk, assign->rhs);
+            int index = resolve_local(compiler, intern(chunk, name));
             if (index != -1) {
-                emit_bytes(chunk, 2, OP_DEEP_SET, index);
+                emit_bytes(compiler->code, 2, OP_DEEP_SET, index);
             } else {
-                uint8_t name_index = add_string(chunk, exp.as.expr_assign->lhs.as.expr_variable->name);
-                emit_bytes(chunk, 2, OP_SET_GLOBAL, name_index);
+                uint32_t slot = resolve_global(chunk, name);
+                emit_instruction(compiler->code, OP_SET_GLOBAL, slot, 0, 0);
             }
             break;
         }
         case EXP_LOGICAL: {
+            LogicalExpression *logical = AST_NODE(ast, LogicalExpression, exp.index);
             /* We first compile the left-hand side of the expression. */
-            compile_expression(compiler, chunk, exp.as.expr_logical->lhs);
-            if (strcmp(exp.as.expr_logical->operator, "&&") == 0) {
+            compile_expression(compiler, chunk, logical->lhs);
+            if (strcmp(logical->operator, "&&") == 0) {
                 /* For logical AND, we emit a conditional jump which we'll use
                  * to jump over the right-hand side operand if the left operand
                  * was falsey (aka short-circuiting). Effectively, we will leave 
                  * the left operand on the stack as the result of evaluating this
                  * expression. */
-                int end_jump = emit_jump(chunk, OP_JZ);
-                compile_expression(compiler, chunk, exp.as.expr_logical->rhs);
-                patch_jump(chunk, end_jump);
-            } else if (strcmp(exp.as.expr_logical->operator, "||") == 0) {
+                int end_jump = emit_jump(compiler->code, OP_JZ);
+                compile_expression(compiler, chunk, logical->rhs);
+                patch_jump(compiler->code, end_jump);
+            } else if (strcmp(logical->operator, "||") == 0) {
                 /* For logical OR, we need to short-circuit when the left-hand side
                  * is truthy. Thus, we have two jumps: the first one is conditional
                  * jump that we use to jump over the code for the right-hand side. 
@@ -259,11 +487,11 @@ static void compile_expression(Compiler *compiler, BytecodeChunk *chunk, Express
                  * the second, unconditional jump that skips the code for the right
                  * operand. However, if the left-hand side was falsey, it jumps over
                  * the unconditional jump and evaluates the right-hand side operand. */
-                int else_jump = emit_jump(chunk, OP_JZ);
-                int end_jump = emit_jump(chunk, OP_JMP);
-                patch_jump(chunk, else_jump);
-                compile_expression(compiler, chunk, exp.as.expr_logical->rhs);
-                patch_jump(chunk, end_jump);
+                int else_jump = emit_jump(compiler->code, OP_JZ);
+                int end_jump = emit_jump(compiler->code, OP_JMP);
+                patch_jump(compiler->code, else_jump);
+                compile_expression(compiler, chunk, logical->rhs);
+                patch_jump(compiler->code, end_jump);
             }
             break;
         }
@@ -271,168 +499,116 @@ static void compile_expression(Compiler *compiler, BytecodeChunk *chunk, Express
     }
 }
 
+static const char *opcode_names[] = {
+    [OP_PRINT] = "OP_PRINT",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUB] = "OP_SUB",
+    [OP_MUL] = "OP_MUL",
+    [OP_DIV] = "OP_DIV",
+    [OP_MOD] = "OP_MOD",
+    [OP_EQ] = "OP_EQ",
+    [OP_GT] = "OP_GT",
+    [OP_LT] = "OP_LT",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_JMP] = "OP_JMP",
+    [OP_JZ] = "OP_JZ",
+    [OP_JNZ] = "OP_JNZ",
+    [OP_FUNC] = "OP_FUNC",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_TAIL_INVOKE] = "OP_TAIL_INVOKE",
+    [OP_RET] = "OP_RET",
+    [OP_CONST] = "OP_CONST",
+    [OP_STR] = "OP_STR",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NULL] = "OP_NULL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEEP_SET] = "OP_DEEP_SET",
+    [OP_DEEP_GET] = "OP_DEEP_GET",
+    [OP_POP] = "OP_POP",
+    [OP_WIDE] = "OP_WIDE",
+    [OP_EXIT] = "OP_EXIT",
+};
+
+const char *opcode_name(uint8_t op) {
+    return op < sizeof(opcode_names) / sizeof(opcode_names[0]) && opcode_names[op] != NULL
+        ? opcode_names[op] : "?";
+}
+
 #ifdef venom_debug
-void disassemble(BytecodeChunk *chunk) {
-    int i = 0;
-    for (
-        uint8_t *ip = chunk->code.data;    
-        ip < &chunk->code.data[chunk->code.count];  /* ip < addr of just beyond the last instruction */
-        ip++, i++
-    ) {
-        switch (*ip) {
+static void disassemble_code(BytecodeChunk *chunk, CodeObject *code, size_t start) {
+    for (size_t offset = start; offset < code->code.count;) {
+        Instruction instruction;
+        int length = decode_instruction(&code->code.data[offset], &instruction);
+        uint32_t *operands = instruction.operands;
+        printf(
+            "%zu: %s%s", offset,
+            instruction.wide ? "OP_WIDE " : "",
+            opcode_names[instruction.op]
+        );
+        switch (instruction.op) {
             case OP_CONST: {
-                uint8_t const_index = *++ip;
-                printf("%d: ", i);
-                printf("OP_CONST, byte (idx: %d): (val: '%f')\n", const_index, chunk->cp[const_index]);
-                i++;
+                printf(" (idx: %u): (val: '%f')", operands[0], code->cp.data[operands[0]]);
                 break;
             }
             case OP_STR: {
-                uint8_t strconst_index = *++ip;
-                printf("%d: ", i);
-                printf("OP_STR, byte (idx: %d): (val: '%s')\n", strconst_index, chunk->sp[strconst_index]);
-                i++;
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                printf("%d: ", i);
-                printf("OP_GET_GLOBAL + byte\n");
-                ++ip;
-                i++;
-                break;
-            }
-            case OP_DEEP_GET: {
-                uint8_t name_index = *++ip;
-                printf("%d: ", i);
-                printf("OP_DEEP_GET, byte (%d): ('%s')\n", name_index, chunk->sp[name_index]);
-                i++;
-                break;
-            }
-            case OP_DEEP_SET: {
-                uint8_t index = *++ip;
-                printf("%d: ", i);
-                printf("OP_DEEP_SET, byte (%d)\n", index);
-                i++;
+                printf(" (idx: %u): (val: '%s')", operands[0], chunk->sp.data[operands[0]]->chars);
                 break;
             }
+            case OP_GET_GLOBAL:
             case OP_SET_GLOBAL: {
-                printf("%d: ", i);
-                printf("OP_SET_GLOBAL\n");
-                i++;
-                ++ip;
-                break;
-            }
-            case OP_ADD: {
-                printf("%d: ", i);
-                printf("OP_ADD\n");
+                printf(" (slot: %u): ('%s')", operands[0], chunk->global_names.data[operands[0]]->chars);
                 break;
             }
-            case OP_SUB: {
-                printf("%d: ", i);
-                printf("OP_SUB\n");
-                break;
-            }
-            case OP_MUL: {
-                printf("%d: ", i);
-                printf("OP_MUL\n");
-                break;
-            }
-            case OP_DIV: {
-                printf("%d: ", i);
-                printf("OP_DIV\n");
-                break;
-            }
-            case OP_MOD: {
-                printf("%d: ", i);
-                printf("OP_MOD\n");
-                break;
-            }
-            case OP_EQ: {
-                printf("%d: ", i);
-                printf("OP_EQ\n");
-                break;
-            }
-            case OP_GT: {
-                printf("%d: ", i);
-                printf("OP_GT\n");
-                break;
-            }
-            case OP_LT: {
-                printf("%d: ", i);
-                printf("OP_LT\n");
-                break;
-            }
-            case OP_JZ: {
-                printf("%d: ", i);
-                int16_t offset = *++ip;
-                offset <<= 8;
-                offset |= *++ip;
-                printf("OP_JZ, byte, byte (offset: '%d')\n", offset);
-                i += 2;
+            case OP_DEEP_GET:
+            case OP_DEEP_SET: {
+                printf(" (%u)", operands[0]);
                 break;
             }
-            case OP_JMP: {
-                printf("%d: ", i);
-                int16_t offset = *++ip;
-                offset <<= 8;
-                offset |= *++ip;
-                printf("OP_JMP, byte, byte (offset: '%d')\n", offset);
-                i += 2;
+            case OP_JMP:
+            case OP_JZ:
+            case OP_JNZ: {
+                printf(" (offset: '%d')", (int32_t)operands[0]);
                 break;
             }
             case OP_FUNC: {
-                printf("%d: ", i);
-                printf("OP_FUNC ");
-                uint8_t funcname_index = *++ip;
-                printf(", byte (name: '%d' (%s)')", funcname_index, chunk->sp[funcname_index]);
-                uint8_t paramcount = *++ip;
-                printf(", byte (paramcount: '%d')", paramcount);
-                for (; i < paramcount; i++) {
-                    uint8_t paramname_index = *++ip;
-                    printf(", byte (param: '%d' (%s)')", paramname_index, chunk->sp[paramname_index]);
-                }
-                uint8_t location = *++ip;
-                printf(", byte (location: '%d')\n", location);
-                i += 2 + paramcount;
-                break;
-            }
-            case OP_INVOKE: {
-                uint8_t funcname_index = *++ip;
-                char *funcname = chunk->sp[funcname_index];
-                printf("%d: ", i);
-                printf("OP_INVOKE, byte (funcname_index: '%d' ('%s')\n", funcname_index, funcname);
-                uint8_t argcount = *++ip;
-                printf(", byte (paramcount: '%d')", argcount);
-                i += 2;
+                printf(
+                    " (slot: '%u' ('%s'), function: '%u')",
+                    operands[0], chunk->global_names.data[operands[0]]->chars,
+                    operands[1]
+                );
                 break;
             }
-            case OP_RET: {
-                printf("%d: ", i);
-                printf("OP_RET\n");
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE: {
+                printf(
+                    " (slot: '%u' ('%s'), argcount: '%u', cache: '%u')",
+                    operands[0], chunk->global_names.data[operands[0]]->chars,
+                    operands[1], operands[2]
+                );
                 break;
             }
-            case OP_NOT: {
-                printf("%d: ", i);
-                printf("OP_NOT\n");
-                break;
-            }
-            case OP_NEGATE: {
-                printf("%d: ", i);
-                printf("OP_NEGATE\n");
-                break;
-            }
-            case OP_PRINT: {
-                printf("%d: ", i);
-                printf("OP_PRINT\n"); 
-                break;
-            }
-            case OP_NULL: {
-                printf("%d: ", i);
-                printf("OP_NULL\n");
-                break;
-            }
-            default: printf("Unknown instruction: %d.\n", *ip); break;
+            default: break;
         }
+        printf("\n");
+        offset += length;
+    }
+}
+
+void disassemble(BytecodeChunk *chunk, size_t start) {
+    disassemble_code(chunk, &chunk->main, start);
+    for (size_t i = 0; i < chunk->functions.count; i++) {
+        CodeObject *code = chunk->functions.data[i];
+        printf(
+            "function %zu: '%s' (paramcount: '%u', max_stack: '%u')\n",
+            i, code->name->chars, code->paramcount, code->max_stack
+        );
+        if (code->source.start != NULL) {
+            printf("(not compiled yet)\n");
+        }
+        disassemble_code(chunk, code, 0);
     }
 }
 #endif
@@ -441,26 +617,39 @@ void compile(Compiler *compiler, BytecodeChunk *chunk, Statement stmt, bool scop
     switch (stmt.kind) {
         case STMT_PRINT: {
             compile_expression(compiler, chunk, stmt.as.stmt_print.exp);
-            emit_byte(chunk, OP_PRINT);        
+            emit_byte(compiler->code, OP_PRINT);        
             break;
         }
         case STMT_LET: {
             compile_expression(compiler, chunk, stmt.as.stmt_let.initializer);
-            uint8_t name_index = add_string(chunk, stmt.as.stmt_let.name);
             if (!scoped) {
-                emit_bytes(chunk, 2, OP_SET_GLOBAL, name_index);
+                uint32_t slot = resolve_global(chunk, stmt.as.stmt_let.name);
+                emit_instruction(compiler->code, OP_SET_GLOBAL, slot, 0, 0);
             } else {
-                compiler->locals[compiler->locals_count++] = chunk->sp[name_index];
+                declare_local(compiler, intern(chunk, stmt.as.stmt_let.name));
             }
             break;
         }
         case STMT_EXPR: {
             compile_expression(compiler, chunk, stmt.as.stmt_expr.exp);
+            /* Assignments consume their value, but anything else (such
+             * as a call) leaves one on the stack, which is discarded so
+             * that a loop does not grow the stack on every iteration. */
+            if (stmt.as.stmt_expr.exp.kind != EXP_ASSIGN) {
+                emit_byte(compiler->code, OP_POP);
+            }
             break;
         }
         case STMT_BLOCK: {
+            int locals_count = compiler->locals_count;
+            Statement *stmts = AST_LIST(compiler->ast, Statement, stmt.as.stmt_block.stmts);
             for (size_t i = 0; i < stmt.as.stmt_block.stmts.count; i++) {
-                compile(compiler, chunk, stmt.as.stmt_block.stmts.data[i], scoped);
+                compile(compiler, chunk, stmts[i], scoped);
+            }
+            /* Locals declared in the block go out of scope at its end,
+             * which also keeps a loop body from piling them up. */
+            for (; compiler->locals_count > locals_count; compiler->locals_count--) {
+                emit_byte(compiler->code, OP_POP);
             }
             break;
         }
@@ -478,22 +667,22 @@ void compile(Compiler *compiler, BytecodeChunk *chunk, Statement stmt, bool scop
              * a placeholder for the real jump offset that will be known only
              * after we compile the 'then' branch because at that point the
              * size of the 'then' branch is known. */ 
-            int then_jump = emit_jump(chunk, OP_JZ);
+            int then_jump = emit_jump(compiler->code, OP_JZ);
             
-            compile(compiler, chunk, *stmt.as.stmt_if.then_branch, scoped);
+            compile(compiler, chunk, *AST_NODE(compiler->ast, Statement, stmt.as.stmt_if.then_branch), scoped);
 
-            int else_jump = emit_jump(chunk, OP_JMP);
+            int else_jump = emit_jump(compiler->code, OP_JMP);
 
             /* Then, we patch the 'then' jump. */
-            patch_jump(chunk, then_jump);
+            patch_jump(compiler->code, then_jump);
 
-            if (stmt.as.stmt_if.else_branch != NULL) {
-                compile(compiler, chunk, *stmt.as.stmt_if.else_branch, scoped);
+            if (stmt.as.stmt_if.else_branch != AST_NONE) {
+                compile(compiler, chunk, *AST_NODE(compiler->ast, Statement, stmt.as.stmt_if.else_branch), scoped);
             }
 
             /* Finally, we patch the 'else' jump. If the 'else' branch
             + wasn't compiled, the offset should be zeroed out. */
-            patch_jump(chunk, else_jump);
+            patch_jump(compiler->code, else_jump);
 
             break;
         }
@@ -501,7 +690,7 @@ void compile(Compiler *compiler, BytecodeChunk *chunk, Statement stmt, bool scop
             /* We need to mark the beginning of the loop before we compile
              * the conditional expression, so that we know where to return
              * after the body of the loop is executed. */
-            int loop_start = chunk->code.count;
+            int loop_start = compiler->code->code.count;
 
             /* We then compile the conditional expression because the VM
             .* expects something like OP_EQ to have already been executed
@@ -516,70 +705,99 @@ void compile(Compiler *compiler, BytecodeChunk *chunk, Statement stmt, bool scop
              * which acts as a placeholder for the real jump offset that will
              * be known only after we compile the body of the 'while' loop,
              * because at that point its size is known. */ 
-            int exit_jump = emit_jump(chunk, OP_JZ);
+            int exit_jump = emit_jump(compiler->code, OP_JZ);
             
             /* Then, we compile the body of the loop. */
-            compile(compiler, chunk, *stmt.as.stmt_while.body, scoped);
+            compile(compiler, chunk, *AST_NODE(compiler->ast, Statement, stmt.as.stmt_while.body), scoped);
 
             /* Then, we emit OP_JMP with a negative offset. */
-            emit_loop(chunk, loop_start);
+            emit_loop(compiler->code, loop_start);
 
             /* Finally, we patch the jump. */
-            patch_jump(chunk, exit_jump);
+            patch_jump(compiler->code, exit_jump);
 
             break;
         }
-        case STMT_FN: {           
-            init_compiler(compiler);
-
-            emit_byte(chunk, OP_FUNC);
-
-            /* Emit function name. */
-            uint8_t name_index = add_string(chunk, stmt.as.stmt_fn.name);
-            emit_byte(chunk, name_index);
-
-            /* Emit parameter count. */
-            emit_byte(chunk, (uint8_t)stmt.as.stmt_fn.parameters.count);
-
-            /* Add parameter names to compiler->locals. */
-            for (size_t i = 0; i < stmt.as.stmt_fn.parameters.count; i++) {
-                uint8_t parameter_index = add_string(chunk, stmt.as.stmt_fn.parameters.data[i]);
-                compiler->locals[compiler->locals_count++] = chunk->sp[parameter_index];
-            }
-           
-            /* Emit the location of the start of the function. */
-            emit_byte(chunk, (uint8_t)(chunk->code.count + 4));
-            
-            /* Emit the jump because we don't want to execute
-             * the code the first time we encounter it. */
-            int jump = emit_jump(chunk, OP_JMP);
-
-            /* Compile the function body and check if it is void. */
-            bool is_void = true;
-            for (size_t i = 0; i < stmt.as.stmt_fn.stmts.count; i++) {
-                if (stmt.as.stmt_fn.stmts.data[i].kind == STMT_RETURN) {
-                    is_void = false;
-                }
-                compile(compiler, chunk, stmt.as.stmt_fn.stmts.data[i], true);
-            }
-
-            /* If the function does not have a return statement,
-             * emit OP_NULL because we have to return something. */
-            if (is_void) {
-                emit_bytes(chunk, 2, OP_NULL, OP_RET);
-            }
-
-            /* Finally, patch the jump. */
-            patch_jump(chunk, jump);
+        case STMT_FN: {
+            uint32_t slot = resolve_global(chunk, stmt.as.stmt_fn.name);
+            uint32_t function = add_function(
+                chunk, intern(chunk, stmt.as.stmt_fn.name),
+                stmt.as.stmt_fn.parameters.count
+            );
+            if (stmt.as.stmt_fn.lazy != AST_NONE) {
+                defer_function(compiler->ast, chunk, chunk->functions.data[function], &stmt.as.stmt_fn);
+            } else if (!compile_function(compiler->ast, chunk, chunk->functions.data[function], &stmt.as.stmt_fn)) {
+                compiler->had_error = true;
+            }
+
+            /* Running the declaration only makes the function value
+             * and stores it in its global slot. */
+            emit_instruction(compiler->code, OP_FUNC, slot, function, 0);
 
             break;
         }
         case STMT_RETURN: {
+            Expression returnval = stmt.as.stmt_return.returnval;
+            if (returnval.kind == EXP_CALL) {
+                /* A call in tail position replaces the current frame
+                 * instead of returning through it. */
+                CallExpression *call = AST_NODE(compiler->ast, CallExpression, returnval.index);
+                Expression *arguments = AST_LIST(compiler->ast, Expression, call->arguments);
+                for (size_t i = 0; i < call->arguments.count; i++) {
+                    compile_expression(compiler, chunk, arguments[i]);
+                }
+                uint32_t slot = resolve_global(chunk, call->var.name);
+                emit_instruction(
+                    compiler->code, OP_TAIL_INVOKE, slot,
+                    argument_count(compiler, call),
+                    add_cache(chunk)
+                );
+                break;
+            }
             /* Compile the return value and emit OP_RET. */
-            compile_expression(compiler, chunk, stmt.as.stmt_return.returnval);
-            emit_byte(chunk, OP_RET);
+            compile_expression(compiler, chunk, returnval);
+            emit_byte(compiler->code, OP_RET);
             break;
         }
         default: assert(0);
     }
+}
+
+void finish_chunk(BytecodeChunk *chunk, size_t start) {
+    /* The VM does not check the instruction pointer against the end
+     * of the chunk, so the top level has to be terminated by OP_EXIT.
+     * Only the code from 'start' on is new, and it cannot jump into
+     * the code before it, so that is all the control-flow pass has
+     * to look at. Functions were finished as they were compiled. */
+    emit_byte(&chunk->main, OP_EXIT);
+    optimize_code(&chunk->main, start);
+}
+
+bool compile_function(Ast *ast, BytecodeChunk *chunk, CodeObject *code, FunctionStatement *fn) {
+    /* The body is compiled into a code object of its own, by a
+     * compiler of its own, whose first locals are the parameters,
+     * wherever the caller put them. */
+    Compiler fn_compiler;
+    init_compiler(&fn_compiler, ast, code);
+
+    Slice *parameters = AST_LIST(ast, Slice, fn->parameters);
+    for (size_t i = 0; i < fn->parameters.count; i++) {
+        declare_local(&fn_compiler, intern(chunk, parameters[i]));
+    }
+
+    Statement *stmts = AST_LIST(ast, Statement, fn->stmts);
+    for (size_t i = 0; i < fn->stmts.count; i++) {
+        compile(&fn_compiler, chunk, stmts[i], true);
+    }
+
+    /* The VM does not check the instruction pointer against the end
+     * of the code, so unless the body ends with a return, we return
+     * null. */
+    size_t count = fn->stmts.count;
+    if (count == 0 || stmts[count-1].kind != STMT_RETURN) {
+        emit_bytes(code, 2, OP_NULL, OP_RET);
+    }
+    optimize_code(code, 0);
+    free_constant_index(code);
+    return !fn_compiler.had_error;
 }
\ No newline at end of file
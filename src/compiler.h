@@ -1,11 +1,11 @@
 #ifndef venom_compiler_h
 #define venom_compiler_h
 
-#define POOL_MAX 256
-
+#include <stdbool.h>
 #include <stdint.h>
 #include "dynarray.h"
 #include "parser.h"
+#include "gc.h"
 #include "object.h"
 #include "table.h"
 
@@ -23,39 +23,143 @@ typedef enum {
     OP_NEGATE,
     OP_JMP,
     OP_JZ,
+    OP_JNZ,
     OP_FUNC,
     OP_INVOKE,
+    OP_TAIL_INVOKE,
     OP_RET,
     OP_CONST,
     OP_STR,
     OP_TRUE,
+    OP_FALSE,
     OP_NULL,
     OP_SET_GLOBAL,
     OP_GET_GLOBAL,
     OP_DEEP_SET,
     OP_DEEP_GET,
+    OP_POP,
+    OP_WIDE,
     OP_EXIT,
 } Opcode;
 
 typedef DynArray(uint8_t) Uint8DynArray;
+typedef DynArray(double) Double_DynArray;
 
-typedef struct BytecodeChunk {
+/* The operands of an instruction are described by a format string
+ * with one character per operand:
+ *
+ *   'b'  a count or a local, always one byte
+ *   'k'  a pool index, global slot, cache index or function index:
+ *        one byte, or four when the instruction is wide
+ *   'j'  a signed jump offset: two bytes, or four when wide
+ *
+ * An instruction is wide when it is preceded by a prefix opcode
+ * (OP_WIDE, or ROP_WIDE in register bytecode). Multi-byte operands
+ * are big-endian. The narrow form is the common one, so small
+ * programs keep their compact encoding. */
+typedef struct {
+    uint8_t op;
+    bool wide;
+    uint32_t operands[5];  /* jump offsets are stored as int32_t */
+} Instruction;
+
+int operands_length(const char *format, bool wide);
+bool operands_fit(const char *format, const uint32_t *operands);
+void read_operands(const char *format, bool wide, const uint8_t *ip, uint32_t *operands);
+void write_operands(Uint8DynArray *code, const char *format, bool wide, const uint32_t *operands);
+
+/* Changes the operands of an instruction in place, for renumbering
+ * the pools and tables they index. */
+typedef void (*OperandRemap)(Instruction *instruction, void *context);
+
+/* A call site remembers the last global it called through, and
+ * the function it resolved to, so that a repeated call to the same
+ * function skips the type and arity checks. */
+typedef struct {
+    Object callee;
+    Function *function;
+} InlineCache;
+
+typedef DynArray(InlineCache) InlineCache_DynArray;
+
+/* The code of one function, or of the top level of the program. Every
+ * code object has a constant pool of its own, so a function's numbers
+ * are numbered from 0 no matter how many the rest of the program has.
+ * Strings, globals and call sites are numbered across the chunk. */
+typedef struct CodeObject {
     Uint8DynArray code;
-    double cp[POOL_MAX];  /* constant pool */
-    char *sp[POOL_MAX];   /* string pool */
-    uint8_t cp_count;
-    uint8_t sp_count;
+    Double_DynArray cp;  /* constant pool */
+    String *name;  /* NULL for the top level */
+    uint32_t paramcount;
+    /* The most slots (or registers) the code uses above the base of
+     * its frame, arguments included. */
+    uint32_t max_stack;
+    /* A function whose body is deferred is compiled when it
+     * is first called, from the source of its declaration, which
+     * starts at its name on 'line', and with the first 'constants'
+     * of the front end's constants in scope. 'source.start' is NULL
+     * once the code is there. */
+    Slice source;
+    int line;
+    uint32_t constants;
+    /* While the code is being compiled, an open-addressing index of
+     * its constant pool, from the bits of each constant to its index
+     * plus one, so that 0 marks an empty bucket. */
+    uint32_t *cp_index;
+    size_t cp_index_capacity;
+    /* With --profile-ops, how many times the instruction at each
+     * offset ran, for the first 'profiled' offsets of the code. */
+    uint64_t *op_counts;
+    size_t profiled;
+} CodeObject;
+
+typedef DynArray(CodeObject *) CodeObject_DynArray;
+
+typedef struct BytecodeChunk {
+    CodeObject main;  /* the top level */
+    CodeObject_DynArray functions;  /* indexed by OP_FUNC and ROP_FUNC */
+    String_DynArray sp;  /* string pool */
+    Table sp_indices;  /* string -> index in 'sp', used by the compiler */
+    Table globals;  /* global name -> slot, used by the compiler */
+    String_DynArray global_names;  /* slot -> name */
+    Heap *heap;  /* the VM's heap, which interns every string */
+    InlineCache_DynArray caches;  /* one per call site */
+    /* What is left of the front end, while there are functions that
+     * have not been compiled yet. */
+    struct Frontend *frontend;
+    /* A chunk loaded from a cache file keeps the code and constants
+     * of every code object in the mapped file. */
+    void *mapping;
+    size_t mapping_size;
 } BytecodeChunk;
 
 typedef struct {
-    char *locals[256];
+    String *locals[256];
     int locals_count;
+    bool had_error;
+    Ast *ast;
+    CodeObject *code;  /* where the code goes */
 } Compiler;
 
-void init_chunk(BytecodeChunk *chunk);
+void init_chunk(BytecodeChunk *chunk, Heap *heap);
+String *intern(BytecodeChunk *chunk, Slice string);
+uint32_t add_string(BytecodeChunk *chunk, Slice string);
+uint32_t add_constant(CodeObject *code, double constant);
+void free_constant_index(CodeObject *code);
+uint32_t resolve_global(BytecodeChunk *chunk, Slice name);
+uint32_t add_cache(BytecodeChunk *chunk);
+uint32_t add_function(BytecodeChunk *chunk, String *name, uint32_t paramcount);
+const char *operand_format(Opcode op);
+const char *opcode_name(uint8_t op);
+int decode_instruction(const uint8_t *ip, Instruction *instruction);
+void encode_instruction(Uint8DynArray *code, const Instruction *instruction);
 void free_chunk(BytecodeChunk *chunk);
+void finish_chunk(BytecodeChunk *chunk, size_t start);
 void compile(Compiler *compiler, BytecodeChunk *chunk, Statement stmt, bool scoped);
-void disassemble(BytecodeChunk *chunk);
-void init_compiler(Compiler *compiler);
+/* Returns false, having reported the error, if the body needs more
+ * locals or arguments than its operands can address. */
+bool compile_function(Ast *ast, BytecodeChunk *chunk, CodeObject *code, FunctionStatement *fn);
+void disassemble(BytecodeChunk *chunk, size_t start);
+void init_compiler(Compiler *compiler, Ast *ast, CodeObject *code);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "compiler.h"
+#include "gc.h"
+#include "vm.h"
+
+#define ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+static void init_space(Space *space, size_t size) {
+    space->start = malloc(size);
+    space->top = space->start;
+    space->end = space->start + size;
+}
+
+void init_heap(Heap *heap, const GCOptions *options) {
+    memset(heap, 0, sizeof(Heap));
+    heap->options = *options;
+    if (heap->options.promotion_age < 1) {
+        heap->options.promotion_age = 1;
+    }
+    if (heap->options.heap_growth < 1.0) {
+        heap->options.heap_growth = 1.0;
+    }
+    init_space(&heap->eden, heap->options.nursery_size);
+    init_space(&heap->survivors[0], heap->options.nursery_size / 4);
+    init_space(&heap->survivors[1], heap->options.nursery_size / 4);
+    heap->next_major = heap->options.heap_size;
+}
+
+void free_heap(Heap *heap) {
+    /* Nursery objects own nothing, so only the old generation has to
+     * be freed object by object. */
+    HeapObject *object = heap->old;
+    while (object != NULL) {
+        HeapObject *next = object->next;
+        free(object);
+        object = next;
+    }
+    free(heap->eden.start);
+    free(heap->survivors[0].start);
+    free(heap->survivors[1].start);
+    dynarray_free(&heap->gray);
+    table_free(&heap->strings);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool in_space(const Space *space, const void *pointer) {
+    return (const char *)pointer >= space->start && (const char *)pointer < space->top;
+}
+
+static bool is_young(const Heap *heap, const HeapObject *object) {
+    return in_space(&heap->eden, object) || in_space(&heap->survivors[heap->from], object);
+}
+
+static HeapObject *allocate_old(Heap *heap, size_t size) {
+    HeapObject *object = malloc(size);
+    object->next = heap->old;
+    heap->old = object;
+    heap->old_bytes += size;
+    return object;
+}
+
+static void init_header(HeapObject *object, HeapObjectType type, size_t size) {
+    object->size = size;
+    object->type = type;
+    object->age = 0;
+    object->marked = false;
+    object->forwarded = false;
+}
+
+/* Minor collections. */
+
+static HeapObject *evacuate(Heap *heap, HeapObject *object, bool promote) {
+    /* Moves a nursery object out of the way and returns its new
+     * address. Old objects stay where they are. */
+    if (object == NULL || !is_young(heap, object)) {
+        return object;
+    }
+    if (object->forwarded) {
+        return object->next;
+    }
+
+    Space *to = &heap->survivors[1 - heap->from];
+    HeapObject *copy;
+    if (promote
+            || object->age + 1u >= heap->options.promotion_age
+            || to->top + object->size > to->end) {
+        /* The object goes to the old generation, which must not point
+         * into the nursery, so its children will be promoted too. */
+        copy = allocate_old(heap, object->size);
+        HeapObject *next = copy->next;
+        memcpy(copy, object, object->size);
+        copy->next = next;
+        heap->stats.bytes_promoted += object->size;
+        dynarray_insert(&heap->gray, copy);
+    } else {
+        /* The object stays young. The survivor space is scanned in
+         * order, so it doesn't need to go on the gray list. */
+        copy = (HeapObject *)to->top;
+        to->top += object->size;
+        memcpy(copy, object, object->size);
+        copy->age++;
+    }
+
+    object->forwarded = true;
+    object->next = copy;
+    return copy;
+}
+
+static void evacuate_value(Heap *heap, Object *value, bool promote) {
+    /* The header is the first member of every heap object, so the
+     * boxed pointer points to it. */
+    if (IS_FUNC(*value)) {
+        *value = AS_FUNC(evacuate(heap, UNBOX_PTR(HeapObject *, *value), promote));
+    } else if (IS_STRING(*value)) {
+        *value = AS_STR(evacuate(heap, UNBOX_PTR(HeapObject *, *value), promote));
+    }
+}
+
+static void evacuate_children(Heap *heap, HeapObject *object, bool promote) {
+    if (object->type == HEAP_FUNCTION) {
+        Function *function = (Function *)object;
+        function->name = (String *)evacuate(heap, &function->name->obj, promote);
+    }
+}
+
+static void evacuate_roots(VM *vm, bool promote) {
+    Heap *heap = &vm->heap;
+    for (size_t i = 0; i < vm->tos; i++) {
+        evacuate_value(heap, &vm->stack[i], promote);
+    }
+    for (size_t i = 0; i < vm->globals_count; i++) {
+        evacuate_value(heap, &vm->globals[i], promote);
+    }
+    for (size_t i = 0; i < vm->frame_count; i++) {
+        Function *function = vm->frames[i].function;
+        vm->frames[i].function = (Function *)evacuate(heap, &function->obj, promote);
+    }
+    if (vm->chunk != NULL) {
+        InlineCache_DynArray *caches = &vm->chunk->caches;
+        for (size_t i = 0; i < caches->count; i++) {
+            evacuate_value(heap, &caches->data[i].callee, promote);
+            caches->data[i].function = (Function *)evacuate(heap, (HeapObject *)caches->data[i].function, promote);
+        }
+    }
+}
+
+static void collect_nursery(VM *vm, bool promote_all) {
+    Heap *heap = &vm->heap;
+    Space *from = &heap->survivors[heap->from];
+    Space *to = &heap->survivors[1 - heap->from];
+    size_t young_bytes = (heap->eden.top - heap->eden.start) + (from->top - from->start);
+    size_t promoted = heap->stats.bytes_promoted;
+
+    evacuate_roots(vm, promote_all);
+
+    /* Visit the children of everything that was moved until nothing
+     * new is moved: the survivor space in order, and the promoted
+     * objects through the gray list. */
+    char *scan = to->start;
+    while (scan < to->top || heap->gray.count > 0) {
+        if (scan < to->top) {
+            HeapObject *object = (HeapObject *)scan;
+            scan += object->size;
+            evacuate_children(heap, object, promote_all);
+        } else {
+            evacuate_children(heap, heap->gray.data[--heap->gray.count], true);
+        }
+    }
+
+    size_t survived = (to->top - to->start) + (heap->stats.bytes_promoted - promoted);
+    heap->stats.bytes_reclaimed += young_bytes - survived;
+    heap->eden.top = heap->eden.start;
+    from->top = from->start;
+    heap->from = 1 - heap->from;
+    heap->stats.minor_collections++;
+}
+
+/* Major collections. */
+
+static void mark_object(Heap *heap, HeapObject *object) {
+    if (object == NULL || object->marked) return;
+    object->marked = true;
+    dynarray_insert(&heap->gray, object);
+}
+
+static void mark_value(Heap *heap, Object value) {
+    if (IS_FUNC(value) || IS_STRING(value)) {
+        mark_object(heap, UNBOX_PTR(HeapObject *, value));
+    }
+}
+
+static void mark_roots(VM *vm) {
+    Heap *heap = &vm->heap;
+    for (size_t i = 0; i < vm->tos; i++) {
+        mark_value(heap, vm->stack[i]);
+    }
+    for (size_t i = 0; i < vm->globals_count; i++) {
+        mark_value(heap, vm->globals[i]);
+    }
+    for (size_t i = 0; i < vm->frame_count; i++) {
+        mark_object(heap, &vm->frames[i].function->obj);
+    }
+    BytecodeChunk *chunk = vm->chunk;
+    if (chunk != NULL) {
+        for (size_t i = 0; i < chunk->caches.count; i++) {
+            mark_value(heap, chunk->caches.data[i].callee);
+        }
+        for (size_t i = 0; i < chunk->sp.count; i++) {
+            mark_object(heap, &chunk->sp.data[i]->obj);
+        }
+        for (size_t i = 0; i < chunk->global_names.count; i++) {
+            mark_object(heap, &chunk->global_names.data[i]->obj);
+        }
+    }
+}
+
+static void sweep(Heap *heap) {
+    HeapObject **link = &heap->old;
+    while (*link != NULL) {
+        HeapObject *object = *link;
+        if (object->marked) {
+            object->marked = false;
+            link = &object->next;
+        } else {
+            *link = object->next;
+            heap->old_bytes -= object->size;
+            heap->stats.bytes_reclaimed += object->size;
+            free(object);
+        }
+    }
+}
+
+static void collect_old(VM *vm) {
+    Heap *heap = &vm->heap;
+
+    /* Empty the nursery first, so that only old objects are left. */
+    collect_nursery(vm, true);
+
+    mark_roots(vm);
+    while (heap->gray.count > 0) {
+        HeapObject *object = heap->gray.data[--heap->gray.count];
+        if (object->type == HEAP_FUNCTION) {
+            mark_object(heap, &((Function *)object)->name->obj);
+        }
+    }
+
+    table_remove_unmarked(&heap->strings);
+    sweep(heap);
+
+    heap->next_major = heap->old_bytes * heap->options.heap_growth;
+    if (heap->next_major < heap->options.heap_size) {
+        heap->next_major = heap->options.heap_size;
+    }
+    heap->stats.major_collections++;
+}
+
+void collect_garbage(VM *vm, bool major) {
+    Heap *heap = &vm->heap;
+    uint64_t start = now_ns();
+
+    /* Stack slots above the roots are dead, but a later frame could
+     * take them as registers without writing them first, and then see
+     * a freed or moved object. Clearing them keeps that from ever
+     * happening. */
+    for (size_t i = vm->tos; i < vm->stack_size; i++) {
+        vm->stack[i] = NULL_VAL;
+    }
+
+    if (!major) {
+        collect_nursery(vm, false);
+    }
+    if (major || heap->old_bytes >= heap->next_major) {
+        collect_old(vm);
+    }
+
+    uint64_t pause = now_ns() - start;
+    heap->stats.total_pause_ns += pause;
+    if (pause > heap->stats.max_pause_ns) {
+        heap->stats.max_pause_ns = pause;
+    }
+}
+
+/* Allocation. */
+
+static HeapObject *allocate(VM *vm, HeapObjectType type, size_t size) {
+    Heap *heap = &vm->heap;
+    size = ALIGN(size);
+    heap->stats.bytes_allocated += size;
+
+    HeapObject *object;
+    if (size > (size_t)(heap->eden.end - heap->eden.start)) {
+        /* Too big for the nursery. */
+        if (heap->old_bytes + size >= heap->next_major) {
+            collect_garbage(vm, true);
+        }
+        object = allocate_old(heap, size);
+    } else {
+        if (heap->eden.top + size > heap->eden.end) {
+            collect_garbage(vm, false);
+        }
+        object = (HeapObject *)heap->eden.top;
+        heap->eden.top += size;
+        object->next = NULL;
+    }
+    init_header(object, type, size);
+    return object;
+}
+
+String *intern_string(Heap *heap, const char *chars, size_t length) {
+    uint32_t hash = hash_string(chars, length);
+    String *string = table_find_string(&heap->strings, chars, length, hash);
+    if (string != NULL) {
+        return string;
+    }
+
+    size_t size = ALIGN(sizeof(String) + length + 1);
+    heap->stats.bytes_allocated += size;
+    string = (String *)allocate_old(heap, size);
+    init_header(&string->obj, HEAP_STRING, size);
+    string->length = length;
+    string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    table_insert(&heap->strings, string, NULL_VAL);
+    return string;
+}
+
+Function *new_function(VM *vm, String *name, CodeObject *code) {
+    Function *function = (Function *)allocate(vm, HEAP_FUNCTION, sizeof(Function));
+    function->name = name;
+    function->code = code;
+    return function;
+}
+
+void print_gc_stats(const Heap *heap) {
+    const GCStats *stats = &heap->stats;
+    fprintf(stderr, "gc: %zu minor, %zu major collections\n",
+        stats->minor_collections, stats->major_collections);
+    fprintf(stderr, "gc: pauses %.3f ms total, %.3f ms max\n",
+        stats->total_pause_ns / 1e6, stats->max_pause_ns / 1e6);
+    fprintf(stderr, "gc: %zu bytes allocated, %zu reclaimed, %zu promoted\n",
+        stats->bytes_allocated, stats->bytes_reclaimed, stats->bytes_promoted);
+    fprintf(stderr, "gc: %zu bytes in the old generation, next major collection at %zu\n",
+        heap->old_bytes, heap->next_major);
+}
@@ -0,0 +1,96 @@
+#ifndef venom_gc_h
+#define venom_gc_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "dynarray.h"
+#include "object.h"
+#include "table.h"
+
+/* The heap has two generations.
+ *
+ * New objects are bump-allocated in the nursery ('eden'). When it
+ * fills up, a minor collection copies the live ones out, Cheney style,
+ * into one of two survivor spaces, and the nursery is reused from the
+ * start. An object that has survived 'promotion_age' minor collections,
+ * or that doesn't fit in the survivor space, is promoted instead: it
+ * is copied to the old generation, together with everything it points
+ * to, so that an old object never points into the nursery.
+ *
+ * Old objects are individually allocated and linked into a list. Once
+ * the old generation has grown past 'next_major' bytes, a major
+ * collection empties the nursery into it and then marks and sweeps
+ * it. The threshold is then set to the surviving bytes times
+ * 'heap_growth'.
+ *
+ * Strings are made by the compiler and are allocated straight in the
+ * old generation. The intern table holds them weakly.
+ *
+ * The roots are the live part of the VM stack, the globals, the call
+ * frames, and the chunk's string pool, global names and call-site
+ * caches. */
+
+typedef struct {
+    size_t nursery_size;  /* bytes; each survivor space is a quarter of it */
+    unsigned promotion_age;
+    size_t heap_size;  /* old generation bytes before the first major collection */
+    double heap_growth;
+} GCOptions;
+
+#define DEFAULT_GC_OPTIONS ((GCOptions){ \
+    .nursery_size = 256 * 1024, \
+    .promotion_age = 2, \
+    .heap_size = 1024 * 1024, \
+    .heap_growth = 2.0, \
+})
+
+typedef struct {
+    size_t minor_collections;
+    size_t major_collections;
+    uint64_t total_pause_ns;
+    uint64_t max_pause_ns;
+    size_t bytes_allocated;
+    size_t bytes_reclaimed;
+    size_t bytes_promoted;
+} GCStats;
+
+typedef struct {
+    char *start;
+    char *top;
+    char *end;
+} Space;
+
+typedef DynArray(HeapObject *) HeapObject_DynArray;
+
+typedef struct Heap {
+    GCOptions options;
+    Space eden;
+    Space survivors[2];
+    int from;  /* the survivor space that holds the nursery's survivors */
+    HeapObject *old;  /* every object in the old generation */
+    size_t old_bytes;
+    size_t next_major;
+    HeapObject_DynArray gray;  /* objects whose children are still to be visited */
+    Table strings;  /* the intern table */
+    GCStats stats;
+} Heap;
+
+struct VM;
+
+void init_heap(Heap *heap, const GCOptions *options);
+void free_heap(Heap *heap);
+
+/* Returns the string with the given contents, making it first if it
+ * doesn't exist. Never collects, so it is safe to call from the
+ * compiler. */
+String *intern_string(Heap *heap, const char *chars, size_t length);
+
+/* May collect, so every live object must be reachable from the VM's
+ * roots when it is called. */
+Function *new_function(struct VM *vm, String *name, struct CodeObject *code);
+
+void collect_garbage(struct VM *vm, bool major);
+void print_gc_stats(const Heap *heap);
+
+#endif
\ No newline at end of file
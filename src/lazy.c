@@ -0,0 +1,73 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include "compiler.h"
+#include "dynarray.h"
+#include "lazy.h"
+#include "optimizer.h"
+#include "parallel.h"
+#include "parser.h"
+#include "regcompiler.h"
+#include "tokenizer.h"
+
+void defer_function(Ast *ast, BytecodeChunk *chunk, CodeObject *code, FunctionStatement *fn) {
+    LazyFunction *lazy = AST_NODE(ast, LazyFunction, fn->lazy);
+    code->source = lazy->source;
+    code->line = lazy->line;
+    code->constants = lazy->constants;
+
+    /* A body compiled ahead of time is merged right here, where the
+     * serial compiler would have compiled it, so that it numbers its
+     * strings, globals and call sites the same. */
+    Frontend *frontend = chunk->frontend;
+    if (frontend != NULL && frontend->next_unit < frontend->unit_count) {
+        merge_unit(chunk, code, &frontend->units[frontend->next_unit++]);
+    }
+}
+
+bool compile_declaration(const Frontend *frontend, Ast *ast, BytecodeChunk *chunk, CodeObject *code) {
+    /* The declaration is parsed again, from its name on. */
+    Tokenizer tokenizer;
+    init_tokenizer(&tokenizer, (char *)code->source.start);
+    tokenizer.line = code->line;
+    Parser parser;
+    init_parser(&parser, &tokenizer, ast);
+    Statement_DynArray stmts = {0};
+    dynarray_insert(&stmts, parse_function(&parser, &tokenizer));
+    bool ok = !parser.had_error;
+    free_parser(&parser);
+
+    /* The body sees the constants that were declared before the
+     * function. Those are never dropped, since they are global. */
+    if (ok) {
+        Optimizer optimizer;
+        init_optimizer(&optimizer, ast);
+        import_constants(&optimizer, frontend->optimizer, code->constants);
+        optimize(&optimizer, &stmts);
+        ok = !optimizer.had_error;
+        free_optimizer(&optimizer);
+    }
+
+    if (ok) {
+        if (frontend->registers) {
+            ok = compile_reg_function(ast, chunk, code, &stmts.data[0].as.stmt_fn);
+        } else {
+            ok = compile_function(ast, chunk, code, &stmts.data[0].as.stmt_fn);
+        }
+    }
+    if (ok) {
+        code->source.start = NULL;
+    }
+
+    dynarray_free(&stmts);
+    return ok;
+}
+
+bool compile_lazy(BytecodeChunk *chunk, CodeObject *code) {
+    /* The nodes of the body are only needed until it is compiled, so
+     * they go at the end of the AST, which is cut back after. */
+    Ast *ast = chunk->frontend->ast;
+    size_t mark = ast->count;
+    bool ok = compile_declaration(chunk->frontend, ast, chunk, code);
+    ast->count = mark;
+    return ok;
+}
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef venom_lazy_h
+#define venom_lazy_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "compiler.h"
+#include "optimizer.h"
+#include "parser.h"
+
+struct Unit;
+
+/* Top-level function bodies are only checked for syntax errors up
+ * front, without building any AST, and a function is parsed, checked
+ * and compiled the first time it is called, so that a program does not
+ * pay for the functions that it never calls. Other errors in a body,
+ * such as a constant that isn't constant, are reported then. That
+ * needs the source, the AST that the constants are folded into and
+ * the constants themselves to stay around while the program runs.
+ *
+ * A cache has to hold the code of every function, so this is only
+ * done when the program isn't cached: with --no-cache, --stream, or
+ * when it is read from standard input.
+ *
+ * The bodies may also have been compiled ahead of time, on other
+ * threads (see parallel.h), in which case they are merged into the
+ * chunk in the order the compiler reaches them. */
+typedef struct Frontend {
+    Ast *ast;
+    Optimizer *optimizer;
+    bool registers;  /* which bytecode the chunk has */
+    struct Unit *units;
+    size_t unit_count;
+    size_t next_unit;  /* the unit of the next function the compiler reaches */
+} Frontend;
+
+/* Called by the compilers for a function whose body is deferred:
+ * either merges the body compiled ahead of time into 'code' or leaves
+ * it for the first call. */
+void defer_function(Ast *ast, BytecodeChunk *chunk, CodeObject *code, FunctionStatement *fn);
+
+/* Parses the declaration of 'code' again, this time with the body,
+ * into 'ast', checks it with the constants it can see, and compiles
+ * it into 'code' and 'chunk'. Returns false, having reported the
+ * error, if the body has errors. Only reads the front end, so several
+ * threads may compile at once, each into an AST and a chunk of its
+ * own. */
+bool compile_declaration(const Frontend *frontend, Ast *ast, BytecodeChunk *chunk, CodeObject *code);
+
+/* Compiles the body of 'code', a function of 'chunk' that has not been
+ * compiled yet, on its first call. */
+bool compile_lazy(BytecodeChunk *chunk, CodeObject *code);
+
+#endif
\ No newline at end of file
@@ -1,69 +1,538 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.h"
 #include "compiler.h"
 #include "dynarray.h"
+#include "lazy.h"
 #include "tokenizer.h"
+#include "optimizer.h"
+#include "parallel.h"
 #include "parser.h"
+#include "profile.h"
+#include "regcompiler.h"
 #include "vm.h"
 
-static char *read_file(const char *path) {
-    FILE *file = fopen(path, "rb");
-    if (file == NULL) {
+static char *map_file(const char *path, size_t *size, size_t *mapped) {
+    /* The file is mapped rather than read, so its pages are only
+     * loaded as the tokenizer reaches them, and never copied. The
+     * tokenizer needs TOKENIZER_PADDING zero bytes after the source,
+     * which the file doesn't have, so we first reserve zeroed memory
+     * for the source and the padding, and then map the file over the
+     * start of it. The kernel zeroes the rest of the last file page.
+     * The source is '*size' bytes long, and the caller unmaps the
+     * '*mapped' bytes at the returned address. */
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
         fprintf(stderr, "Could not open file \"%s\".\n", path);
         exit(74);
     }
 
-    fseek(file, 0L, SEEK_END);
-    size_t size = ftell(file);
-    rewind(file);
-
-    char *buffer = malloc(size+1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
         exit(74);
     }
 
-    size_t bytes_read = fread(buffer, 1, size, file);
-    if (bytes_read < size) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
+    *size = st.st_size;
+    size_t page = sysconf(_SC_PAGESIZE);
+    *mapped = (*size + TOKENIZER_PADDING + page - 1) / page * page;
+    char *source = mmap(NULL, *mapped, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (source == MAP_FAILED
+            || (*size > 0 && mmap(source, *size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        fprintf(stderr, "Could not map file \"%s\".\n", path);
         exit(74);
     }
 
-    buffer[bytes_read] = '\0';
-
-    fclose(file);
-    return buffer;
+    close(fd);
+    return source;
 }
 
-void run_file(char *file) {
-    char *source = read_file(file);
+static bool run_chunk(VM *vm, BytecodeChunk *chunk, bool registers, size_t start) {
+    /* The profiling loops are picked here, once per run, rather than
+     * in the loops, which stay as they are without a profile. */
+    if (vm->profile != NULL) {
+        return registers ? run_registers_profiled(vm, chunk, start) : run_profiled(vm, chunk, start);
+    }
+    return registers ? run_registers(vm, chunk, start) : run(vm, chunk, start);
+}
 
+static bool compile_source(char *source, Frontend *frontend, bool lazy, int jobs, BytecodeChunk *chunk) {
+    /* Runs the front end over the whole source at once. If 'lazy' is
+     * set, the syntax of the bodies of top-level functions is checked,
+     * but they are only parsed and compiled on their first call, and
+     * the chunk keeps the front end for that. Otherwise, with more than
+     * one job, they are skipped by the parser and compiled on that many
+     * threads first, and merged in as the top level is compiled.
+     * Returns false if the program has errors. */
+    bool parallel = !lazy && jobs > 1;
     Statement_DynArray stmts = {0};
     Parser parser;
     Tokenizer tokenizer;
     init_tokenizer(&tokenizer, source);
-    parse(&parser, &tokenizer, &stmts);
+    parse(&parser, &tokenizer, frontend->ast, &stmts, lazy ? BODY_DEFER : parallel ? BODY_SKIP : BODY_PARSE);
 
-    Compiler compiler;
-    BytecodeChunk chunk;
-    init_chunk(&chunk);
+    optimize(frontend->optimizer, &stmts);
+    if (parser.had_error || frontend->optimizer->had_error
+            || (parallel && !compile_units(frontend, &stmts, jobs))) {
+        if (parallel) {
+            free_units(frontend);
+        }
+        dynarray_free(&stmts);
+        return false;
+    }
 
-    for (size_t i = 0; i < stmts.count; i++) {
-        compile(&compiler, &chunk, stmts.data[i], false);
-        free_stmt(stmts.data[i]);
+    chunk->frontend = frontend;
+
+    bool ok;
+    if (frontend->registers) {
+        RegCompiler compiler;
+        init_reg_compiler(&compiler, frontend->ast, &chunk->main);
+        for (size_t i = 0; i < stmts.count; i++) {
+            compile_registers(&compiler, chunk, stmts.data[i], false);
+        }
+        finish_reg_chunk(chunk, 0);
+        ok = !compiler.had_error;
+    } else {
+        Compiler compiler;
+        init_compiler(&compiler, frontend->ast, &chunk->main);
+        for (size_t i = 0; i < stmts.count; i++) {
+            compile(&compiler, chunk, stmts.data[i], false);
+        }
+        finish_chunk(chunk, 0);
+        ok = !compiler.had_error;
     }
 
+    dynarray_free(&stmts);
+    if (parallel) {
+        free_units(frontend);
+    }
+    if (!lazy || !ok) {
+        chunk->frontend = NULL;
+    }
+    return ok;
+}
+
+int run_file(char *file, bool registers, bool use_cache, bool verify_cache, int jobs, bool gc_stats, VMOptions *options) {
+    size_t size, mapped;
+    char *source = map_file(file, &size, &mapped);
+
+    /* The VM is made first because its heap holds the strings that
+     * the compiler interns. */
     VM vm;
-    init_vm(&vm);
-    run(&vm, &chunk);
+    init_vm(&vm, options);
 
-    dynarray_free(&stmts);
+    BytecodeChunk chunk;
+    init_chunk(&chunk, &vm.heap);
+
+    Ast ast;
+    init_ast(&ast);
+    Optimizer optimizer;
+    init_optimizer(&optimizer, &ast);
+    Frontend frontend = { .ast = &ast, .optimizer = &optimizer, .registers = registers };
+
+    /* The front end only runs if there is no cache that matches the
+     * source, and then it replaces the cache. A cache has to hold
+     * every function, since a later run has no AST to compile them
+     * from, so functions are only compiled on their first call when
+     * there is no cache, and the front end runs on a single thread. */
+    char *cache = use_cache ? cache_path(file, registers) : NULL;
+    CacheHeader key = cache_key(source, size, registers);
+    if (cache == NULL || !load_cache(cache, &key, verify_cache, &chunk)) {
+        if (!compile_source(source, &frontend, cache == NULL && jobs <= 1, jobs, &chunk)) {
+            free(cache);
+            free_optimizer(&optimizer);
+            free_ast(&ast);
+            free_chunk(&chunk);
+            free_vm(&vm);
+            munmap(source, mapped);
+            return 1;
+        }
+        if (cache != NULL) {
+            write_cache(cache, &key, &chunk);
+        }
+    }
+    free(cache);
+
+    /* Unless the chunk still needs it, the whole tree goes at once. */
+    if (chunk.frontend == NULL) {
+        free_optimizer(&optimizer);
+        free_ast(&ast);
+    }
+
+    bool ok = run_chunk(&vm, &chunk, registers, 0);
+
+    if (gc_stats) {
+        print_gc_stats(&vm.heap);
+    }
+    if (vm.profile != NULL) {
+        report_profile(vm.profile, &chunk, registers, stderr, options->profile_path);
+    }
+
+    if (chunk.frontend != NULL) {
+        free_optimizer(&optimizer);
+        free_ast(&ast);
+    }
     free_chunk(&chunk);
     free_vm(&vm);
-    free(source);
+    munmap(source, mapped);
+    return ok ? 0 : 1;
+}
+
+/* Running a program as it is read. Each top-level statement is
+ * parsed, checked, compiled and run before the next one is parsed,
+ * so output starts as soon as the first statement is in, and the AST
+ * never holds more than one statement, plus the constants, whose
+ * folded values the statements after them still read. */
+typedef struct {
+    bool registers;
+    VM vm;
+    BytecodeChunk chunk;
+    Ast ast;
+    Optimizer optimizer;
+    Compiler compiler;
+    RegCompiler reg_compiler;
+    Statement_DynArray stmts;  /* the statement being run */
+    Frontend frontend;  /* for the functions, which are compiled lazily */
+} Stream;
+
+static void init_stream(Stream *stream, bool registers, VMOptions *options) {
+    stream->registers = registers;
+    init_vm(&stream->vm, options);
+    init_chunk(&stream->chunk, &stream->vm.heap);
+    init_ast(&stream->ast);
+    init_optimizer(&stream->optimizer, &stream->ast);
+    init_compiler(&stream->compiler, &stream->ast, &stream->chunk.main);
+    init_reg_compiler(&stream->reg_compiler, &stream->ast, &stream->chunk.main);
+    stream->stmts = (Statement_DynArray){0};
+    stream->frontend = (Frontend){
+        .ast = &stream->ast,
+        .optimizer = &stream->optimizer,
+        .registers = registers,
+    };
+    stream->chunk.frontend = &stream->frontend;
+}
+
+static void free_stream(Stream *stream) {
+    dynarray_free(&stream->stmts);
+    free_optimizer(&stream->optimizer);
+    free_ast(&stream->ast);
+    free_chunk(&stream->chunk);
+    free_vm(&stream->vm);
+}
+
+static bool run_statements(Stream *stream, char *source, int line) {
+    /* Runs every statement in 'source', which starts at 'line' of the
+     * program. Returns false at the first error, after which nothing
+     * else is run. The source has to stay around until the stream is
+     * freed, since the constants refer to it. */
+    Tokenizer tokenizer;
+    init_tokenizer(&tokenizer, source);
+    tokenizer.line = line;
+    Parser parser;
+    init_parser(&parser, &tokenizer, &stream->ast);
+    parser.bodies = BODY_DEFER;
+
+    bool ok = true;
+    while (ok && parser.current.type != TOKEN_EOF) {
+        size_t mark = stream->ast.count;
+        size_t constants = stream->optimizer.constants.count;
+
+        stream->stmts.count = 0;
+        dynarray_insert(&stream->stmts, parse_statement(&parser, &tokenizer));
+        if (parser.had_error) {
+            ok = false;
+            break;
+        }
+        optimize(&stream->optimizer, &stream->stmts);
+        if (stream->optimizer.had_error) {
+            ok = false;
+            break;
+        }
+
+        /* A constant declaration is folded away entirely. */
+        if (stream->stmts.count > 0) {
+            size_t start = stream->chunk.main.code.count;
+            if (stream->registers) {
+                compile_registers(&stream->reg_compiler, &stream->chunk, stream->stmts.data[0], false);
+                finish_reg_chunk(&stream->chunk, start);
+                ok = !stream->reg_compiler.had_error;
+            } else {
+                compile(&stream->compiler, &stream->chunk, stream->stmts.data[0], false);
+                finish_chunk(&stream->chunk, start);
+                ok = !stream->compiler.had_error;
+            }
+            ok = ok && run_chunk(&stream->vm, &stream->chunk, stream->registers, start);
+        }
+
+        /* The statement's nodes are not needed anymore, unless it
+         * declared a constant. */
+        if (stream->optimizer.constants.count == constants) {
+            stream->ast.count = mark;
+        }
+    }
+
+    free_parser(&parser);
+    return ok;
+}
+
+int stream_file(char *file, bool registers, bool gc_stats, VMOptions *options) {
+    size_t size, mapped;
+    char *source = map_file(file, &size, &mapped);
+
+    Stream stream;
+    init_stream(&stream, registers, options);
+    bool ok = run_statements(&stream, source, 1);
+    if (gc_stats) {
+        print_gc_stats(&stream.vm.heap);
+    }
+    if (stream.vm.profile != NULL) {
+        report_profile(stream.vm.profile, &stream.chunk, registers, stderr, options->profile_path);
+    }
+    free_stream(&stream);
+
+    munmap(source, mapped);
+    return ok ? 0 : 1;
+}
+
+/* Standard input is read as it arrives, in pieces of up to this many
+ * bytes. */
+#define INPUT_CHUNK 65536
+
+typedef DynArray(char *) Source_DynArray;
+
+/* The text read from standard input that has not been run yet. It is
+ * always followed by TOKENIZER_PADDING zero bytes. */
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+    size_t complete;  /* the text up to here is whole top-level statements */
+    size_t scanned;  /* the text up to here is whole tokens */
+    /* The state of the scan at 'scanned'. */
+    int depth;  /* of braces */
+    bool has_if;  /* the statement has an 'if' outside of braces */
+    bool ended;  /* the statement has ended, unless 'else' comes next */
+} Input;
+
+static void find_statements(Input *input) {
+    /* A top-level statement ends at a ';' or '}' outside of braces.
+     * If there is an 'if' outside of braces, an 'else' can still come
+     * after that, so then the statement only ends at the next token
+     * that is not 'else'. A token is only scanned once some text
+     * follows it, since otherwise it might be cut short. A string that
+     * is still open would be a tokenizing error, so the scan stops at
+     * its opening quote. There are no escapes in strings, so the quote
+     * is the last one if there is an odd number of them. */
+    char *end = input->text + input->length;
+    int quotes = 0;
+    for (char *c = input->text + input->scanned; c < end; c++) {
+        if (*c == '"') quotes++;
+    }
+    if (quotes % 2 == 1) {
+        while (*--end != '"');
+        *end = '\0';
+    }
+
+    Tokenizer tokenizer;
+    init_tokenizer(&tokenizer, input->text + input->scanned);
+    for (Token token = get_token(&tokenizer);
+            token.type != TOKEN_EOF && token.start + token.length < end;
+            token = get_token(&tokenizer)) {
+        if (input->ended) {
+            input->ended = false;
+            if (token.type != TOKEN_ELSE) {
+                input->complete = input->scanned;
+                input->has_if = false;
+            }
+        }
+
+        if (token.type == TOKEN_LEFT_BRACE) {
+            input->depth++;
+        } else if (token.type == TOKEN_RIGHT_BRACE) {
+            input->depth--;
+        } else if (token.type == TOKEN_IF && input->depth == 0) {
+            input->has_if = true;
+        }
+        input->scanned = token.start + token.length - input->text;
+
+        if (input->depth <= 0
+                && (token.type == TOKEN_SEMICOLON || token.type == TOKEN_RIGHT_BRACE)) {
+            /* A stray '}' is for the parser to report. */
+            input->depth = 0;
+            if (input->has_if) {
+                input->ended = true;
+            } else {
+                input->complete = input->scanned;
+            }
+        }
+    }
+
+    if (end < input->text + input->length) {
+        *end = '"';
+    }
+}
+
+static bool run_input(Stream *stream, Input *input, size_t length, Source_DynArray *sources, int *line) {
+    /* Runs the first 'length' bytes of the input and drops them. They
+     * are copied out first, because the constants keep pointing into
+     * their text. */
+    char *source = malloc(length + TOKENIZER_PADDING);
+    memcpy(source, input->text, length);
+    memset(source + length, '\0', TOKENIZER_PADDING);
+    dynarray_insert(sources, source);
+
+    memmove(input->text, input->text + length, input->length - length + TOKENIZER_PADDING);
+    input->length -= length;
+    input->scanned = input->scanned > length ? input->scanned - length : 0;
+    input->complete = 0;
+
+    bool ok = run_statements(stream, source, *line);
+    for (size_t i = 0; i < length; i++) {
+        if (source[i] == '\n') ++*line;
+    }
+    return ok;
+}
+
+int stream_stdin(bool registers, bool gc_stats, VMOptions *options) {
+    /* Standard input may be a pipe or a terminal, so it can't be mapped
+     * and isn't read to the end first. Whenever some of it arrives, the
+     * whole statements at the start of what has not been run yet are
+     * run, and the rest waits for more. */
+    Input input = {0};
+    input.capacity = INPUT_CHUNK + TOKENIZER_PADDING;
+    input.text = calloc(input.capacity, 1);
+    Source_DynArray sources = {0};
+    int line = 1;
+
+    Stream stream;
+    init_stream(&stream, registers, options);
+
+    bool ok = true;
+    for (;;) {
+        if (input.length + INPUT_CHUNK + TOKENIZER_PADDING > input.capacity) {
+            input.capacity *= 2;
+            input.text = realloc(input.text, input.capacity);
+        }
+        /* Whatever has been printed so far goes out before we wait. */
+        fflush(stdout);
+        ssize_t count = read(STDIN_FILENO, input.text + input.length, INPUT_CHUNK);
+        if (count < 0) {
+            fprintf(stderr, "Could not read standard input.\n");
+            ok = false;
+            break;
+        }
+        if (count == 0) {
+            /* Whatever is left is the last statement, or an error. */
+            ok = run_input(&stream, &input, input.length, &sources, &line);
+            break;
+        }
+        input.length += count;
+        memset(input.text + input.length, '\0', TOKENIZER_PADDING);
+
+        find_statements(&input);
+        if (input.complete > 0 && !run_input(&stream, &input, input.complete, &sources, &line)) {
+            ok = false;
+            break;
+        }
+    }
+
+    if (gc_stats) {
+        print_gc_stats(&stream.vm.heap);
+    }
+    if (stream.vm.profile != NULL) {
+        report_profile(stream.vm.profile, &stream.chunk, registers, stderr, options->profile_path);
+    }
+    free_stream(&stream);
+
+    for (size_t i = 0; i < sources.count; i++) {
+        free(sources.data[i]);
+    }
+    dynarray_free(&sources);
+    free(input.text);
+    return ok ? 0 : 1;
+}
+
+#define DEFAULT_PROFILE_PATH "profile.json"
+
+static void usage(void) {
+    printf(
+        "Usage: venom [--registers] [--stack-size=N] [--max-stack-size=N]\n"
+        "             [--nursery-size=N] [--promotion-age=N] [--heap-size=N]\n"
+        "             [--heap-growth=F] [--gc-stats] [--stream] [--no-cache]\n"
+        "             [--verify-cache] [--jobs=N] [--profile-ops[=FILE]] [file]\n"
+        "\n"
+        "With --stream, each top-level statement runs as soon as it is\n"
+        "compiled. Without a file, or with '-', the program is streamed\n"
+        "from standard input. Otherwise, the compiled file is cached in\n"
+        "the same directory, with a 'c' appended to its name ('rc' with\n"
+        "--registers), unless --no-cache is given. A damaged cache is\n"
+        "rebuilt. With --verify-cache, the stack depth of its code is\n"
+        "checked too. With --jobs, its top-level functions are compiled\n"
+        "on N threads.\n"
+        "\n"
+        "With --profile-ops, every instruction run is counted and timed,\n"
+        "a summary is printed to stderr at the end, and the counts are\n"
+        "written to FILE (" DEFAULT_PROFILE_PATH " by default) as JSON.\n"
+    );
 }
 
 int main(int argc, char *argv[]) {
-    if (argc == 2) run_file(argv[1]);
-    else printf("Usage: venom [file]\n");
+    char *file = NULL;
+    bool registers = false;
+    bool gc_stats = false;
+    bool stream = false;
+    bool use_cache = true;
+    bool verify_cache = false;
+    int jobs = 1;
+    VMOptions options = DEFAULT_VM_OPTIONS;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--registers") == 0) {
+            registers = true;
+        } else if (strncmp(argv[i], "--stack-size=", 13) == 0) {
+            options.stack_size = strtoul(argv[i] + 13, NULL, 10);
+        } else if (strncmp(argv[i], "--max-stack-size=", 17) == 0) {
+            options.max_stack_size = strtoul(argv[i] + 17, NULL, 10);
+        } else if (strncmp(argv[i], "--nursery-size=", 15) == 0) {
+            options.gc.nursery_size = strtoul(argv[i] + 15, NULL, 10);
+        } else if (strncmp(argv[i], "--promotion-age=", 16) == 0) {
+            options.gc.promotion_age = strtoul(argv[i] + 16, NULL, 10);
+        } else if (strncmp(argv[i], "--heap-size=", 12) == 0) {
+            options.gc.heap_size = strtoul(argv[i] + 12, NULL, 10);
+        } else if (strncmp(argv[i], "--heap-growth=", 14) == 0) {
+            options.gc.heap_growth = strtod(argv[i] + 14, NULL);
+        } else if (strcmp(argv[i], "--gc-stats") == 0) {
+            gc_stats = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = false;
+        } else if (strcmp(argv[i], "--verify-cache") == 0) {
+            verify_cache = true;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+        } else if (strcmp(argv[i], "--profile-ops") == 0) {
+            options.profile_path = DEFAULT_PROFILE_PATH;
+        } else if (strncmp(argv[i], "--profile-ops=", 14) == 0) {
+            options.profile_path = argv[i] + 14;
+        } else if (file == NULL) {
+            file = argv[i];
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (file == NULL || strcmp(file, "-") == 0) {
+        return stream_stdin(registers, gc_stats, &options);
+    }
+    if (stream) {
+        return stream_file(file, registers, gc_stats, &options);
+    }
+    return run_file(file, registers, use_cache, verify_cache, jobs, gc_stats, &options);
 }
\ No newline at end of file
@@ -1,19 +1,92 @@
 #include <stdio.h>
 #include "object.h"
 
+int format_number(double number, char *buffer) {
+    /* The number is m * 2^e exactly, and what "%.2f" prints is the
+     * integer nearest to m * 2^e * 100, ties to even, with the point
+     * put before its last two digits. While that integer fits in 64
+     * bits, it is worked out exactly with a multiplication and a
+     * shift, which is many times faster than printf. */
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    int exponent = (bits >> 52) & 0x7FF;
+    uint64_t mantissa = bits & ((UINT64_C(1) << 52) - 1);
+    int e;
+    if (exponent == 0) {
+        e = -1074;
+    } else {
+        mantissa |= UINT64_C(1) << 52;
+        e = exponent - 1075;
+    }
+
+    /* m < 2^53, so m * 100 < 2^60 always fits, and m * 2^e * 100
+     * does as long as e <= 4. Anything bigger, and the infinities and
+     * NaN, are rare enough to leave to snprintf. */
+    if (exponent == 0x7FF || e > 4) {
+        return snprintf(buffer, NUMBER_BUFFER_SIZE, "%.2f", number);
+    }
+    uint64_t hundredths;
+    if (e >= 0) {
+        hundredths = (mantissa << e) * 100;
+    } else if (e > -62) {
+        uint64_t scaled = mantissa * 100;
+        int shift = -e;
+        hundredths = scaled >> shift;
+        uint64_t rest = scaled & ((UINT64_C(1) << shift) - 1);
+        uint64_t half = UINT64_C(1) << (shift - 1);
+        if (rest > half || (rest == half && (hundredths & 1))) {
+            hundredths++;
+        }
+    } else {
+        /* Less than 2^60 / 2^62 of a hundredth rounds to 0. */
+        hundredths = 0;
+    }
+
+    /* The digits come out backwards, at least three of them. */
+    char digits[24];
+    int count = 0;
+    do {
+        digits[count++] = '0' + hundredths % 10;
+        hundredths /= 10;
+    } while (hundredths > 0 || count < 3);
+
+    int length = 0;
+    if (bits >> 63) {
+        buffer[length++] = '-';
+    }
+    while (count > 2) {
+        buffer[length++] = digits[--count];
+    }
+    buffer[length++] = '.';
+    buffer[length++] = digits[1];
+    buffer[length++] = digits[0];
+    buffer[length] = '\0';
+    return length;
+}
+
 void print_object(Object *object) {
-    if IS_BOOL(object) {
-        printf("%s", object->as.bval ? "true" : "false");
-    } else if IS_NUM(object) {
-        printf("%.2f", object->as.dval);
-    } else if IS_FUNC(object) {
-        printf("<fn %s", object->as.func.name);    
-        printf(" @ %d>", object->as.func.location);   
-    } else if IS_POINTER(object) {
-        printf("PTR ('%d')", *object->as.ptr);
-    } else if IS_NULL(object) {
+    if (IS_BOOL(*object)) {
+        printf("%s", BOOL_VAL(*object) ? "true" : "false");
+    } else if (IS_NUM(*object)) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        format_number(NUM_VAL(*object), buffer);
+        printf("%s", buffer);
+    } else if (IS_FUNC(*object)) {
+        printf("<fn %s>", FUNC_VAL(*object)->name->chars);
+    } else if (IS_NULL(*object)) {
         printf("null");
-    } else if IS_STRING(object) {
-        printf("%s", object->as.str);
+    } else if (IS_STRING(*object)) {
+        printf("%s", STR_VAL(*object)->chars);
+    }
+}
+
+bool objects_equal(Object a, Object b) {
+    /* Numbers are compared as doubles so that 0 == -0 and NaN != NaN.
+     * Everything else is equal only if the boxed bits are: booleans
+     * and null by value, heap objects by address. Strings are interned,
+     * so comparing their addresses compares their contents. */
+    if (IS_NUM(a) && IS_NUM(b)) {
+        return NUM_VAL(a) == NUM_VAL(b);
     }
+    return a == b;
 }
\ No newline at end of file
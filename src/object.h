@@ -3,56 +3,121 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include "dynarray.h"
 
+/* Every value is NaN-boxed into 64 bits. Any double that is not a
+ * quiet NaN with the bits in QNAN set is stored as is. Everything
+ * else lives inside that NaN space:
+ *
+ *   null, false, true:  QNAN | 1, 2, 3
+ *   undefined:          QNAN | 4 (marks unset global slots)
+ *   heap pointers:      SIGN_BIT | QNAN | tag << 48 | 48-bit address
+ *
+ * The pointer tag distinguishes strings from functions. x86-64 and
+ * AArch64 user-space addresses fit in the low 48 bits, which is what
+ * makes this work. */
+typedef uint64_t Object;
+
 typedef enum {
-    OBJ_NUMBER,
-    OBJ_BOOLEAN,
-    OBJ_FUNCTION,
-    OBJ_POINTER,
-    OBJ_STRING,
-    OBJ_NULL,
-} ObjectType;
-
-typedef struct Object Object;
-
-typedef struct {
-    char *name;
-    uint8_t location;
-    size_t paramcount;
+    HEAP_STRING,
+    HEAP_FUNCTION,
+} HeapObjectType;
+
+/* Every object on the garbage-collected heap (see gc.h) starts with
+ * this header. */
+typedef struct HeapObject {
+    /* In the old generation, the next old object. In the nursery,
+     * the new address of the object once a collection has moved it. */
+    struct HeapObject *next;
+    uint32_t size;  /* in bytes, header included */
+    uint8_t type;
+    uint8_t age;  /* minor collections survived */
+    bool marked;
+    bool forwarded;
+} HeapObject;
+
+/* Strings are immutable and interned: the heap's intern table holds
+ * the only String with any given contents, so two strings are equal
+ * exactly when they are the same object. The length and hash are
+ * computed once, when the string is interned. */
+typedef struct String {
+    HeapObject obj;
+    uint32_t length;
+    uint32_t hash;
+    char chars[];  /* NUL-terminated */
+} String;
+
+/* A function value is made every time its declaration runs. The code
+ * it runs, and the number of parameters it takes, are in the code
+ * object, which belongs to the chunk (see compiler.h). */
+typedef struct Function {
+    HeapObject obj;
+    String *name;
+    struct CodeObject *code;
 } Function;
 
-typedef struct Object {
-    ObjectType type;
-    union {
-        char *str;
-        double dval;
-        bool bval;
-        Function func;
-        uint8_t *ptr;
-    } as;
-    char *name;
-} Object;
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NULL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_UNDEFINED 4
+
+#define TAG_STRING ((uint64_t)1 << 48)
+#define TAG_FUNCTION ((uint64_t)2 << 48)
+#define TAG_MASK (SIGN_BIT | QNAN | ((uint64_t)3 << 48))
+#define PAYLOAD_MASK ((uint64_t)0x0000ffffffffffff)
+
+#define NULL_VAL ((Object)(QNAN | TAG_NULL))
+#define FALSE_VAL ((Object)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Object)(QNAN | TAG_TRUE))
+#define UNDEFINED_VAL ((Object)(QNAN | TAG_UNDEFINED))
 
 typedef DynArray(Object) Object_DynArray;
-typedef DynArray(char *) String_DynArray;
+typedef DynArray(String *) String_DynArray;
+
+static inline Object num_to_object(double num) {
+    Object object;
+    memcpy(&object, &num, sizeof(double));
+    return object;
+}
+
+static inline double object_to_num(Object object) {
+    double num;
+    memcpy(&num, &object, sizeof(double));
+    return num;
+}
+
+#define IS_BOOL(object) (((object) | 1) == TRUE_VAL)
+#define IS_NUM(object) (((object) & QNAN) != QNAN)
+#define IS_FUNC(object) (((object) & TAG_MASK) == (SIGN_BIT | QNAN | TAG_FUNCTION))
+#define IS_NULL(object) ((object) == NULL_VAL)
+#define IS_STRING(object) (((object) & TAG_MASK) == (SIGN_BIT | QNAN | TAG_STRING))
+
+#define BOX_PTR(tag, thing) ((Object)(SIGN_BIT | QNAN | (tag) | (uint64_t)(uintptr_t)(thing)))
+#define UNBOX_PTR(type, object) ((type)(uintptr_t)((object) & PAYLOAD_MASK))
+
+#define AS_NUM(thing) num_to_object(thing)
+#define AS_BOOL(thing) ((thing) ? TRUE_VAL : FALSE_VAL)
+#define AS_FUNC(thing) BOX_PTR(TAG_FUNCTION, thing)
+#define AS_STR(thing) BOX_PTR(TAG_STRING, thing)
 
-#define IS_BOOL(object) ((object)->type == OBJ_BOOLEAN)
-#define IS_NUM(object) ((object)->type == OBJ_NUMBER)
-#define IS_FUNC(object) ((object)->type == OBJ_FUNCTION)
-#define IS_POINTER(object) ((object)->type == OBJ_POINTER)
-#define IS_NULL(object) ((object)->type == OBJ_NULL)
-#define IS_STRING(object) ((object)->type == OBJ_STRING)
+#define NUM_VAL(object) object_to_num(object)
+#define BOOL_VAL(object) ((object) == TRUE_VAL)
+#define FUNC_VAL(object) UNBOX_PTR(Function *, object)
+#define STR_VAL(object) UNBOX_PTR(String *, object)
 
-#define AS_NUM(thing) ((Object){ .type = OBJ_NUMBER, .as.dval = (thing) })
-#define AS_BOOL(thing) ((Object){ .type = OBJ_BOOLEAN, .as.bval = (thing) })
-#define AS_FUNC(thing) ((Object){ .type = OBJ_FUNCTION, .as.func = (thing) })
-#define AS_POINTER(thing) ((Object){ .type = OBJ_POINTER, .as.ptr = (thing)} )
-#define AS_STR(thing) ((Object){ .type = OBJ_STRING, .as.str = (thing)} )
+/* Numbers are printed with two decimals, as by printf's "%.2f". The
+ * largest doubles have 309 digits before the point. */
+#define NUMBER_BUFFER_SIZE 320
 
-#define NUM_VAL(object) ((object).as.dval)
-#define BOOL_VAL(object) ((object).as.bval)
+/* Writes 'number' to 'buffer', NUL-terminated, and returns its
+ * length. */
+int format_number(double number, char *buffer);
 
 void print_object(Object *object);
+bool objects_equal(Object a, Object b);
 
 #endif
\ No newline at end of file
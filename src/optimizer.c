@@ -0,0 +1,413 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dynarray.h"
+#include "optimizer.h"
+#include "parser.h"
+#include "table.h"
+
+void init_optimizer(Optimizer *optimizer, Ast *ast) {
+    memset(optimizer, 0, sizeof(Optimizer));
+    optimizer->ast = ast;
+}
+
+void free_optimizer(Optimizer *optimizer) {
+    dynarray_free(&optimizer->constants);
+    free(optimizer->names);
+}
+
+static void optimizer_error(Optimizer *optimizer, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    optimizer->had_error = true;
+    fprintf(stderr, "compile error: ");
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static bool same_name(Slice a, Slice b) {
+    return a.length == b.length && memcmp(a.start, b.start, a.length) == 0;
+}
+
+static ConstantName *find_name(const Optimizer *optimizer, Slice name) {
+    /* Returns the bucket of 'name', or the empty one where it would
+     * be inserted, probing linearly as in table.c. */
+    size_t mask = optimizer->names_capacity - 1;
+    for (size_t index = hash_string(name.start, name.length) & mask;; index = (index + 1) & mask) {
+        ConstantName *bucket = &optimizer->names[index];
+        if (bucket->name.start == NULL || same_name(bucket->name, name)) {
+            return bucket;
+        }
+    }
+}
+
+static void grow_names(Optimizer *optimizer) {
+    ConstantName *names = optimizer->names;
+    size_t capacity = optimizer->names_capacity;
+    optimizer->names_capacity = capacity == 0 ? 8 : capacity * 2;
+    optimizer->names = calloc(optimizer->names_capacity, sizeof(ConstantName));
+    for (size_t i = 0; i < capacity; i++) {
+        if (names[i].name.start != NULL) {
+            *find_name(optimizer, names[i].name) = names[i];
+        }
+    }
+    free(names);
+}
+
+static void push_constant(Optimizer *optimizer, Constant constant) {
+    /* The name's bucket stays once it is made, even when no constant
+     * by that name is visible anymore. */
+    if ((optimizer->names_count + 1) * 4 > optimizer->names_capacity * 3) {
+        grow_names(optimizer);
+    }
+    ConstantName *bucket = find_name(optimizer, constant.name);
+    if (bucket->name.start == NULL) {
+        bucket->name = constant.name;
+        bucket->latest = -1;
+        optimizer->names_count++;
+    }
+    constant.previous = bucket->latest;
+    bucket->latest = optimizer->constants.count;
+    dynarray_insert(&optimizer->constants, constant);
+}
+
+static void end_scope(Optimizer *optimizer, size_t count) {
+    /* Pops the constants declared since the scope began, at 'count',
+     * uncovering the ones they hid. Their values belong to the AST. */
+    while (optimizer->constants.count > count) {
+        Constant *constant = &optimizer->constants.data[--optimizer->constants.count];
+        find_name(optimizer, constant->name)->latest = constant->previous;
+    }
+}
+
+static Constant *resolve_constant(Optimizer *optimizer, Slice name) {
+    /* The innermost declaration wins, so that locals shadow the
+     * constants declared around them. */
+    if (optimizer->names_count == 0) {
+        return NULL;
+    }
+    ConstantName *bucket = find_name(optimizer, name);
+    if (bucket->name.start == NULL || bucket->latest == -1) {
+        return NULL;
+    }
+    Constant *constant = &optimizer->constants.data[bucket->latest];
+    return constant->shadow ? NULL : constant;
+}
+
+static LiteralExpression *literal(Optimizer *optimizer, Expression exp) {
+    return AST_NODE(optimizer->ast, LiteralExpression, exp.index);
+}
+
+static bool is_number(Optimizer *optimizer, Expression exp) {
+    return exp.kind == EXP_LITERAL && literal(optimizer, exp)->specval == NULL;
+}
+
+static bool is_constant(Expression exp) {
+    return exp.kind == EXP_LITERAL || exp.kind == EXP_STRING;
+}
+
+static bool is_truthy(Optimizer *optimizer, Expression exp) {
+    /* Mirrors the VM, where only 'true' satisfies a condition. */
+    return exp.kind == EXP_LITERAL
+        && literal(optimizer, exp)->specval != NULL
+        && strcmp(literal(optimizer, exp)->specval, "true") == 0;
+}
+
+/* Folding never adds nodes to the AST, so that the pointers into it
+ * that the optimizer holds stay valid. Instead, a folded literal is
+ * written over the node of the expression it replaces, which is at
+ * least as large. */
+_Static_assert(sizeof(LiteralExpression) <= sizeof(BinaryExpression), "literal must fit in a binary node");
+_Static_assert(sizeof(LiteralExpression) <= sizeof(VariableExpression), "literal must fit in a variable node");
+_Static_assert(sizeof(StringExpression) <= sizeof(VariableExpression), "string must fit in a variable node");
+
+static void number_literal(Optimizer *optimizer, Expression *exp, double dval) {
+    *AST_NODE(optimizer->ast, LiteralExpression, exp->index) = (LiteralExpression){ .dval = dval };
+    exp->kind = EXP_LITERAL;
+}
+
+static void bool_literal(Optimizer *optimizer, Expression *exp, bool value) {
+    *AST_NODE(optimizer->ast, LiteralExpression, exp->index) = (LiteralExpression){
+        .specval = value ? "true" : "false",
+    };
+    exp->kind = EXP_LITERAL;
+}
+
+static void copy_constant(Optimizer *optimizer, Expression *exp, Expression value) {
+    /* Every use gets its own copy, because folding may modify it. */
+    if (value.kind == EXP_STRING) {
+        *AST_NODE(optimizer->ast, StringExpression, exp->index) =
+            *AST_NODE(optimizer->ast, StringExpression, value.index);
+    } else {
+        *AST_NODE(optimizer->ast, LiteralExpression, exp->index) = *literal(optimizer, value);
+    }
+    exp->kind = value.kind;
+}
+
+static bool fold_binary(Optimizer *optimizer, Expression *exp) {
+    BinaryExpression binary = *AST_NODE(optimizer->ast, BinaryExpression, exp->index);
+    char *op = binary.operator;
+    Expression lhs = binary.lhs, rhs = binary.rhs;
+
+    if (is_number(optimizer, lhs) && is_number(optimizer, rhs)) {
+        double a = literal(optimizer, lhs)->dval;
+        double b = literal(optimizer, rhs)->dval;
+        /* '>=' and '<=' are folded the way they are compiled, as the
+         * negation of '<' and '>', so that NaN compares the same. */
+        if (strcmp(op, "+") == 0) number_literal(optimizer, exp, a + b);
+        else if (strcmp(op, "-") == 0) number_literal(optimizer, exp, a - b);
+        else if (strcmp(op, "*") == 0) number_literal(optimizer, exp, a * b);
+        else if (strcmp(op, "/") == 0) number_literal(optimizer, exp, a / b);
+        else if (strcmp(op, "%%") == 0) number_literal(optimizer, exp, fmod(a, b));
+        else if (strcmp(op, ">") == 0) bool_literal(optimizer, exp, a > b);
+        else if (strcmp(op, "<") == 0) bool_literal(optimizer, exp, a < b);
+        else if (strcmp(op, ">=") == 0) bool_literal(optimizer, exp, !(a < b));
+        else if (strcmp(op, "<=") == 0) bool_literal(optimizer, exp, !(a > b));
+        else if (strcmp(op, "==") == 0) bool_literal(optimizer, exp, a == b);
+        else if (strcmp(op, "!=") == 0) bool_literal(optimizer, exp, a != b);
+        else return false;
+        return true;
+    }
+
+    /* Booleans and null are equal only to themselves, and never to
+     * a number. Strings are left alone because the VM compares them
+     * by address. */
+    if (lhs.kind == EXP_LITERAL && rhs.kind == EXP_LITERAL) {
+        char *a = literal(optimizer, lhs)->specval;
+        char *b = literal(optimizer, rhs)->specval;
+        bool equal = a != NULL && b != NULL && strcmp(a, b) == 0;
+        if (strcmp(op, "==") == 0) bool_literal(optimizer, exp, equal);
+        else if (strcmp(op, "!=") == 0) bool_literal(optimizer, exp, !equal);
+        else return false;
+        return true;
+    }
+
+    return false;
+}
+
+static void fold_expression(Optimizer *optimizer, Expression *exp) {
+    Ast *ast = optimizer->ast;
+    switch (exp->kind) {
+        case EXP_VARIABLE: {
+            Constant *constant = resolve_constant(optimizer, AST_NODE(ast, VariableExpression, exp->index)->name);
+            if (constant != NULL) {
+                copy_constant(optimizer, exp, constant->value);
+            }
+            break;
+        }
+        case EXP_UNARY: {
+            UnaryExpression *unary = AST_NODE(ast, UnaryExpression, exp->index);
+            fold_expression(optimizer, &unary->exp);
+            if (is_number(optimizer, unary->exp)) {
+                /* Reuse the operand's literal for the result. */
+                Expression operand = unary->exp;
+                literal(optimizer, operand)->dval = -literal(optimizer, operand)->dval;
+                *exp = operand;
+            }
+            break;
+        }
+        case EXP_BINARY: {
+            BinaryExpression *binary = AST_NODE(ast, BinaryExpression, exp->index);
+            fold_expression(optimizer, &binary->lhs);
+            fold_expression(optimizer, &binary->rhs);
+            fold_binary(optimizer, exp);
+            break;
+        }
+        case EXP_LOGICAL: {
+            LogicalExpression *logical = AST_NODE(ast, LogicalExpression, exp->index);
+            fold_expression(optimizer, &logical->lhs);
+            fold_expression(optimizer, &logical->rhs);
+            if (is_constant(logical->lhs)) {
+                /* The left operand is the result if it short-circuits
+                 * the expression, otherwise the right operand is. */
+                bool is_and = strcmp(logical->operator, "&&") == 0;
+                bool keep_lhs = is_truthy(optimizer, logical->lhs) != is_and;
+                *exp = keep_lhs ? logical->lhs : logical->rhs;
+            }
+            break;
+        }
+        case EXP_CALL: {
+            CallExpression *call = AST_NODE(ast, CallExpression, exp->index);
+            Expression *arguments = AST_LIST(ast, Expression, call->arguments);
+            for (size_t i = 0; i < call->arguments.count; i++) {
+                fold_expression(optimizer, &arguments[i]);
+            }
+            break;
+        }
+        case EXP_ASSIGN: {
+            AssignExpression *assign = AST_NODE(ast, AssignExpression, exp->index);
+            Slice name = AST_NODE(ast, VariableExpression, assign->lhs.index)->name;
+            if (resolve_constant(optimizer, name) != NULL) {
+                optimizer_error(optimizer, "Cannot assign to constant '%.*s'.", name.length, name.start);
+            }
+            fold_expression(optimizer, &assign->rhs);
+            break;
+        }
+        default: break;
+    }
+}
+
+static void optimize_statement(Optimizer *optimizer, Statement *stmt, bool scoped);
+
+static bool is_empty(Statement stmt) {
+    return stmt.kind == STMT_BLOCK && stmt.as.stmt_block.stmts.count == 0;
+}
+
+static Statement empty_statement(void) {
+    return (Statement){ .kind = STMT_BLOCK, .as.stmt_block.stmts = {0} };
+}
+
+static size_t optimize_block(Optimizer *optimizer, Statement *stmts, size_t count, bool scoped) {
+    /* Statements that compile to nothing, such as constant declarations
+     * and dead branches, are dropped from the block altogether. Returns
+     * the number of statements that are left. */
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        optimize_statement(optimizer, &stmts[i], scoped);
+        if (!is_empty(stmts[i])) {
+            stmts[kept++] = stmts[i];
+        }
+    }
+    return kept;
+}
+
+static void declare_local(Optimizer *optimizer, Slice name) {
+    if (resolve_constant(optimizer, name) != NULL) {
+        push_constant(optimizer, (Constant){ .name = name, .shadow = true });
+    }
+}
+
+static void check_redeclaration(Optimizer *optimizer, Slice name) {
+    if (resolve_constant(optimizer, name) != NULL) {
+        optimizer_error(optimizer, "Cannot redeclare constant '%.*s'.", name.length, name.start);
+    }
+}
+
+static void replace_with_branch(Optimizer *optimizer, Statement *stmt, AstIndex keep) {
+    /* Replaces an 'if' or 'while' statement with one of its branches
+     * (or with an empty statement if 'keep' is AST_NONE). */
+    *stmt = keep != AST_NONE ? *AST_NODE(optimizer->ast, Statement, keep) : empty_statement();
+}
+
+static void optimize_statement(Optimizer *optimizer, Statement *stmt, bool scoped) {
+    switch (stmt->kind) {
+        case STMT_PRINT: {
+            fold_expression(optimizer, &stmt->as.stmt_print.exp);
+            break;
+        }
+        case STMT_EXPR: {
+            fold_expression(optimizer, &stmt->as.stmt_expr.exp);
+            break;
+        }
+        case STMT_RETURN: {
+            fold_expression(optimizer, &stmt->as.stmt_return.returnval);
+            break;
+        }
+        case STMT_LET: {
+            /* The initializer is folded before the name is declared
+             * so that it still sees a constant the local shadows. */
+            fold_expression(optimizer, &stmt->as.stmt_let.initializer);
+            if (scoped) {
+                declare_local(optimizer, stmt->as.stmt_let.name);
+            } else {
+                check_redeclaration(optimizer, stmt->as.stmt_let.name);
+            }
+            break;
+        }
+        case STMT_CONST: {
+            LetStatement *decl = &stmt->as.stmt_const;
+            fold_expression(optimizer, &decl->initializer);
+            if (!is_constant(decl->initializer)) {
+                optimizer_error(
+                    optimizer,
+                    "Initializer of constant '%.*s' is not a constant expression.",
+                    decl->name.length, decl->name.start
+                );
+            } else {
+                if (!scoped) {
+                    check_redeclaration(optimizer, decl->name);
+                }
+                Constant constant = {
+                    .name = decl->name,
+                    .value = decl->initializer,
+                };
+                push_constant(optimizer, constant);
+            }
+            /* Every use of the constant has been replaced with its
+             * value, so the declaration itself compiles to nothing. */
+            *stmt = empty_statement();
+            break;
+        }
+        case STMT_BLOCK: {
+            size_t count = optimizer->constants.count;
+            AstList *stmts = &stmt->as.stmt_block.stmts;
+            stmts->count = optimize_block(optimizer, AST_LIST(optimizer->ast, Statement, *stmts), stmts->count, scoped);
+            end_scope(optimizer, count);
+            break;
+        }
+        case STMT_IF: {
+            IfStatement *if_stmt = &stmt->as.stmt_if;
+            fold_expression(optimizer, &if_stmt->condition);
+            optimize_statement(optimizer, AST_NODE(optimizer->ast, Statement, if_stmt->then_branch), scoped);
+            if (if_stmt->else_branch != AST_NONE) {
+                optimize_statement(optimizer, AST_NODE(optimizer->ast, Statement, if_stmt->else_branch), scoped);
+            }
+            if (is_constant(if_stmt->condition)) {
+                if (is_truthy(optimizer, if_stmt->condition)) {
+                    replace_with_branch(optimizer, stmt, if_stmt->then_branch);
+                } else {
+                    replace_with_branch(optimizer, stmt, if_stmt->else_branch);
+                }
+            }
+            break;
+        }
+        case STMT_WHILE: {
+            WhileStatement *while_stmt = &stmt->as.stmt_while;
+            fold_expression(optimizer, &while_stmt->condition);
+            optimize_statement(optimizer, AST_NODE(optimizer->ast, Statement, while_stmt->body), scoped);
+            if (is_constant(while_stmt->condition) && !is_truthy(optimizer, while_stmt->condition)) {
+                replace_with_branch(optimizer, stmt, AST_NONE);
+            }
+            break;
+        }
+        case STMT_FN: {
+            FunctionStatement *fn = &stmt->as.stmt_fn;
+            check_redeclaration(optimizer, fn->name);
+            if (fn->lazy != AST_NONE) {
+                /* The body is optimized along with its first compile,
+                 * seeing the constants that it would see now. */
+                AST_NODE(optimizer->ast, LazyFunction, fn->lazy)->constants = optimizer->constants.count;
+                break;
+            }
+            size_t count = optimizer->constants.count;
+            Slice *parameters = AST_LIST(optimizer->ast, Slice, fn->parameters);
+            for (size_t i = 0; i < fn->parameters.count; i++) {
+                declare_local(optimizer, parameters[i]);
+            }
+            fn->stmts.count = optimize_block(optimizer, AST_LIST(optimizer->ast, Statement, fn->stmts), fn->stmts.count, true);
+            end_scope(optimizer, count);
+            break;
+        }
+        default: break;
+    }
+}
+
+void optimize(Optimizer *optimizer, Statement_DynArray *stmts) {
+    stmts->count = optimize_block(optimizer, stmts->data, stmts->count, false);
+}
+
+void import_constants(Optimizer *optimizer, const Optimizer *from, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        Constant constant = from->constants.data[i];
+        if (optimizer->ast != from->ast && !constant.shadow) {
+            /* A folded value is a single literal node. */
+            size_t size = constant.value.kind == EXP_STRING ? sizeof(StringExpression) : sizeof(LiteralExpression);
+            constant.value.index = add_node(optimizer->ast, from->ast->data + constant.value.index, size);
+        }
+        push_constant(optimizer, constant);
+    }
+}
\ No newline at end of file
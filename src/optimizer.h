@@ -0,0 +1,47 @@
+#ifndef venom_optimizer_h
+#define venom_optimizer_h
+
+#include <stdbool.h>
+#include "dynarray.h"
+#include "parser.h"
+
+/* A name visible at some point of the program that refers either
+ * to a constant, in which case 'value' is its folded literal, or to
+ * a local that shadows an outer constant, in which case 'shadow' is
+ * set. */
+typedef struct {
+    Slice name;
+    Expression value;
+    bool shadow;
+    int previous;  /* the one with the same name that it hides, or -1 */
+} Constant;
+
+typedef DynArray(Constant) Constant_DynArray;
+
+/* An open-addressing hash table from each name that has ever been
+ * declared to the innermost visible constant by that name, so that
+ * resolving a name doesn't scan all of the constants. */
+typedef struct {
+    Slice name;  /* 'start' is NULL if the bucket is empty */
+    int latest;  /* index into 'constants', or -1 */
+} ConstantName;
+
+typedef struct {
+    Constant_DynArray constants;
+    ConstantName *names;
+    size_t names_count;
+    size_t names_capacity;
+    bool had_error;
+    Ast *ast;
+} Optimizer;
+
+void init_optimizer(Optimizer *optimizer, Ast *ast);
+void free_optimizer(Optimizer *optimizer);
+void optimize(Optimizer *optimizer, Statement_DynArray *stmts);
+
+/* Declares the first 'count' constants of 'from' in 'optimizer', as
+ * if they had been declared in its AST, whose values are copied over
+ * unless the two share it. */
+void import_constants(Optimizer *optimizer, const Optimizer *from, size_t count);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,227 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "cfg.h"
+#include "compiler.h"
+#include "dynarray.h"
+#include "gc.h"
+#include "lazy.h"
+#include "parallel.h"
+#include "parser.h"
+#include "regcompiler.h"
+
+static void compile_unit(const Frontend *frontend, Unit *unit) {
+    /* Everything the unit makes is its own, and it only reads the
+     * front end, which nothing writes to while the units compile. */
+    Ast ast;
+    init_ast(&ast);
+    unit->ok = compile_declaration(frontend, &ast, &unit->chunk, &unit->code);
+    free_ast(&ast);
+}
+
+typedef struct {
+    const Frontend *frontend;
+    atomic_size_t next;  /* the next unit nobody has taken yet */
+} Pool;
+
+static void *work(void *argument) {
+    Pool *pool = argument;
+    for (;;) {
+        size_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->frontend->unit_count) {
+            return NULL;
+        }
+        compile_unit(pool->frontend, &pool->frontend->units[i]);
+    }
+}
+
+bool compile_units(Frontend *frontend, Statement_DynArray *stmts, int jobs) {
+    /* One unit per skipped function, in the order of the program,
+     * which is the order the compiler will reach them in. */
+    size_t count = 0;
+    for (size_t i = 0; i < stmts->count; i++) {
+        if (stmts->data[i].kind == STMT_FN && stmts->data[i].as.stmt_fn.lazy != AST_NONE) {
+            count++;
+        }
+    }
+    frontend->units = calloc(count, sizeof(Unit));
+    frontend->unit_count = count;
+    frontend->next_unit = 0;
+
+    /* The strings are all made by the compiler, so the heaps never
+     * need a nursery. */
+    GCOptions options = DEFAULT_GC_OPTIONS;
+    options.nursery_size = 0;
+    Unit *unit = frontend->units;
+    for (size_t i = 0; i < stmts->count; i++) {
+        Statement *stmt = &stmts->data[i];
+        if (stmt->kind != STMT_FN || stmt->as.stmt_fn.lazy == AST_NONE) {
+            continue;
+        }
+        LazyFunction *lazy = AST_NODE(frontend->ast, LazyFunction, stmt->as.stmt_fn.lazy);
+        init_heap(&unit->heap, &options);
+        init_chunk(&unit->chunk, &unit->heap);
+        unit->code.source = lazy->source;
+        unit->code.line = lazy->line;
+        unit->code.constants = lazy->constants;
+        unit->code.paramcount = stmt->as.stmt_fn.parameters.count;
+        unit++;
+    }
+
+    /* The calling thread takes units too. A thread that cannot be
+     * started just leaves more for the others. */
+    Pool pool = { .frontend = frontend };
+    atomic_init(&pool.next, 0);
+    size_t threads = (size_t)jobs < count ? (size_t)jobs : count;
+    pthread_t *workers = malloc(sizeof(pthread_t) * (threads > 0 ? threads : 1));
+    size_t started = 0;
+    for (size_t i = 1; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, work, &pool) == 0) {
+            started++;
+        }
+    }
+    work(&pool);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    bool ok = true;
+    for (size_t i = 0; i < count; i++) {
+        ok = ok && frontend->units[i].ok;
+    }
+    return ok;
+}
+
+/* How a unit's numbers map to the chunk's. Call sites and functions
+ * are only ever appended, so they just move up by a fixed amount. */
+typedef struct {
+    uint32_t *strings;
+    uint32_t *globals;
+    uint32_t caches;
+    uint32_t functions;
+} Renumbering;
+
+static void renumber_stack(Instruction *instruction, void *context) {
+    Renumbering *renumbering = context;
+    uint32_t *operands = instruction->operands;
+    switch (instruction->op) {
+        case OP_STR:
+            operands[0] = renumbering->strings[operands[0]];
+            break;
+        case OP_SET_GLOBAL:
+        case OP_GET_GLOBAL:
+            operands[0] = renumbering->globals[operands[0]];
+            break;
+        case OP_FUNC:
+            operands[0] = renumbering->globals[operands[0]];
+            operands[1] += renumbering->functions;
+            break;
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            operands[0] = renumbering->globals[operands[0]];
+            operands[2] += renumbering->caches;
+            break;
+        default: break;
+    }
+}
+
+static void renumber_registers(Instruction *instruction, void *context) {
+    Renumbering *renumbering = context;
+    uint32_t *operands = instruction->operands;
+    switch (instruction->op) {
+        case ROP_LOADS:
+            operands[1] = renumbering->strings[operands[1]];
+            break;
+        case ROP_GETG:
+            operands[1] = renumbering->globals[operands[1]];
+            break;
+        case ROP_SETG:
+            operands[0] = renumbering->globals[operands[0]];
+            break;
+        case ROP_FUNC:
+            operands[0] = renumbering->globals[operands[0]];
+            operands[1] += renumbering->functions;
+            break;
+        case ROP_CALL:
+            operands[1] = renumbering->globals[operands[1]];
+            operands[4] += renumbering->caches;
+            break;
+        case ROP_TAILCALL:
+            operands[0] = renumbering->globals[operands[0]];
+            operands[3] += renumbering->caches;
+            break;
+        default: break;
+    }
+}
+
+static void renumber(BytecodeChunk *chunk, CodeObject *code, Renumbering *renumbering) {
+    if (chunk->frontend->registers) {
+        remap_reg_code(code, renumber_registers, renumbering);
+    } else {
+        remap_code(code, renumber_stack, renumbering);
+    }
+}
+
+static Slice string_slice(const String *string) {
+    return (Slice){ .start = string->chars, .length = string->length };
+}
+
+void merge_unit(BytecodeChunk *chunk, CodeObject *code, Unit *unit) {
+    BytecodeChunk *from = &unit->chunk;
+    Renumbering renumbering = {
+        .strings = malloc(sizeof(uint32_t) * (from->sp.count + 1)),
+        .globals = malloc(sizeof(uint32_t) * (from->global_names.count + 1)),
+        .caches = chunk->caches.count,
+        .functions = chunk->functions.count,
+    };
+    for (size_t i = 0; i < from->sp.count; i++) {
+        renumbering.strings[i] = add_string(chunk, string_slice(from->sp.data[i]));
+    }
+    for (size_t i = 0; i < from->global_names.count; i++) {
+        renumbering.globals[i] = resolve_global(chunk, string_slice(from->global_names.data[i]));
+    }
+    for (size_t i = 0; i < from->caches.count; i++) {
+        add_cache(chunk);
+    }
+
+    /* The code of the nested functions moves over as it is. */
+    for (size_t i = 0; i < from->functions.count; i++) {
+        CodeObject *nested = from->functions.data[i];
+        uint32_t index = add_function(chunk, intern(chunk, string_slice(nested->name)), nested->paramcount);
+        CodeObject *to = chunk->functions.data[index];
+        to->code = nested->code;
+        to->cp = nested->cp;
+        to->max_stack = nested->max_stack;
+        free(nested);
+        renumber(chunk, to, &renumbering);
+    }
+    from->functions.count = 0;
+
+    code->code = unit->code.code;
+    code->cp = unit->code.cp;
+    code->max_stack = unit->code.max_stack;
+    code->source.start = NULL;
+    unit->code.code = (Uint8DynArray){0};
+    unit->code.cp = (Double_DynArray){0};
+    renumber(chunk, code, &renumbering);
+
+    free(renumbering.strings);
+    free(renumbering.globals);
+}
+
+void free_units(Frontend *frontend) {
+    for (size_t i = 0; i < frontend->unit_count; i++) {
+        Unit *unit = &frontend->units[i];
+        free_chunk(&unit->chunk);
+        dynarray_free(&unit->code.code);
+        dynarray_free(&unit->code.cp);
+        free_heap(&unit->heap);
+    }
+    free(frontend->units);
+    frontend->units = NULL;
+    frontend->unit_count = 0;
+    frontend->next_unit = 0;
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#ifndef venom_parallel_h
+#define venom_parallel_h
+
+#include <stdbool.h>
+#include "compiler.h"
+#include "gc.h"
+#include "lazy.h"
+#include "parser.h"
+
+/* Compiling the top-level functions of a program on several threads.
+ * The program is parsed first with the function bodies skipped, which
+ * splits it into the top-level statements and the source of every
+ * function body. Each body is then
+ * a unit that a thread parses, checks and compiles on its own, into a
+ * chunk of its own, with strings, globals, call sites and nested
+ * functions numbered from 0. When the compiler reaches the function in
+ * the top level, the unit is merged into the chunk: its tables are
+ * added to the chunk's, in the order they were made, and its code is
+ * renumbered to match. That is the order the serial compiler would
+ * have made them in, so the bytecode comes out the same. */
+typedef struct Unit {
+    Heap heap;  /* interns the unit's strings */
+    BytecodeChunk chunk;
+    CodeObject code;  /* the function's own code */
+    bool ok;
+} Unit;
+
+/* Compiles every skipped function among 'stmts' on up to 'jobs'
+ * threads, leaving the units in 'frontend'. Returns false if any of
+ * them has errors. */
+bool compile_units(Frontend *frontend, Statement_DynArray *stmts, int jobs);
+
+/* Merges a unit into 'chunk' as the body of 'code'. */
+void merge_unit(BytecodeChunk *chunk, CodeObject *code, Unit *unit);
+
+void free_units(Frontend *frontend);
+
+#endif
\ No newline at end of file
@@ -7,123 +7,59 @@
 #include "dynarray.h"
 #include "parser.h"
 #include "tokenizer.h"
-#include "util.h"
 
-#define venom_debug
-
-void free_stmt(Statement stmt) {
-    switch (stmt.kind) {
-        case STMT_PRINT: {
-            free_expression(stmt.as.stmt_print.exp);
-            break;
-        }
-        case STMT_LET: {
-            free_expression(stmt.as.stmt_let.initializer);
-            free(stmt.as.stmt_let.name);
-            break;
-        }
-        case STMT_BLOCK: {
-            for (size_t i = 0; i < stmt.as.stmt_block.stmts.count; i++) {
-                free_stmt(stmt.as.stmt_block.stmts.data[i]);
-            }
-            dynarray_free(&stmt.as.stmt_block.stmts);
-            break;
-        }
-        case STMT_IF: {
-            free_expression(stmt.as.stmt_if.condition);
-
-            free_stmt(*stmt.as.stmt_if.then_branch);
-            free(stmt.as.stmt_if.then_branch);
+void init_ast(Ast *ast) {
+    ast->capacity = 1024;
+    ast->data = malloc(ast->capacity);
+    /* Keep offset 0 free for AST_NONE. */
+    ast->count = 8;
+}
 
-            if (stmt.as.stmt_if.else_branch != NULL) {
-                free_stmt(*stmt.as.stmt_if.else_branch);
-                free(stmt.as.stmt_if.else_branch);
-            }
+void free_ast(Ast *ast) {
+    free(ast->data);
+}
 
-            break;
-        }
-        case STMT_WHILE: {
-            free_expression(stmt.as.stmt_while.condition);
-            free_stmt(*stmt.as.stmt_while.body);
-            free(stmt.as.stmt_while.body);
-            break;
-        }
-        case STMT_RETURN: {
-            free_expression(stmt.as.stmt_return.returnval);
-            break;
-        }
-        case STMT_EXPR: {
-            free_expression(stmt.as.stmt_expr.exp);
-            break;
-        }
-        case STMT_FN: {
-            free(stmt.as.stmt_fn.name);
-            for (size_t i = 0; i < stmt.as.stmt_fn.parameters.count; i++) {
-                free(stmt.as.stmt_fn.parameters.data[i]);
-            }
-            dynarray_free(&stmt.as.stmt_fn.parameters);
-            for (size_t i = 0; i < stmt.as.stmt_fn.stmts.count; i++) {
-                free_stmt(stmt.as.stmt_fn.stmts.data[i]);
-            }
-            dynarray_free(&stmt.as.stmt_fn.stmts);
-            break;
+AstIndex add_node(Ast *ast, const void *node, size_t size) {
+    /* Nodes are 8-byte aligned, which suits every member they have. */
+    size_t index = (ast->count + 7) & ~(size_t)7;
+    if (index + size > UINT32_MAX) {
+        fprintf(stderr, "parse error: program is too large\n");
+        exit(1);
+    }
+    if (index + size > ast->capacity) {
+        while (index + size > ast->capacity) {
+            ast->capacity *= 2;
         }
-        default: break;
+        ast->data = realloc(ast->data, ast->capacity);
     }
+    memcpy(ast->data + index, node, size);
+    ast->count = index + size;
+    return index;
 }
 
-void free_expression(Expression e) {
-    switch (e.kind) {
-        case EXP_LITERAL: {
-            free(e.as.expr_literal);
-            break;
-        }
-        case EXP_VARIABLE: {
-            free(e.as.expr_variable->name);
-            free(e.as.expr_variable);
-            break;
-        }
-        case EXP_STRING: {
-            free(e.as.expr_string->str);
-            free(e.as.expr_string);
-            break;
-        }
-        case EXP_UNARY: {
-            free_expression(*e.as.expr_unary->exp);
-            free(e.as.expr_unary);
-            break;
-        }
-        case EXP_BINARY: {
-            free_expression(e.as.expr_binary->lhs);
-            free_expression(e.as.expr_binary->rhs);
-            free(e.as.expr_binary);
-            break;
-        }
-        case EXP_ASSIGN: {
-            free_expression(e.as.expr_assign->lhs);
-            free_expression(e.as.expr_assign->rhs);
-            free(e.as.expr_assign);
-            break;
-        }
-        case EXP_LOGICAL: {
-            free_expression(e.as.expr_logical->lhs);
-            free_expression(e.as.expr_logical->rhs);
-            free(e.as.expr_logical);
-            break;
-        }
-        case EXP_CALL: {
-            free(e.as.expr_call->var->name);
-            free(e.as.expr_call->var);
-            for (size_t i = 0; i < e.as.expr_call->arguments.count; i++) {
-                free_expression(e.as.expr_call->arguments.data[i]);
-            }
-            dynarray_free(&e.as.expr_call->arguments);
-            free(e.as.expr_call);
-            break;
-        }
+static AstIndex new_node(Parser *parser, const void *node, size_t size) {
+    /* While the parser is only checking the syntax, no node is made. */
+    return parser->checking ? AST_NONE : add_node(parser->ast, node, size);
+}
+
+static Expression add_expression(Parser *parser, ExpressionKind kind, const void *node, size_t size) {
+    return (Expression){ .kind = kind, .index = new_node(parser, node, size) };
+}
+
+static AstList pop_list(Parser *parser, const void *elements, size_t size, size_t *count, size_t first) {
+    /* Copies the elements of a complete list into the AST and takes
+     * them off the pending stack. */
+    AstList list = { .start = AST_NONE, .count = *count - first };
+    if (list.count > 0) {
+        list.start = new_node(parser, (const char *)elements + first * size, list.count * size);
     }
+    *count = first;
+    return list;
 }
 
+#define add_list(parser, pending, first) \
+    pop_list((parser), (pending)->data, sizeof((pending)->data[0]), &(pending)->count, (first))
+
 static void parse_error(Parser *parser, char *message) {
     parser->had_error = true;
     fprintf(stderr, "parse error: %s\n", message);
@@ -165,37 +101,30 @@ static Token consume(Parser *parser, Tokenizer *tokenizer, TokenType type, char
 }
 
 static Expression number(Parser *parser) {
-    LiteralExpression *e = malloc(sizeof(LiteralExpression));
-    e->dval = strtod(parser->previous.start, NULL);
-    e->specval = NULL;
-    return (Expression){
-        .kind = EXP_LITERAL,
-        .as.expr_literal = e,
+    LiteralExpression e = {
+        .dval = parser->previous.value,
+        .specval = NULL,
     };
+    return add_expression(parser, EXP_LITERAL, &e, sizeof(e));
 }
 
 static Expression string(Parser *parser) {
-    StringExpression *e = malloc(sizeof(StringExpression));
-    e->str = own_string_n(parser->previous.start, parser->previous.length - 1);
-    return (Expression){
-        .kind = EXP_STRING,
-        .as.expr_string = e,
+    /* The token starts after the opening quote and includes the
+     * closing one. */
+    StringExpression e = {
+        .str = { parser->previous.start, parser->previous.length - 1 },
     };
+    return add_expression(parser, EXP_STRING, &e, sizeof(e));
 }
 
 static Expression variable(Parser *parser) {
-    VariableExpression *e = malloc(sizeof(VariableExpression));
-    e->name = own_string_n(parser->previous.start, parser->previous.length);
-    return (Expression){
-        .kind = EXP_VARIABLE,
-        .as.expr_variable = e, 
-    };
+    VariableExpression e = { .name = TOKEN_SLICE(parser->previous) };
+    return add_expression(parser, EXP_VARIABLE, &e, sizeof(e));
 }
 
-static Expression special_literal(char *specval) {
-    LiteralExpression *e = malloc(sizeof(LiteralExpression));
-    e->specval = specval;
-    return (Expression){ .kind = EXP_LITERAL, .as.expr_literal = e };
+static Expression special_literal(Parser *parser, char *specval) {
+    LiteralExpression e = { .specval = specval };
+    return add_expression(parser, EXP_LITERAL, &e, sizeof(e));
 }
 
 static Expression primary();
@@ -220,10 +149,11 @@ static char *operator(Token token) {
 }
 
 static Expression finish_call(Parser *parser, Tokenizer *tokenizer, Expression exp) {
-    Expression_DynArray arguments = {0};
+    size_t first = parser->pending_args.count;
     if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
-            dynarray_insert(&arguments, expression(parser, tokenizer));
+            Expression argument = expression(parser, tokenizer);
+            dynarray_insert(&parser->pending_args, argument);
         } while (match(parser, tokenizer, 1, TOKEN_COMMA));
     }
     consume(
@@ -231,13 +161,11 @@ static Expression finish_call(Parser *parser, Tokenizer *tokenizer, Expression e
         TOKEN_RIGHT_PAREN,
         "Expected ')' after expression."
     );
-    CallExpression *e = malloc(sizeof(CallExpression));
-    e->arguments = arguments;
-    e->var = exp.as.expr_variable;
-    return (Expression){
-        .kind = EXP_CALL,
-        .as.expr_call = e,
+    CallExpression e = {
+        .var = parser->checking ? (VariableExpression){ .name = {0} } : *AST_NODE(parser->ast, VariableExpression, exp.index),
+        .arguments = add_list(parser, &parser->pending_args, first),
     };
+    return add_expression(parser, EXP_CALL, &e, sizeof(e));
 }
 
 static Expression call(Parser *parser, Tokenizer *tokenizer) {
@@ -254,12 +182,8 @@ static Expression call(Parser *parser, Tokenizer *tokenizer) {
 
 static Expression unary(Parser *parser, Tokenizer *tokenizer) {
     if (match(parser, tokenizer, 1, TOKEN_MINUS)) {
-        Expression *right = malloc(sizeof(Expression));
-        *right = unary(parser, tokenizer);
-        UnaryExpression *e = malloc(sizeof(UnaryExpression));
-        e->exp = right;
-        Expression result = { .kind = EXP_UNARY, .as.expr_unary = e };
-        return result;
+        UnaryExpression e = { .exp = unary(parser, tokenizer) };
+        return add_expression(parser, EXP_UNARY, &e, sizeof(e));
     }
     return call(parser, tokenizer);
 }
@@ -269,14 +193,8 @@ static Expression factor(Parser *parser, Tokenizer *tokenizer) {
     while (match(parser, tokenizer, 3, TOKEN_STAR, TOKEN_SLASH, TOKEN_MOD)) {
         char *op = operator(parser->previous);
         Expression right = unary(parser, tokenizer);
-        Expression result = { 
-            .kind = EXP_BINARY, 
-            .as.expr_binary = malloc(sizeof(BinaryExpression)), 
-        };
-        result.as.expr_binary->lhs = expr;
-        result.as.expr_binary->rhs = right;
-        result.as.expr_binary->operator = op;
-        expr = result;
+        BinaryExpression e = { .lhs = expr, .rhs = right, .operator = op };
+        expr = add_expression(parser, EXP_BINARY, &e, sizeof(e));
     }
     return expr;
 }
@@ -286,14 +204,8 @@ static Expression term(Parser *parser, Tokenizer *tokenizer) {
     while (match(parser, tokenizer, 2, TOKEN_PLUS, TOKEN_MINUS)) {
         char *op = operator(parser->previous);
         Expression right = factor(parser, tokenizer);
-        Expression result = { 
-            .kind = EXP_BINARY,
-            .as.expr_binary = malloc(sizeof(BinaryExpression)),
-        };
-        result.as.expr_binary->lhs = expr;
-        result.as.expr_binary->rhs = right;
-        result.as.expr_binary->operator = op;
-        expr = result;
+        BinaryExpression e = { .lhs = expr, .rhs = right, .operator = op };
+        expr = add_expression(parser, EXP_BINARY, &e, sizeof(e));
     }
     return expr;
 }
@@ -306,14 +218,8 @@ static Expression comparison(Parser *parser, Tokenizer *tokenizer) {
     )) {
         char *op = operator(parser->previous);
         Expression right = term(parser, tokenizer);
-        Expression result = { 
-            .kind = EXP_BINARY,
-            .as.expr_binary = malloc(sizeof(BinaryExpression)),
-        };
-        result.as.expr_binary->lhs = expr;
-        result.as.expr_binary->rhs = right;
-        result.as.expr_binary->operator = op;
-        expr = result;
+        BinaryExpression e = { .lhs = expr, .rhs = right, .operator = op };
+        expr = add_expression(parser, EXP_BINARY, &e, sizeof(e));
     }
     return expr;
 }
@@ -323,14 +229,8 @@ static Expression equality(Parser *parser, Tokenizer *tokenizer) {
     while (match(parser, tokenizer, 2, TOKEN_DOUBLE_EQUAL, TOKEN_BANG_EQUAL)) {
         char *op = operator(parser->previous);
         Expression right = comparison(parser, tokenizer);
-        Expression result = { 
-            .kind = EXP_BINARY,
-            .as.expr_binary = malloc(sizeof(BinaryExpression)),
-        };
-        result.as.expr_binary->lhs = expr;
-        result.as.expr_binary->rhs = right;
-        result.as.expr_binary->operator = op;
-        expr = result;
+        BinaryExpression e = { .lhs = expr, .rhs = right, .operator = op };
+        expr = add_expression(parser, EXP_BINARY, &e, sizeof(e));
     }
     return expr;
 }
@@ -338,15 +238,10 @@ static Expression equality(Parser *parser, Tokenizer *tokenizer) {
 static Expression and_(Parser *parser, Tokenizer *tokenizer) {
     Expression expr = equality(parser, tokenizer);
     if (match(parser, tokenizer, 1, TOKEN_DOUBLE_AMPERSAND)) {
-        char *op = own_string_n(parser->previous.start, parser->previous.length);
+        char *op = "&&";
         Expression right = equality(parser, tokenizer);
-        Expression result = { 
-            .kind = EXP_LOGICAL,
-            .as.expr_logical = malloc(sizeof(LogicalExpression)),
-        };
-        result.as.expr_logical->lhs = expr;
-        result.as.expr_logical->rhs = right;
-        result.as.expr_logical->operator = op;
+        LogicalExpression e = { .lhs = expr, .rhs = right, .operator = op };
+        add_expression(parser, EXP_LOGICAL, &e, sizeof(e));
     }
     return expr;
 }
@@ -354,15 +249,10 @@ static Expression and_(Parser *parser, Tokenizer *tokenizer) {
 static Expression or_(Parser *parser, Tokenizer *tokenizer) {
     Expression expr = and_(parser, tokenizer);
     if (match(parser, tokenizer, 1, TOKEN_DOUBLE_PIPE)) {
-        char *op = own_string_n(parser->previous.start, parser->previous.length);
+        char *op = "||";
         Expression right = and_(parser, tokenizer);
-        Expression result = { 
-            .kind = EXP_LOGICAL,
-            .as.expr_logical = malloc(sizeof(LogicalExpression)),
-        };
-        result.as.expr_logical->lhs = expr;
-        result.as.expr_logical->rhs = right;
-        result.as.expr_logical->operator = op;
+        LogicalExpression e = { .lhs = expr, .rhs = right, .operator = op };
+        add_expression(parser, EXP_LOGICAL, &e, sizeof(e));
     }
     return expr;
 }
@@ -371,13 +261,8 @@ static Expression assignment(Parser *parser, Tokenizer *tokenizer) {
     Expression expr = or_(parser, tokenizer);
     if (match(parser, tokenizer, 1, TOKEN_EQUAL)) {
         Expression right = assignment(parser, tokenizer);
-        Expression result = { 
-            .kind = EXP_ASSIGN,
-            .as.expr_assign = malloc(sizeof(AssignExpression)),
-        };
-        result.as.expr_assign->lhs = expr;
-        result.as.expr_assign->rhs = right;
-        return result;
+        AssignExpression e = { .lhs = expr, .rhs = right };
+        return add_expression(parser, EXP_ASSIGN, &e, sizeof(e));
     }
     return expr;
 }
@@ -396,17 +281,18 @@ static Expression grouping(Parser *parser, Tokenizer *tokenizer) {
     return exp;
 }
 
-static Statement_DynArray block(Parser *parser, Tokenizer *tokenizer) {
-    Statement_DynArray stmts = {0};
+static AstList block(Parser *parser, Tokenizer *tokenizer) {
+    size_t first = parser->pending_stmts.count;
     while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
-        dynarray_insert(&stmts, statement(parser, tokenizer));
+        Statement stmt = statement(parser, tokenizer);
+        dynarray_insert(&parser->pending_stmts, stmt);
     }
     consume(
         parser, tokenizer,
         TOKEN_RIGHT_BRACE,
         "Expected '}' at the end of the block."
     );
-    return stmts;
+    return add_list(parser, &parser->pending_stmts, first);
 }
 
 static Expression primary(Parser *parser, Tokenizer *tokenizer) {
@@ -419,47 +305,52 @@ static Expression primary(Parser *parser, Tokenizer *tokenizer) {
     } else if (match(parser, tokenizer, 1, TOKEN_LEFT_PAREN)) {
         return grouping(parser, tokenizer);
     } else if (match(parser, tokenizer, 1, TOKEN_TRUE)) {
-        return special_literal("true");
+        return special_literal(parser, "true");
     } else if (match(parser, tokenizer, 1, TOKEN_FALSE)) {
-        return special_literal("false");
+        return special_literal(parser, "false");
     } else if (match(parser, tokenizer, 1, TOKEN_NULL)) {
-        return special_literal("null");
+        return special_literal(parser, "null");
     }
 }
 
 #ifdef venom_debug
-static void print_expression(Expression e) {
+static void print_expression(Ast *ast, Expression e) {
     printf("(");
     switch (e.kind) {
         case EXP_LITERAL: {
-            printf("%f", e.as.expr_literal->dval);
+            printf("%f", AST_NODE(ast, LiteralExpression, e.index)->dval);
             break;
         }
         case EXP_VARIABLE: {
-            printf("%s", e.as.expr_variable->name);
+            Slice name = AST_NODE(ast, VariableExpression, e.index)->name;
+            printf("%.*s", name.length, name.start);
             break;
         }
         case EXP_UNARY: {
             printf("-");
-            print_expression(*e.as.expr_unary->exp);
+            print_expression(ast, AST_NODE(ast, UnaryExpression, e.index)->exp);
             break;
         }
         case EXP_BINARY: {
-            print_expression(e.as.expr_binary->lhs);
-            printf(" %s ", e.as.expr_binary->operator);
-            print_expression(e.as.expr_binary->lhs);
+            BinaryExpression *binary = AST_NODE(ast, BinaryExpression, e.index);
+            print_expression(ast, binary->lhs);
+            printf(" %s ", binary->operator);
+            print_expression(ast, binary->lhs);
             break;
         }
         case EXP_CALL: {
-            printf("%s", e.as.expr_call->var->name);
-            for (size_t i = 0; i < e.as.expr_call->arguments.count; i++) {
-                print_expression(e.as.expr_call->arguments.data[i]);
+            CallExpression *call = AST_NODE(ast, CallExpression, e.index);
+            Expression *arguments = AST_LIST(ast, Expression, call->arguments);
+            printf("%.*s", call->var.name.length, call->var.name.start);
+            for (size_t i = 0; i < call->arguments.count; i++) {
+                print_expression(ast, arguments[i]);
             }
             printf("()");
             break;
         }
         case EXP_STRING: {
-            printf("%s", e.as.expr_string->str);
+            Slice str = AST_NODE(ast, StringExpression, e.index)->str;
+            printf("%.*s", str.length, str.start);
             break;
         }
         default: assert(0);
@@ -471,8 +362,10 @@ static void print_expression(Expression e) {
 static Statement print_statement(Parser *parser, Tokenizer *tokenizer) {
     Expression exp = expression(parser, tokenizer);
 #ifdef venom_debug
-    print_expression(exp);
-    printf("\n");
+    if (!parser->checking) {
+        print_expression(parser->ast, exp);
+        printf("\n");
+    }
 #endif
     consume(
         parser, tokenizer,
@@ -489,14 +382,16 @@ static Statement let_statement(Parser *parser, Tokenizer *tokenizer) {
         TOKEN_IDENTIFIER,
         "Expected identifier after 'let'."
     );
-    char *name = own_string_n(identifier.start, identifier.length);
+    Slice name = TOKEN_SLICE(identifier);
     Expression initializer;
     if (match(parser, tokenizer, 1, TOKEN_EQUAL)) {
         initializer = expression(parser, tokenizer);
     }
 #ifdef venom_debug
-    print_expression(initializer);
-    printf("\n");
+    if (!parser->checking) {
+        print_expression(parser->ast, initializer);
+        printf("\n");
+    }
 #endif
     consume(
         parser, tokenizer,
@@ -510,6 +405,31 @@ static Statement let_statement(Parser *parser, Tokenizer *tokenizer) {
     return (Statement){ .kind = STMT_LET, .as.stmt_let = stmt };
 }
 
+static Statement const_statement(Parser *parser, Tokenizer *tokenizer) {
+    Token identifier = consume(
+        parser, tokenizer,
+        TOKEN_IDENTIFIER,
+        "Expected identifier after 'const'."
+    );
+    Slice name = TOKEN_SLICE(identifier);
+    consume(
+        parser, tokenizer,
+        TOKEN_EQUAL,
+        "Expected '=' after the name of the constant."
+    );
+    Expression initializer = expression(parser, tokenizer);
+    consume(
+        parser, tokenizer,
+        TOKEN_SEMICOLON,
+        "Expected semicolon at the end of the statement."
+    );
+    LetStatement stmt = {
+        .name = name,
+        .initializer = initializer
+    };
+    return (Statement){ .kind = STMT_CONST, .as.stmt_const = stmt };
+}
+
 static Statement expression_statement(Parser *parser, Tokenizer *tokenizer) {
     Expression expr = expression(parser, tokenizer);
     consume(
@@ -534,18 +454,16 @@ static Statement if_statement(Parser *parser, Tokenizer *tokenizer) {
         "Expected ')' after the condition."
     );
 
-    Statement *then_branch = malloc(sizeof(Statement));
-    Statement *else_branch = NULL;
-
-    *then_branch = statement(parser, tokenizer);
+    Statement then_branch = statement(parser, tokenizer);
+    AstIndex else_branch = AST_NONE;
 
     if (match(parser, tokenizer, 1, TOKEN_ELSE)) {
-        else_branch = malloc(sizeof(Statement));
-        *else_branch = statement(parser, tokenizer);
+        Statement stmt = statement(parser, tokenizer);
+        else_branch = new_node(parser, &stmt, sizeof(stmt));
     }
 
     IfStatement stmt = {
-        .then_branch = then_branch,
+        .then_branch = new_node(parser, &then_branch, sizeof(then_branch)),
         .else_branch = else_branch,
         .condition = condition,
     };
@@ -564,15 +482,17 @@ static Statement while_statement(Parser *parser, Tokenizer *tokenizer) {
         TOKEN_RIGHT_PAREN,
         "Expected ')' after condition."
     );
+    Statement body = statement(parser, tokenizer);
     WhileStatement stmt = {
         .condition = condition,
-        .body = malloc(sizeof(Statement)),
+        .body = new_node(parser, &body, sizeof(body)),
     };
-    *stmt.body = statement(parser, tokenizer);
     return (Statement){ .kind = STMT_WHILE, .as.stmt_while = stmt };
  }
 
-static Statement function_statement(Parser *parser, Tokenizer *tokenizer) {
+static Statement function_statement(Parser *parser, Tokenizer *tokenizer, BodyMode mode) {
+    /* The name has been scanned, and nothing after it. */
+    int line = tokenizer->line;
     Token name = consume(
         parser, tokenizer,
         TOKEN_IDENTIFIER,
@@ -583,7 +503,7 @@ static Statement function_statement(Parser *parser, Tokenizer *tokenizer) {
         TOKEN_LEFT_PAREN,
         "Expected '(' after identifier."
     );
-    String_DynArray parameters = {0};
+    size_t first = parser->pending_params.count;
     if (!check(parser, TOKEN_RIGHT_PAREN)) {
         do {
             Token parameter = consume(
@@ -592,8 +512,8 @@ static Statement function_statement(Parser *parser, Tokenizer *tokenizer) {
                 "Expected parameter name."
             );
             dynarray_insert(
-                &parameters,
-                own_string_n(parameter.start, parameter.length)
+                &parser->pending_params,
+                TOKEN_SLICE(parameter)
             );
         } while (match(parser, tokenizer, 1, TOKEN_COMMA));
     }
@@ -607,11 +527,43 @@ static Statement function_statement(Parser *parser, Tokenizer *tokenizer) {
         TOKEN_LEFT_BRACE,
         "Expected '{' after the ')'."
     );
+    AstList parameters = add_list(parser, &parser->pending_params, first);
     FunctionStatement stmt = {
-        .name = own_string_n(name.start, name.length),
-        .stmts = block(parser, tokenizer),
+        .name = TOKEN_SLICE(name),
         .parameters = parameters,
+        .lazy = AST_NONE,
+    };
+    if (mode == BODY_PARSE) {
+        stmt.stmts = block(parser, tokenizer);
+        return (Statement){ .kind = STMT_FN, .as.stmt_fn = stmt };
+    }
+    if (mode == BODY_DEFER) {
+        /* The body is parsed without making any nodes, which only
+         * checks its syntax, and is parsed for real when it is
+         * compiled. */
+        parser->checking = true;
+        block(parser, tokenizer);
+        parser->checking = false;
+    } else {
+        /* Skipping the body only matches its braces, which are never
+         * part of another token. */
+        for (int depth = 1; depth > 0; advance(parser, tokenizer)) {
+            if (check(parser, TOKEN_EOF)) {
+                parse_error(parser, "Expected '}' at the end of the block.");
+                break;
+            }
+            if (check(parser, TOKEN_LEFT_BRACE)) {
+                depth++;
+            } else if (check(parser, TOKEN_RIGHT_BRACE)) {
+                depth--;
+            }
+        }
+    }
+    LazyFunction body = {
+        .source = { name.start, parser->previous.start + parser->previous.length - name.start },
+        .line = line,
     };
+    stmt.lazy = add_node(parser->ast, &body, sizeof(body));
     return (Statement){ .kind = STMT_FN, .as.stmt_fn = stmt };
 }
 
@@ -633,6 +585,8 @@ static Statement statement(Parser *parser, Tokenizer *tokenizer) {
         return print_statement(parser, tokenizer);
     } else if (match(parser, tokenizer, 1, TOKEN_LET)) {
         return let_statement(parser, tokenizer);
+    } else if (match(parser, tokenizer, 1, TOKEN_CONST)) {
+        return const_statement(parser, tokenizer);
     } else if (match(parser, tokenizer, 1, TOKEN_LEFT_BRACE)) {
         BlockStatement stmt = { .stmts = block(parser, tokenizer) };
         return (Statement){ .kind = STMT_BLOCK, .as.stmt_block = stmt };
@@ -641,7 +595,7 @@ static Statement statement(Parser *parser, Tokenizer *tokenizer) {
     } else if (match(parser, tokenizer, 1, TOKEN_WHILE)) {
         return while_statement(parser, tokenizer);
     } else if (match(parser, tokenizer, 1, TOKEN_FN)) {
-        return function_statement(parser, tokenizer);
+        return function_statement(parser, tokenizer, BODY_PARSE);
     } else if (match(parser, tokenizer, 1, TOKEN_RETURN)) {
         return return_statement(parser, tokenizer);
     } else {
@@ -649,14 +603,36 @@ static Statement statement(Parser *parser, Tokenizer *tokenizer) {
     }
 }
 
-static Statement parse_statement(Parser *parser, Tokenizer *tokenizer) {
+void init_parser(Parser *parser, Tokenizer *tokenizer, Ast *ast) {
+    memset(parser, 0, sizeof(Parser));
+    parser->ast = ast;
+    advance(parser, tokenizer);
+}
+
+void free_parser(Parser *parser) {
+    dynarray_free(&parser->pending_stmts);
+    dynarray_free(&parser->pending_args);
+    dynarray_free(&parser->pending_params);
+}
+
+Statement parse_statement(Parser *parser, Tokenizer *tokenizer) {
+    /* Only top-level functions are deferred, so that the constants
+     * a body can see are always a prefix of those declared so far. */
+    if (parser->bodies != BODY_PARSE && match(parser, tokenizer, 1, TOKEN_FN)) {
+        return function_statement(parser, tokenizer, parser->bodies);
+    }
     return statement(parser, tokenizer);
 }
 
-void parse(Parser *parser, Tokenizer *tokenizer, Statement_DynArray *stmts) {
-    parser->had_error = false;
-    advance(parser, tokenizer);
+Statement parse_function(Parser *parser, Tokenizer *tokenizer) {
+    return function_statement(parser, tokenizer, BODY_PARSE);
+}
+
+void parse(Parser *parser, Tokenizer *tokenizer, Ast *ast, Statement_DynArray *stmts, BodyMode bodies) {
+    init_parser(parser, tokenizer, ast);
+    parser->bodies = bodies;
     while (parser->current.type != TOKEN_EOF) {
         dynarray_insert(stmts, parse_statement(parser, tokenizer));
     }
+    free_parser(parser);
 }
@@ -2,6 +2,7 @@
 #define venom_parser_h
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "dynarray.h"
 #include "tokenizer.h"
 #include "object.h"
@@ -17,6 +18,33 @@ typedef enum {
     EXP_LOGICAL,
 } ExpressionKind;
 
+typedef DynArray(Slice) Name_DynArray;
+
+/* Every node of the AST lives in one growable arena and refers to
+ * other nodes by their offset into it, which is 32 bits wide. The
+ * whole tree is freed at once with the arena. Adding a node may move
+ * the arena, so a pointer to a node is only good until the next one
+ * is added. Offset 0 is never a node, so it can stand for none. */
+typedef struct {
+    char *data;
+    size_t count;
+    size_t capacity;
+} Ast;
+
+typedef uint32_t AstIndex;
+
+#define AST_NONE 0
+
+/* A run of nodes of the same type (statements, arguments, parameter
+ * names) stored next to each other. */
+typedef struct {
+    AstIndex start;
+    uint32_t count;
+} AstList;
+
+#define AST_NODE(ast, type, index) ((type *)((ast)->data + (index)))
+#define AST_LIST(ast, type, list) AST_NODE(ast, type, (list).start)
+
 typedef struct LiteralExpression LiteralExpression;
 typedef struct VariableExpression VariableExpression;
 typedef struct StringExpression StringExpression;
@@ -29,18 +57,10 @@ typedef struct Expression Expression;
 
 typedef DynArray(Expression) Expression_DynArray;
 
+/* 'index' locates the node of the type that 'kind' names. */
 typedef struct Expression {
     ExpressionKind kind;
-    union {
-        LiteralExpression *expr_literal;
-        VariableExpression *expr_variable;
-        StringExpression *expr_string;
-        UnaryExpression *expr_unary;
-        BinaryExpression *expr_binary;
-        CallExpression *expr_call;
-        AssignExpression *expr_assign;
-        LogicalExpression *expr_logical;
-    } as;
+    AstIndex index;
 } Expression;
 
 typedef struct LiteralExpression {
@@ -49,15 +69,15 @@ typedef struct LiteralExpression {
 } LiteralExpression;
 
 typedef struct VariableExpression {
-    char *name;
+    Slice name;
 } VariableExpression;
 
 typedef struct StringExpression {
-    char *str;
+    Slice str;
 } StringExpression;
 
 typedef struct UnaryExpression {
-    Expression *exp;
+    Expression exp;
 } UnaryExpression;
 
 typedef struct BinaryExpression {
@@ -67,8 +87,8 @@ typedef struct BinaryExpression {
 } BinaryExpression;
 
 typedef struct CallExpression {
-    VariableExpression *var;
-    Expression_DynArray arguments;
+    VariableExpression var;
+    AstList arguments;  /* of Expression */
 } CallExpression;
 
 typedef struct AssignExpression {
@@ -84,6 +104,7 @@ typedef struct LogicalExpression {
 
 typedef enum {
     STMT_LET,
+    STMT_CONST,
     STMT_EXPR,
     STMT_PRINT,
     STMT_BLOCK,
@@ -98,7 +119,7 @@ typedef struct Statement Statement;
 typedef DynArray(Statement) Statement_DynArray;
 
 typedef struct {
-    char *name;
+    Slice name;
     Expression initializer;
 } LetStatement;
 
@@ -111,24 +132,33 @@ typedef struct {
 } ExpressionStatement;
 
 typedef struct {
-    Statement_DynArray stmts;
+    AstList stmts;  /* of Statement */
 } BlockStatement;
 
+/* A function whose body is compiled on its first call, when it is
+ * parsed from its source. */
 typedef struct {
-    char *name;
-    Statement_DynArray stmts;
-    String_DynArray parameters;
+    Slice source;  /* from the function's name to its closing '}' */
+    int line;  /* of the name */
+    uint32_t constants;  /* how many constants the body can see */
+} LazyFunction;
+
+typedef struct {
+    Slice name;
+    AstList stmts;  /* of Statement, empty if 'lazy' is set */
+    AstList parameters;  /* of Slice */
+    AstIndex lazy;  /* a LazyFunction, or AST_NONE */
 } FunctionStatement;
 
 typedef struct {
     Expression condition;
-    Statement *then_branch;
-    Statement *else_branch;
+    AstIndex then_branch;
+    AstIndex else_branch;  /* or AST_NONE */
 } IfStatement;
 
 typedef struct {
     Expression condition;
-    Statement *body;
+    AstIndex body;
 } WhileStatement;
 
 typedef struct {
@@ -140,6 +170,7 @@ typedef struct Statement {
     union {
         PrintStatement stmt_print;
         LetStatement stmt_let;
+        LetStatement stmt_const;
         ExpressionStatement stmt_expr;
         BlockStatement stmt_block;
         FunctionStatement stmt_fn;
@@ -149,14 +180,50 @@ typedef struct Statement {
     } as;
 } Statement;
 
+/* How the parser treats the bodies of top-level functions. */
+typedef enum {
+    BODY_PARSE,  /* parses them */
+    BODY_DEFER,  /* only checks their syntax, and records them to be
+                  * parsed and compiled on their first call */
+    BODY_SKIP,  /* only matches their braces and records them, for
+                 * when they are parsed and checked elsewhere */
+} BodyMode;
+
 typedef struct {
     Token current;
     Token previous;
     bool had_error;
+    BodyMode bodies;
+    bool checking;  /* parsing only to check the syntax, making no nodes */
+    Ast *ast;
+    /* The elements of the lists being parsed. Nested lists are pushed
+     * on top of the outer ones, and each list is copied into the AST
+     * in one piece once it is complete. */
+    Statement_DynArray pending_stmts;
+    Expression_DynArray pending_args;
+    Name_DynArray pending_params;
 } Parser;
 
-void parse(Parser *parser, Tokenizer *tokenizer, Statement_DynArray *stmts);
-void free_expression(Expression e);
-void free_stmt(Statement stmt);
+void init_ast(Ast *ast);
+void free_ast(Ast *ast);
+
+/* Copies a node of 'size' bytes into the arena and returns its offset. */
+AstIndex add_node(Ast *ast, const void *node, size_t size);
+void parse(Parser *parser, Tokenizer *tokenizer, Ast *ast, Statement_DynArray *stmts, BodyMode bodies);
+
+/* Parsing one top-level statement at a time. After init_parser,
+ * 'parser->current' is the first token, and each parse_statement
+ * leaves it at the token after the statement, until it is TOKEN_EOF.
+ * Between top-level statements, the parser holds no offsets into the
+ * AST, so the arena may be cut back to drop the statements that are
+ * no longer needed. */
+void init_parser(Parser *parser, Tokenizer *tokenizer, Ast *ast);
+void free_parser(Parser *parser);
+Statement parse_statement(Parser *parser, Tokenizer *tokenizer);
+
+/* Parses the whole of a function declaration whose 'fn' is already
+ * behind the parser, as when the body of a deferred function is
+ * compiled. */
+Statement parse_function(Parser *parser, Tokenizer *tokenizer);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "profile.h"
+#include "regcompiler.h"
+
+/* The instructions with the highest counts that the report lists. */
+#define HOTTEST_INSTRUCTIONS 20
+
+void grow_op_counts(CodeObject *code, size_t offset) {
+    /* Counts are kept for the whole of the code as it is now, or for
+     * twice as much as before if the code has grown past that. */
+    size_t size = code->code.count;
+    if (size < code->profiled * 2) size = code->profiled * 2;
+    if (size <= offset) size = offset + 1;
+    code->op_counts = realloc(code->op_counts, sizeof(uint64_t) * size);
+    memset(code->op_counts + code->profiled, 0, sizeof(uint64_t) * (size - code->profiled));
+    code->profiled = size;
+}
+
+void start_profile(Profile *profile) {
+    profile->start = read_cycles();
+}
+
+void stop_profile(Profile *profile) {
+    profile->cycles[profile->op] += read_cycles() - profile->start;
+}
+
+typedef struct {
+    const CodeObject *code;
+    size_t offset;
+    uint64_t count;
+} Hotspot;
+
+typedef DynArray(Hotspot) Hotspot_DynArray;
+
+static const Profile *sorting;
+
+static int by_cycles(const void *a, const void *b) {
+    uint64_t x = sorting->cycles[*(const uint8_t *)a];
+    uint64_t y = sorting->cycles[*(const uint8_t *)b];
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int by_count(const void *a, const void *b) {
+    uint64_t x = ((const Hotspot *)a)->count;
+    uint64_t y = ((const Hotspot *)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static const char *function_name(const CodeObject *code) {
+    return code->name != NULL ? code->name->chars : "<top level>";
+}
+
+static CodeObject *code_at(BytecodeChunk *chunk, size_t i) {
+    return i == 0 ? &chunk->main : chunk->functions.data[i - 1];
+}
+
+static uint8_t opcode_at(const CodeObject *code, size_t offset, bool registers) {
+    /* The opcode of a wide instruction follows its prefix. */
+    uint8_t op = code->code.data[offset];
+    return op == (registers ? ROP_WIDE : OP_WIDE) ? code->code.data[offset + 1] : op;
+}
+
+void report_profile(const Profile *profile, BytecodeChunk *chunk, bool registers, FILE *out, const char *path) {
+    const char *(*name)(uint8_t) = registers ? reg_opcode_name : opcode_name;
+
+    /* What the program printed comes first. */
+    fflush(stdout);
+
+    /* The opcodes that ran, by the time spent in them. */
+    uint8_t ops[256];
+    int op_count = 0;
+    uint64_t total_count = 0, total_cycles = 0;
+    for (int op = 0; op < 256; op++) {
+        if (profile->counts[op] > 0) {
+            ops[op_count++] = op;
+            total_count += profile->counts[op];
+            total_cycles += profile->cycles[op];
+        }
+    }
+    sorting = profile;
+    qsort(ops, op_count, sizeof(ops[0]), by_cycles);
+
+    /* Every offset that ran, in the order of the code. */
+    Hotspot_DynArray hotspots = {0};
+    for (size_t i = 0; i <= chunk->functions.count; i++) {
+        const CodeObject *code = code_at(chunk, i);
+        for (size_t offset = 0; offset < code->profiled; offset++) {
+            if (code->op_counts[offset] > 0) {
+                dynarray_insert(&hotspots, ((Hotspot){ code, offset, code->op_counts[offset] }));
+            }
+        }
+    }
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write the profile to \"%s\".\n", path);
+    } else {
+        fprintf(file, "{\n  \"backend\": \"%s\",\n", registers ? "registers" : "stack");
+        fprintf(file, "  \"clock\": \"%s\",\n",
+#if defined(__x86_64__) || defined(__i386__)
+            "tsc"
+#else
+            "ns"
+#endif
+        );
+        fprintf(file, "  \"opcodes\": [");
+        for (int i = 0; i < op_count; i++) {
+            fprintf(file, "%s\n    {\"opcode\": \"%s\", \"count\": %llu, \"cycles\": %llu}",
+                i > 0 ? "," : "", name(ops[i]),
+                (unsigned long long)profile->counts[ops[i]],
+                (unsigned long long)profile->cycles[ops[i]]);
+        }
+        fprintf(file, "\n  ],\n  \"instructions\": [");
+        for (size_t i = 0; i < hotspots.count; i++) {
+            const Hotspot *hotspot = &hotspots.data[i];
+            fprintf(file, "%s\n    {\"function\": \"%s\", \"offset\": %zu, \"opcode\": \"%s\", \"count\": %llu}",
+                i > 0 ? "," : "", function_name(hotspot->code), hotspot->offset,
+                name(opcode_at(hotspot->code, hotspot->offset, registers)),
+                (unsigned long long)hotspot->count);
+        }
+        fprintf(file, "\n  ]\n}\n");
+        fclose(file);
+    }
+
+    fprintf(out, "%-16s %14s %7s %16s %7s %10s\n",
+        "opcode", "count", "", "cycles", "", "cycles/op");
+    for (int i = 0; i < op_count; i++) {
+        uint64_t count = profile->counts[ops[i]];
+        uint64_t cycles = profile->cycles[ops[i]];
+        fprintf(out, "%-16s %14llu %6.2f%% %16llu %6.2f%% %10.1f\n", name(ops[i]),
+            (unsigned long long)count, 100.0 * count / total_count,
+            (unsigned long long)cycles, total_cycles ? 100.0 * cycles / total_cycles : 0.0,
+            (double)cycles / count);
+    }
+
+    qsort(hotspots.data, hotspots.count, sizeof(Hotspot), by_count);
+    fprintf(out, "\n%-24s %8s  %-16s %14s\n", "function", "offset", "opcode", "count");
+    for (size_t i = 0; i < hotspots.count && i < HOTTEST_INSTRUCTIONS; i++) {
+        const Hotspot *hotspot = &hotspots.data[i];
+        fprintf(out, "%-24s %8zu  %-16s %14llu\n", function_name(hotspot->code), hotspot->offset,
+            name(opcode_at(hotspot->code, hotspot->offset, registers)), (unsigned long long)hotspot->count);
+    }
+    if (file != NULL) {
+        fprintf(out, "\nprofile written to %s\n", path);
+    }
+
+    dynarray_free(&hotspots);
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef venom_profile_h
+#define venom_profile_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "compiler.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+/* With --profile-ops, the VM runs in a second copy of its dispatch
+ * loops (see profvm.c) that counts every instruction it dispatches,
+ * per opcode and per offset in each code object, and the cycles from
+ * the dispatch of each instruction to the dispatch of the next one,
+ * per opcode. The cycles are those of the time-stamp counter where
+ * there is one, and nanoseconds elsewhere, and they include the
+ * profiler's own bookkeeping, a few dozen cycles per instruction, as
+ * well as whatever the instruction called into: the garbage collector,
+ * the compiler for a function's first call, stdio for a print. */
+typedef struct Profile {
+    uint64_t counts[256];  /* dispatches per opcode */
+    uint64_t cycles[256];  /* per opcode */
+    uint8_t op;  /* the instruction being timed */
+    uint64_t start;  /* when it was dispatched */
+} Profile;
+
+static inline uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+void grow_op_counts(CodeObject *code, size_t offset);
+
+/* Called by the profiling loops as they dispatch the instruction at
+ * 'ip' in 'code'. 'wide' is the prefix of wide instructions in the
+ * code's bytecode (OP_WIDE or ROP_WIDE), which the loops dispatch
+ * like an instruction of its own, but which then runs the opcode
+ * after it without dispatching again. A wide instruction is counted
+ * and timed as that opcode. */
+static inline void profile_instruction(Profile *profile, CodeObject *code, const uint8_t *ip, uint8_t wide) {
+    uint8_t op = *ip == wide ? ip[1] : *ip;
+    uint64_t now = read_cycles();
+    profile->cycles[profile->op] += now - profile->start;
+    profile->start = now;
+    profile->op = op;
+    profile->counts[op]++;
+
+    /* The top level grows as statements are streamed in, so its
+     * counts may have to grow with it. */
+    size_t offset = ip - code->code.data;
+    if (offset >= code->profiled) {
+        grow_op_counts(code, offset);
+    }
+    code->op_counts[offset]++;
+}
+
+/* Around each run of the profiling loops, so that the time between
+ * runs is not charged to any instruction. */
+void start_profile(Profile *profile);
+void stop_profile(Profile *profile);
+
+/* Prints the opcodes sorted by the cycles spent in them and the
+ * instructions that ran the most times to 'out', and writes all of
+ * the counts to 'path' as JSON, with each offset under the name of
+ * its function. */
+void report_profile(const Profile *profile, BytecodeChunk *chunk, bool registers, FILE *out, const char *path);
+
+#endif
\ No newline at end of file
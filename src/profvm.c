@@ -0,0 +1,9 @@
+/* The dispatch loops of vm.c and regvm.c, compiled a second time with
+ * venom_profile_ops defined, as run_profiled and run_registers_profiled,
+ * which count and time every instruction (see profile.h). They are
+ * picked instead of run and run_registers before the VM starts, so
+ * the loops without profiling are the same as if it didn't exist. */
+#undef venom_count_instructions
+#define venom_profile_ops
+#include "vm.c"
+#include "regvm.c"
\ No newline at end of file
@@ -0,0 +1,698 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "lazy.h"
+#include "regcompiler.h"
+
+void init_reg_compiler(RegCompiler *compiler, Ast *ast, CodeObject *code) {
+    memset(compiler, 0, sizeof(RegCompiler));
+    compiler->ast = ast;
+    compiler->code = code;
+}
+
+static void emit_byte(CodeObject *code, uint8_t byte) {
+    dynarray_insert(&code->code, byte);
+}
+
+const char *reg_operand_format(RegOpcode op) {
+    /* Registers are 'b' operands, see compiler.h for the others. */
+    switch (op) {
+        case ROP_PRINT:
+        case ROP_TRUE:
+        case ROP_FALSE:
+        case ROP_NULL:
+        case ROP_RET:
+            return "b";
+        case ROP_LOADK:
+        case ROP_LOADS:
+        case ROP_GETG:
+            return "bk";
+        case ROP_SETG:
+            return "kb";
+        case ROP_MOVE:
+        case ROP_NOT:
+        case ROP_NEGATE:
+            return "bb";
+        case ROP_JMP:
+            return "j";
+        case ROP_JZ:
+            return "bj";
+        case ROP_FUNC:  /* slot, function */
+            return "kk";
+        case ROP_CALL:  /* dst, slot, base, argcount, cache */
+            return "bkbbk";
+        case ROP_TAILCALL:  /* slot, base, argcount, cache */
+            return "kbbk";
+        case ROP_WIDE:
+        case ROP_EXIT:
+            return "";
+        default:
+            return "bbb";
+    }
+}
+
+static int instruction_length(const Instruction *instruction) {
+    int prefix = instruction->wide ? 1 : 0;
+    return prefix + 1 + operands_length(reg_operand_format(instruction->op), instruction->wide);
+}
+
+static void write_instruction(CodeObject *code, const Instruction *instruction) {
+    if (instruction->wide) {
+        emit_byte(code, ROP_WIDE);
+    }
+    emit_byte(code, instruction->op);
+    write_operands(&code->code, reg_operand_format(instruction->op), instruction->wide, instruction->operands);
+}
+
+static void emit_instruction(CodeObject *code, Instruction instruction) {
+    /* Emits the instruction in the narrow form unless one of its
+     * operands does not fit. */
+    instruction.wide = !operands_fit(reg_operand_format(instruction.op), instruction.operands);
+    write_instruction(code, &instruction);
+}
+
+static void emit_op(CodeObject *code, RegOpcode op, uint32_t a, uint32_t b, uint32_t c) {
+    /* Emits a three-address instruction. Operands that the opcode
+     * doesn't take are ignored, by convention they are passed as -1. */
+    emit_instruction(code, (Instruction){ .op = op, .operands = { a, b, c } });
+}
+
+static int emit_jump(CodeObject *code, RegOpcode jump, int src) {
+    /* Like the stack compiler, emit a placeholder offset that is
+     * backpatched once the size of the jumped-over code is known. It
+     * is always wide, and narrowed when the code is finished if it
+     * fits. The returned index points to the first byte of the offset. */
+    Instruction instruction = { .op = jump, .wide = true, .operands = { src } };
+    write_instruction(code, &instruction);
+    return code->code.count - 4;
+}
+
+static void patch_jump(CodeObject *code, int jump) {
+    /* Jump offsets are relative to the end of the jump instruction,
+     * which is where the VM's ip points after reading the offset. */
+    uint32_t offset = code->code.count - (jump + 4);
+    code->code.data[jump] = (offset >> 24) & 0xFF;
+    code->code.data[jump+1] = (offset >> 16) & 0xFF;
+    code->code.data[jump+2] = (offset >> 8) & 0xFF;
+    code->code.data[jump+3] = offset & 0xFF;
+}
+
+static void emit_loop(CodeObject *code, int loop_start) {
+    /* The distance back to the start of the loop is already known,
+     * so the jump is wide only if it has to be. */
+    Instruction loop = { .op = ROP_JMP };
+    loop.operands[0] = loop_start - (int)(code->code.count + instruction_length(&loop));
+    if (!operands_fit(reg_operand_format(ROP_JMP), loop.operands)) {
+        loop.wide = true;
+        loop.operands[0] = loop_start - (int)(code->code.count + instruction_length(&loop));
+    }
+    emit_instruction(code, loop);
+}
+
+static int alloc_register(RegCompiler *compiler) {
+    /* The code's max_stack is the most registers ever live at once.
+     * Register operands are a single byte, so a register past 255
+     * would silently alias a low one. As in compiler.c, the error is
+     * reported once and handed back through compile_reg_function(),
+     * since the function may be compiled while the program runs. */
+    int reg = compiler->regs_count++;
+    if (reg > UINT8_MAX && !compiler->had_error) {
+        compiler->had_error = true;
+        fprintf(stderr, "compile error: code needs more than %d registers\n", UINT8_MAX + 1);
+    }
+    if ((uint32_t)compiler->regs_count > compiler->code->max_stack) {
+        compiler->code->max_stack = compiler->regs_count;
+    }
+    return reg;
+}
+
+static void declare_local(RegCompiler *compiler, String *name) {
+    /* Every local has a register of its own, so there is room for it
+     * unless alloc_register() has already reported the error. */
+    if (compiler->locals_count <= UINT8_MAX) {
+        compiler->locals[compiler->locals_count++] = name;
+    }
+}
+
+static int resolve_local(RegCompiler *compiler, String *name) {
+    /* Names are interned, so they are compared by address. */
+    for (int i = compiler->locals_count - 1; i >= 0; i--) {
+        if (compiler->locals[i] == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void compile_expression_to(RegCompiler *compiler, BytecodeChunk *chunk, Expression exp, int dst);
+
+static int compile_expression_any(RegCompiler *compiler, BytecodeChunk *chunk, Expression exp) {
+    /* Locals already live in a register, so they are used in place
+     * instead of being copied. Anything else is evaluated into a fresh
+     * temporary, which the caller releases by restoring 'regs_count'. */
+    if (exp.kind == EXP_VARIABLE) {
+        Slice name = AST_NODE(compiler->ast, VariableExpression, exp.index)->name;
+        int index = resolve_local(compiler, intern(chunk, name));
+        if (index != -1) {
+            return index;
+        }
+    }
+    int dst = alloc_register(compiler);
+    compile_expression_to(compiler, chunk, exp, dst);
+    return dst;
+}
+
+static int compile_arguments(RegCompiler *compiler, BytecodeChunk *chunk, CallExpression *call) {
+    /* Each argument is evaluated straight into its own register in a
+     * contiguous block above all live registers, which is where the
+     * callee's frame will start. Returns the first register. */
+    int base = compiler->regs_count;
+    Expression *arguments = AST_LIST(compiler->ast, Expression, call->arguments);
+    for (size_t i = 0; i < call->arguments.count; i++) {
+        int arg = alloc_register(compiler);
+        compile_expression_to(compiler, chunk, arguments[i], arg);
+        compiler->regs_count = arg + 1;
+    }
+    return base;
+}
+
+static RegOpcode binary_opcode(char *operator) {
+    if (strcmp(operator, "+") == 0) return ROP_ADD;
+    if (strcmp(operator, "-") == 0) return ROP_SUB;
+    if (strcmp(operator, "*") == 0) return ROP_MUL;
+    if (strcmp(operator, "/") == 0) return ROP_DIV;
+    if (strcmp(operator, "%%") == 0) return ROP_MOD;
+    if (strcmp(operator, ">") == 0) return ROP_GT;
+    if (strcmp(operator, "<") == 0) return ROP_LT;
+    if (strcmp(operator, ">=") == 0) return ROP_GE;
+    if (strcmp(operator, "<=") == 0) return ROP_LE;
+    if (strcmp(operator, "==") == 0) return ROP_EQ;
+    if (strcmp(operator, "!=") == 0) return ROP_NE;
+    assert(0);
+}
+
+static void compile_assign(RegCompiler *compiler, BytecodeChunk *chunk, AssignExpression *assign, int dst) {
+    /* 'dst' is -1 when the value of the assignment is not used. */
+    Slice name = AST_NODE(compiler->ast, VariableExpression, assign->lhs.index)->name;
+    int index = resolve_local(compiler, intern(chunk, name));
+    if (index != -1) {
+        compile_expression_to(compiler, chunk, assign->rhs, index);
+        if (dst != -1 && dst != index) {
+            emit_op(compiler->code, ROP_MOVE, dst, index, -1);
+        }
+    } else {
+        int saved = compiler->regs_count;
+        int src = compile_expression_any(compiler, chunk, assign->rhs);
+        emit_op(compiler->code, ROP_SETG, resolve_global(chunk, name), src, -1);
+        if (dst != -1 && dst != src) {
+            emit_op(compiler->code, ROP_MOVE, dst, src, -1);
+        }
+        compiler->regs_count = saved;
+    }
+}
+
+static void compile_expression_to(RegCompiler *compiler, BytecodeChunk *chunk, Expression exp, int dst) {
+    Ast *ast = compiler->ast;
+    int saved = compiler->regs_count;
+    switch (exp.kind) {
+        case EXP_LITERAL: {
+            LiteralExpression *literal = AST_NODE(ast, LiteralExpression, exp.index);
+            char *specval = literal->specval;
+            if (specval == NULL) {
+                uint32_t const_index = add_constant(compiler->code, literal->dval);
+                emit_op(compiler->code, ROP_LOADK, dst, const_index, -1);
+            } else if (strcmp(specval, "true") == 0) {
+                emit_op(compiler->code, ROP_TRUE, dst, -1, -1);
+            } else if (strcmp(specval, "false") == 0) {
+                emit_op(compiler->code, ROP_FALSE, dst, -1, -1);
+            } else if (strcmp(specval, "null") == 0) {
+                emit_op(compiler->code, ROP_NULL, dst, -1, -1);
+            }
+            break;
+        }
+        case EXP_STRING: {
+            uint32_t const_index = add_string(chunk, AST_NODE(ast, StringExpression, exp.index)->str);
+            emit_op(compiler->code, ROP_LOADS, dst, const_index, -1);
+            break;
+        }
+        case EXP_VARIABLE: {
+            Slice name = AST_NODE(ast, VariableExpression, exp.index)->name;
+            int index = resolve_local(compiler, intern(chunk, name));
+            if (index == -1) {
+                uint32_t slot = resolve_global(chunk, name);
+                emit_op(compiler->code, ROP_GETG, dst, slot, -1);
+            } else if (index != dst) {
+                emit_op(compiler->code, ROP_MOVE, dst, index, -1);
+            }
+            break;
+        }
+        case EXP_UNARY: {
+            int src = compile_expression_any(compiler, chunk, AST_NODE(ast, UnaryExpression, exp.index)->exp);
+            emit_op(compiler->code, ROP_NEGATE, dst, src, -1);
+            break;
+        }
+        case EXP_BINARY: {
+            BinaryExpression *binary = AST_NODE(ast, BinaryExpression, exp.index);
+            int a = compile_expression_any(compiler, chunk, binary->lhs);
+            int b = compile_expression_any(compiler, chunk, binary->rhs);
+            emit_op(compiler->code, binary_opcode(binary->operator), dst, a, b);
+            break;
+        }
+        case EXP_CALL: {
+            CallExpression *call = AST_NODE(ast, CallExpression, exp.index);
+            int base = compile_arguments(compiler, chunk, call);
+            uint32_t slot = resolve_global(chunk, call->var.name);
+            emit_instruction(compiler->code, (Instruction){
+                .op = ROP_CALL,
+                .operands = { dst, slot, base, call->arguments.count, add_cache(chunk) },
+            });
+            break;
+        }
+        case EXP_ASSIGN: {
+            compile_assign(compiler, chunk, AST_NODE(ast, AssignExpression, exp.index), dst);
+            break;
+        }
+        case EXP_LOGICAL: {
+            LogicalExpression *logical = AST_NODE(ast, LogicalExpression, exp.index);
+            compile_expression_to(compiler, chunk, logical->lhs, dst);
+            if (strcmp(logical->operator, "&&") == 0) {
+                /* If the left operand is falsey, it is the result. */
+                int end_jump = emit_jump(compiler->code, ROP_JZ, dst);
+                compile_expression_to(compiler, chunk, logical->rhs, dst);
+                patch_jump(compiler->code, end_jump);
+            } else if (strcmp(logical->operator, "||") == 0) {
+                /* If the left operand is truthy, it is the result. */
+                int else_jump = emit_jump(compiler->code, ROP_JZ, dst);
+                int end_jump = emit_jump(compiler->code, ROP_JMP, -1);
+                patch_jump(compiler->code, else_jump);
+                compile_expression_to(compiler, chunk, logical->rhs, dst);
+                patch_jump(compiler->code, end_jump);
+            }
+            break;
+        }
+        default: assert(0);
+    }
+    compiler->regs_count = saved;
+}
+
+static const char *reg_opcode_names[] = {
+    [ROP_PRINT] = "ROP_PRINT",
+    [ROP_LOADK] = "ROP_LOADK",
+    [ROP_LOADS] = "ROP_LOADS",
+    [ROP_TRUE] = "ROP_TRUE",
+    [ROP_FALSE] = "ROP_FALSE",
+    [ROP_NULL] = "ROP_NULL",
+    [ROP_MOVE] = "ROP_MOVE",
+    [ROP_GETG] = "ROP_GETG",
+    [ROP_SETG] = "ROP_SETG",
+    [ROP_ADD] = "ROP_ADD",
+    [ROP_SUB] = "ROP_SUB",
+    [ROP_MUL] = "ROP_MUL",
+    [ROP_DIV] = "ROP_DIV",
+    [ROP_MOD] = "ROP_MOD",
+    [ROP_EQ] = "ROP_EQ",
+    [ROP_NE] = "ROP_NE",
+    [ROP_GT] = "ROP_GT",
+    [ROP_GE] = "ROP_GE",
+    [ROP_LT] = "ROP_LT",
+    [ROP_LE] = "ROP_LE",
+    [ROP_NOT] = "ROP_NOT",
+    [ROP_NEGATE] = "ROP_NEGATE",
+    [ROP_JMP] = "ROP_JMP",
+    [ROP_JZ] = "ROP_JZ",
+    [ROP_FUNC] = "ROP_FUNC",
+    [ROP_CALL] = "ROP_CALL",
+    [ROP_TAILCALL] = "ROP_TAILCALL",
+    [ROP_RET] = "ROP_RET",
+    [ROP_WIDE] = "ROP_WIDE",
+    [ROP_EXIT] = "ROP_EXIT",
+};
+
+const char *reg_opcode_name(uint8_t op) {
+    return op < sizeof(reg_opcode_names) / sizeof(reg_opcode_names[0]) && reg_opcode_names[op] != NULL
+        ? reg_opcode_names[op] : "?";
+}
+
+#ifdef venom_debug
+int disassemble_reg_instruction(BytecodeChunk *chunk, CodeObject *code, int offset) {
+    Instruction instruction;
+    uint8_t *ip = &code->code.data[offset];
+    instruction.wide = ip[0] == ROP_WIDE;
+    instruction.op = ip[instruction.wide ? 1 : 0];
+    const char *format = reg_operand_format(instruction.op);
+    read_operands(format, instruction.wide, &ip[instruction.wide ? 2 : 1], instruction.operands);
+
+    uint32_t *operands = instruction.operands;
+    printf("%d: %s%s", offset, instruction.wide ? "ROP_WIDE " : "", reg_opcode_names[instruction.op]);
+    switch (instruction.op) {
+        case ROP_PRINT:
+        case ROP_TRUE:
+        case ROP_FALSE:
+        case ROP_NULL:
+        case ROP_RET: {
+            printf(" r%u\n", operands[0]);
+            break;
+        }
+        case ROP_LOADK: {
+            printf(" r%u, k%u ('%f')\n", operands[0], operands[1], code->cp.data[operands[1]]);
+            break;
+        }
+        case ROP_LOADS: {
+            printf(" r%u, s%u ('%s')\n", operands[0], operands[1], chunk->sp.data[operands[1]]->chars);
+            break;
+        }
+        case ROP_GETG: {
+            printf(" r%u, g%u ('%s')\n", operands[0], operands[1], chunk->global_names.data[operands[1]]->chars);
+            break;
+        }
+        case ROP_SETG: {
+            printf(" g%u ('%s'), r%u\n", operands[0], chunk->global_names.data[operands[0]]->chars, operands[1]);
+            break;
+        }
+        case ROP_MOVE:
+        case ROP_NOT:
+        case ROP_NEGATE: {
+            printf(" r%u, r%u\n", operands[0], operands[1]);
+            break;
+        }
+        case ROP_JMP: {
+            printf(" (offset: '%d')\n", (int32_t)operands[0]);
+            break;
+        }
+        case ROP_JZ: {
+            printf(" r%u, (offset: '%d')\n", operands[0], (int32_t)operands[1]);
+            break;
+        }
+        case ROP_FUNC: {
+            printf(
+                " (name: '%s', function: '%u')\n",
+                chunk->global_names.data[operands[0]]->chars, operands[1]
+            );
+            break;
+        }
+        case ROP_CALL: {
+            printf(
+                " r%u, '%s', (base: r%u, argcount: '%u', cache: '%u')\n",
+                operands[0], chunk->global_names.data[operands[1]]->chars, operands[2], operands[3], operands[4]
+            );
+            break;
+        }
+        case ROP_TAILCALL: {
+            printf(
+                " '%s', (base: r%u, argcount: '%u', cache: '%u')\n",
+                chunk->global_names.data[operands[0]]->chars, operands[1], operands[2], operands[3]
+            );
+            break;
+        }
+        case ROP_EXIT: {
+            printf("\n");
+            break;
+        }
+        default: {
+            printf(" r%u, r%u, r%u\n", operands[0], operands[1], operands[2]);
+            break;
+        }
+    }
+    return instruction_length(&instruction);
+}
+
+static void disassemble_reg_code(BytecodeChunk *chunk, CodeObject *code, size_t start) {
+    for (size_t offset = start; offset < code->code.count;) {
+        offset += disassemble_reg_instruction(chunk, code, offset);
+    }
+}
+
+void disassemble_registers(BytecodeChunk *chunk, size_t start) {
+    disassemble_reg_code(chunk, &chunk->main, start);
+    for (size_t i = 0; i < chunk->functions.count; i++) {
+        CodeObject *code = chunk->functions.data[i];
+        printf(
+            "function %zu: '%s' (paramcount: '%u', registers: '%u')\n",
+            i, code->name->chars, code->paramcount, code->max_stack
+        );
+        if (code->source.start != NULL) {
+            printf("(not compiled yet)\n");
+        }
+        disassemble_reg_code(chunk, code, 0);
+    }
+}
+#endif
+
+void compile_registers(RegCompiler *compiler, BytecodeChunk *chunk, Statement stmt, bool scoped) {
+    int saved = compiler->regs_count;
+    switch (stmt.kind) {
+        case STMT_PRINT: {
+            int src = compile_expression_any(compiler, chunk, stmt.as.stmt_print.exp);
+            emit_op(compiler->code, ROP_PRINT, src, -1, -1);
+            break;
+        }
+        case STMT_LET: {
+            if (!scoped) {
+                int src = compile_expression_any(compiler, chunk, stmt.as.stmt_let.initializer);
+                emit_op(compiler->code, ROP_SETG, resolve_global(chunk, stmt.as.stmt_let.name), src, -1);
+            } else {
+                /* Between statements, only locals are live, so the
+                 * next free register becomes the new local's slot.
+                 * The initializer is compiled before the name is
+                 * declared so that it still sees any outer binding. */
+                int slot = alloc_register(compiler);
+                compile_expression_to(compiler, chunk, stmt.as.stmt_let.initializer, slot);
+                declare_local(compiler, intern(chunk, stmt.as.stmt_let.name));
+                saved = compiler->regs_count;
+            }
+            break;
+        }
+        case STMT_EXPR: {
+            Expression exp = stmt.as.stmt_expr.exp;
+            if (exp.kind == EXP_ASSIGN) {
+                compile_assign(compiler, chunk, AST_NODE(compiler->ast, AssignExpression, exp.index), -1);
+            } else {
+                compile_expression_any(compiler, chunk, exp);
+            }
+            break;
+        }
+        case STMT_BLOCK: {
+            /* Locals declared in the block go out of scope at its end,
+             * and their registers are reused. */
+            int locals_count = compiler->locals_count;
+            Statement *stmts = AST_LIST(compiler->ast, Statement, stmt.as.stmt_block.stmts);
+            for (size_t i = 0; i < stmt.as.stmt_block.stmts.count; i++) {
+                compile_registers(compiler, chunk, stmts[i], scoped);
+            }
+            compiler->locals_count = locals_count;
+            break;
+        }
+        case STMT_IF: {
+            int condition = compile_expression_any(compiler, chunk, stmt.as.stmt_if.condition);
+            int then_jump = emit_jump(compiler->code, ROP_JZ, condition);
+            compiler->regs_count = saved;
+
+            compile_registers(compiler, chunk, *AST_NODE(compiler->ast, Statement, stmt.as.stmt_if.then_branch), scoped);
+
+            if (stmt.as.stmt_if.else_branch != AST_NONE) {
+                int else_jump = emit_jump(compiler->code, ROP_JMP, -1);
+                patch_jump(compiler->code, then_jump);
+                compile_registers(compiler, chunk, *AST_NODE(compiler->ast, Statement, stmt.as.stmt_if.else_branch), scoped);
+                patch_jump(compiler->code, else_jump);
+            } else {
+                patch_jump(compiler->code, then_jump);
+            }
+            saved = compiler->regs_count;
+            break;
+        }
+        case STMT_WHILE: {
+            int loop_start = compiler->code->code.count;
+            int condition = compile_expression_any(compiler, chunk, stmt.as.stmt_while.condition);
+            int exit_jump = emit_jump(compiler->code, ROP_JZ, condition);
+            compiler->regs_count = saved;
+
+            compile_registers(compiler, chunk, *AST_NODE(compiler->ast, Statement, stmt.as.stmt_while.body), scoped);
+            emit_loop(compiler->code, loop_start);
+            patch_jump(compiler->code, exit_jump);
+            saved = compiler->regs_count;
+            break;
+        }
+        case STMT_FN: {
+            uint32_t function = add_function(
+                chunk, intern(chunk, stmt.as.stmt_fn.name),
+                stmt.as.stmt_fn.parameters.count
+            );
+            if (stmt.as.stmt_fn.lazy != AST_NONE) {
+                defer_function(compiler->ast, chunk, chunk->functions.data[function], &stmt.as.stmt_fn);
+            } else if (!compile_reg_function(compiler->ast, chunk, chunk->functions.data[function], &stmt.as.stmt_fn)) {
+                compiler->had_error = true;
+            }
+            emit_op(compiler->code, ROP_FUNC, resolve_global(chunk, stmt.as.stmt_fn.name), function, -1);
+            break;
+        }
+        case STMT_RETURN: {
+            Expression returnval = stmt.as.stmt_return.returnval;
+            if (returnval.kind == EXP_CALL) {
+                /* A call in tail position moves its arguments to the
+                 * bottom of the current frame and reuses it. */
+                CallExpression *call = AST_NODE(compiler->ast, CallExpression, returnval.index);
+                int base = compile_arguments(compiler, chunk, call);
+                emit_instruction(compiler->code, (Instruction){
+                    .op = ROP_TAILCALL,
+                    .operands = { resolve_global(chunk, call->var.name), base, call->arguments.count, add_cache(chunk) },
+                });
+                break;
+            }
+            int src = compile_expression_any(compiler, chunk, stmt.as.stmt_return.returnval);
+            emit_op(compiler->code, ROP_RET, src, -1, -1);
+            break;
+        }
+        default: assert(0);
+    }
+    compiler->regs_count = saved;
+}
+
+static void narrow_jumps(CodeObject *code, size_t start);
+
+void finish_reg_chunk(BytecodeChunk *chunk, size_t start) {
+    /* Only the code from 'start' on is new, as in finish_chunk(). */
+    emit_byte(&chunk->main, ROP_EXIT);
+    narrow_jumps(&chunk->main, start);
+}
+
+bool compile_reg_function(Ast *ast, BytecodeChunk *chunk, CodeObject *code, FunctionStatement *fn) {
+    /* The body gets its own code object and its own compiler: its
+     * frame starts with the parameters in r0..rN-1, wherever the
+     * caller put them. */
+    RegCompiler fn_compiler;
+    init_reg_compiler(&fn_compiler, ast, code);
+
+    Slice *parameters = AST_LIST(ast, Slice, fn->parameters);
+    for (size_t i = 0; i < fn->parameters.count; i++) {
+        alloc_register(&fn_compiler);
+        declare_local(&fn_compiler, intern(chunk, parameters[i]));
+    }
+
+    Statement *stmts = AST_LIST(ast, Statement, fn->stmts);
+    for (size_t i = 0; i < fn->stmts.count; i++) {
+        compile_registers(&fn_compiler, chunk, stmts[i], true);
+    }
+
+    /* Unless the body ends with a return, it returns null rather than
+     * running off the end of its code. */
+    size_t count = fn->stmts.count;
+    if (count == 0 || stmts[count-1].kind != STMT_RETURN) {
+        int dst = alloc_register(&fn_compiler);
+        emit_op(code, ROP_NULL, dst, -1, -1);
+        emit_op(code, ROP_RET, dst, -1, -1);
+    }
+    narrow_jumps(code, 0);
+    free_constant_index(code);
+    return !fn_compiler.had_error;
+}
+
+typedef struct {
+    Instruction instruction;
+    int target;  /* index of the instruction a jump lands on, or -1 */
+} RegNode;
+
+typedef DynArray(RegNode) RegNode_DynArray;
+
+static int jump_operand(uint8_t op) {
+    /* The index of a jump's offset among its operands, or -1. */
+    if (op == ROP_JMP) return 0;
+    if (op == ROP_JZ) return 1;
+    return -1;
+}
+
+static void decode_reg_code(CodeObject *code, size_t start, RegNode_DynArray *nodes) {
+    /* Offsets below are relative to 'start'. */
+    size_t length = code->code.count - start;
+    int *index_of = malloc(sizeof(int) * (length + 1));
+    for (size_t offset = 0; offset < length;) {
+        RegNode node = { .target = -1 };
+        uint8_t *ip = &code->code.data[start + offset];
+        node.instruction.wide = ip[0] == ROP_WIDE;
+        node.instruction.op = ip[node.instruction.wide ? 1 : 0];
+        read_operands(
+            reg_operand_format(node.instruction.op), node.instruction.wide,
+            &ip[node.instruction.wide ? 2 : 1], node.instruction.operands
+        );
+        index_of[offset] = nodes->count;
+        offset += instruction_length(&node.instruction);
+        dynarray_insert(nodes, node);
+    }
+    index_of[length] = nodes->count;
+
+    /* Jump offsets are relative to the end of the jump. */
+    size_t end = 0;
+    for (size_t i = 0; i < nodes->count; i++) {
+        Instruction *instruction = &nodes->data[i].instruction;
+        end += instruction_length(instruction);
+        int jump = jump_operand(instruction->op);
+        if (jump != -1) {
+            nodes->data[i].target = index_of[end + (int32_t)instruction->operands[jump]];
+        }
+    }
+    free(index_of);
+}
+
+static void encode_reg_code(CodeObject *code, size_t start, RegNode_DynArray *nodes) {
+    /* As in encode() in cfg.c, every jump starts out in the narrow
+     * form, and the ones that turn out not to fit are widened, which
+     * moves the code after them, until the layout stops changing. */
+    for (size_t i = 0; i < nodes->count; i++) {
+        if (jump_operand(nodes->data[i].instruction.op) != -1) {
+            nodes->data[i].instruction.wide = false;
+        }
+    }
+
+    int *offsets = malloc(sizeof(int) * (nodes->count + 1));
+    bool changed;
+    do {
+        offsets[0] = 0;
+        for (size_t i = 0; i < nodes->count; i++) {
+            offsets[i+1] = offsets[i] + instruction_length(&nodes->data[i].instruction);
+        }
+
+        changed = false;
+        for (size_t i = 0; i < nodes->count; i++) {
+            Instruction *instruction = &nodes->data[i].instruction;
+            int jump = jump_operand(instruction->op);
+            if (jump == -1) {
+                continue;
+            }
+            instruction->operands[jump] = offsets[nodes->data[i].target] - offsets[i+1];
+            if (!instruction->wide && !operands_fit(reg_operand_format(instruction->op), instruction->operands)) {
+                instruction->wide = true;
+                changed = true;
+            }
+        }
+    } while (changed);
+
+    code->code.count = start;
+    for (size_t i = 0; i < nodes->count; i++) {
+        write_instruction(code, &nodes->data[i].instruction);
+    }
+    free(offsets);
+}
+
+static void narrow_jumps(CodeObject *code, size_t start) {
+    /* Lays out the code from 'start' on again, with every jump that
+     * fits in the narrow form. Nothing before 'start' jumps into it. */
+    RegNode_DynArray nodes = {0};
+    decode_reg_code(code, start, &nodes);
+    encode_reg_code(code, start, &nodes);
+    dynarray_free(&nodes);
+}
+
+void remap_reg_code(CodeObject *code, OperandRemap remap, void *context) {
+    RegNode_DynArray nodes = {0};
+    decode_reg_code(code, 0, &nodes);
+    for (size_t i = 0; i < nodes.count; i++) {
+        Instruction *instruction = &nodes.data[i].instruction;
+        if (jump_operand(instruction->op) == -1) {
+            remap(instruction, context);
+            instruction->wide = !operands_fit(reg_operand_format(instruction->op), instruction->operands);
+        }
+    }
+    encode_reg_code(code, 0, &nodes);
+    dynarray_free(&nodes);
+}
@@ -0,0 +1,87 @@
+#ifndef venom_regcompiler_h
+#define venom_regcompiler_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "compiler.h"
+#include "parser.h"
+
+/* Three-address instructions for the register VM. Operands named
+ * 'dst', 'a', 'b' and 'src' are one-byte register numbers relative
+ * to the base of the current frame, so code that needs more than 256
+ * registers is a compile error. Parameters occupy the first
+ * registers of a frame, followed by locals and then temporaries.
+ *
+ *   ROP_LOADK dst, const      ROP_ADD dst, a, b   (and the other
+ *   ROP_LOADS dst, string     binary operators)
+ *   ROP_MOVE dst, src         ROP_JZ src, offset16
+ *   ROP_GETG dst, global      ROP_JMP offset16
+ *   ROP_SETG global, src      ROP_CALL dst, global, base, argcount, cache
+ *                             ROP_TAILCALL global, base, argcount, cache
+ *
+ * A call passes its arguments in consecutive registers starting at
+ * 'base', which become the first registers of the callee's frame, so
+ * no argument is ever copied.
+ *
+ * Constant, string, global, cache and function operands are one byte,
+ * and four when the instruction is prefixed with ROP_WIDE, which also
+ * widens jump offsets to four bytes. */
+typedef enum {
+    ROP_PRINT,
+    ROP_LOADK,
+    ROP_LOADS,
+    ROP_TRUE,
+    ROP_FALSE,
+    ROP_NULL,
+    ROP_MOVE,
+    ROP_GETG,
+    ROP_SETG,
+    ROP_ADD,
+    ROP_SUB,
+    ROP_MUL,
+    ROP_DIV,
+    ROP_MOD,
+    ROP_EQ,
+    ROP_NE,
+    ROP_GT,
+    ROP_GE,
+    ROP_LT,
+    ROP_LE,
+    ROP_NOT,
+    ROP_NEGATE,
+    ROP_JMP,
+    ROP_JZ,
+    ROP_FUNC,
+    ROP_CALL,
+    ROP_TAILCALL,
+    ROP_RET,
+    ROP_WIDE,
+    ROP_EXIT,
+} RegOpcode;
+
+typedef struct {
+    String *locals[256];
+    int locals_count;
+    int regs_count;  /* locals plus live temporaries */
+    bool had_error;
+    Ast *ast;
+    CodeObject *code;  /* where the code goes */
+} RegCompiler;
+
+void init_reg_compiler(RegCompiler *compiler, Ast *ast, CodeObject *code);
+void compile_registers(RegCompiler *compiler, BytecodeChunk *chunk, Statement stmt, bool scoped);
+/* Returns false, having reported the error, if the body needs more
+ * than 256 registers. */
+bool compile_reg_function(Ast *ast, BytecodeChunk *chunk, CodeObject *code, FunctionStatement *fn);
+void finish_reg_chunk(BytecodeChunk *chunk, size_t start);
+
+/* Applies 'remap' to every instruction of a finished code object and
+ * lays it out again, with every jump in the form the compiler would
+ * have emitted it in had the operands been the remapped ones. */
+void remap_reg_code(CodeObject *code, OperandRemap remap, void *context);
+const char *reg_operand_format(RegOpcode op);
+const char *reg_opcode_name(uint8_t op);
+void disassemble_registers(BytecodeChunk *chunk, size_t start);
+int disassemble_reg_instruction(BytecodeChunk *chunk, CodeObject *code, int offset);
+
+#endif
\ No newline at end of file
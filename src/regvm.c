@@ -0,0 +1,471 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "math.h"
+#include "profile.h"
+#include "regcompiler.h"
+#include "vm.h"
+#include "object.h"
+
+#ifdef venom_profile_ops
+bool run_registers_profiled(VM *vm, BytecodeChunk *chunk, size_t start) {
+#else
+bool run_registers(VM *vm, BytecodeChunk *chunk, size_t start) {
+#endif
+#define READ_UINT8() (*ip++)
+
+#define READ_INT16() \
+    (ip += 2, \
+    (int16_t)((ip[-2] << 8) | ip[-1]))
+
+#define READ_UINT32() \
+    (ip += 4, \
+    (uint32_t)ip[-4] << 24 | ip[-3] << 16 | ip[-2] << 8 | ip[-1])
+
+#define READ_INT32() ((int32_t)READ_UINT32())
+
+/* Registers are slots on the VM stack, relative to the current frame. */
+#define R(index) (base[(index)])
+
+#define BINARY_OP(op, wrapper) \
+do { \
+    dst = READ_UINT8(); \
+    uint8_t a = READ_UINT8(); \
+    uint8_t b = READ_UINT8(); \
+    R(dst) = wrapper(NUM_VAL(R(a)) op NUM_VAL(R(b))); \
+} while (0)
+
+#define AS_NOT_BOOL(thing) AS_BOOL(!(thing))
+
+/* As in vm.c, only numbers may take part in arithmetic. */
+#define CHECK_NUMBERS(a, b) \
+do { \
+    if (!IS_NUM(a) || !IS_NUM(b)) { \
+        runtime_error("Operands must be numbers"); \
+        goto error; \
+    } \
+} while (0)
+
+#define ARITHMETIC_OP(op) \
+do { \
+    dst = READ_UINT8(); \
+    uint8_t a = READ_UINT8(); \
+    uint8_t b = READ_UINT8(); \
+    CHECK_NUMBERS(R(a), R(b)); \
+    R(dst) = AS_NUM(NUM_VAL(R(a)) op NUM_VAL(R(b))); \
+} while (0)
+
+#ifdef venom_debug
+#define TRACE() \
+    (printf("current instruction: "), \
+    disassemble_reg_instruction(chunk, code, ip - code->code.data))
+#else
+#define TRACE() ((void)0)
+#endif
+
+#if defined(venom_profile_ops)
+#define COUNT() profile_instruction(vm->profile, code, ip, ROP_WIDE)
+#elif defined(venom_count_instructions)
+#define COUNT() (++instruction_count)
+#else
+#define COUNT() ((void)0)
+#endif
+
+#ifdef venom_computed_goto
+#define DISPATCH() do { TRACE(); COUNT(); goto *dispatch_table[*ip++]; } while (0)
+#define TARGET(op) op##_handler
+#else
+#define DISPATCH() do { TRACE(); COUNT(); goto dispatch; } while (0)
+#define TARGET(op) case op
+#endif
+
+#ifdef venom_computed_goto
+    static void *dispatch_table[] = {
+        [ROP_PRINT] = &&ROP_PRINT_handler,
+        [ROP_LOADK] = &&ROP_LOADK_handler,
+        [ROP_LOADS] = &&ROP_LOADS_handler,
+        [ROP_TRUE] = &&ROP_TRUE_handler,
+        [ROP_FALSE] = &&ROP_FALSE_handler,
+        [ROP_NULL] = &&ROP_NULL_handler,
+        [ROP_MOVE] = &&ROP_MOVE_handler,
+        [ROP_GETG] = &&ROP_GETG_handler,
+        [ROP_SETG] = &&ROP_SETG_handler,
+        [ROP_ADD] = &&ROP_ADD_handler,
+        [ROP_SUB] = &&ROP_SUB_handler,
+        [ROP_MUL] = &&ROP_MUL_handler,
+        [ROP_DIV] = &&ROP_DIV_handler,
+        [ROP_MOD] = &&ROP_MOD_handler,
+        [ROP_EQ] = &&ROP_EQ_handler,
+        [ROP_NE] = &&ROP_NE_handler,
+        [ROP_GT] = &&ROP_GT_handler,
+        [ROP_GE] = &&ROP_GE_handler,
+        [ROP_LT] = &&ROP_LT_handler,
+        [ROP_LE] = &&ROP_LE_handler,
+        [ROP_NOT] = &&ROP_NOT_handler,
+        [ROP_NEGATE] = &&ROP_NEGATE_handler,
+        [ROP_JMP] = &&ROP_JMP_handler,
+        [ROP_JZ] = &&ROP_JZ_handler,
+        [ROP_FUNC] = &&ROP_FUNC_handler,
+        [ROP_CALL] = &&ROP_CALL_handler,
+        [ROP_TAILCALL] = &&ROP_TAILCALL_handler,
+        [ROP_RET] = &&ROP_RET_handler,
+        [ROP_WIDE] = &&ROP_WIDE_handler,
+        [ROP_EXIT] = &&ROP_EXIT_handler,
+    };
+#endif
+
+#ifdef venom_count_instructions
+    unsigned long long instruction_count = 0;
+#endif
+
+#ifdef venom_debug
+    disassemble_registers(chunk, start);
+#endif
+
+    /* The code object being run, whose constants ROP_LOADK reads. */
+    CodeObject *code = &chunk->main;
+    Object *base = vm->stack;
+    uint8_t *ip = code->code.data + start;
+
+    /* Operands that have a four-byte form after ROP_WIDE, which
+     * jumps into the narrow handler past the point where it reads
+     * them. Registers and counts are always one byte. */
+    uint32_t slot, index, cache_index;
+    int32_t offset;
+    uint8_t dst, src, count, argbase;
+
+    /* Whether the code ran to OP_EXIT rather than stopping at a
+     * runtime error. */
+    bool ok = true;
+
+#ifdef venom_profile_ops
+    start_profile(vm->profile);
+#endif
+
+    reserve_globals(vm, chunk->global_names.count);
+    vm->chunk = chunk;
+
+    /* Calls make room for the registers of the code they enter, and
+     * this makes room for the top level's. */
+    if (code->max_stack > vm->stack_size && !reserve_frame(vm, code->max_stack)) {
+        runtime_error("Stack overflow");
+        goto error;
+    }
+
+#ifdef venom_computed_goto
+    TRACE();
+    COUNT();
+    goto *dispatch_table[*ip++];
+#else
+    TRACE();
+    COUNT();
+dispatch:
+    switch (*ip++) {
+#endif
+        TARGET(ROP_PRINT): {
+            src = READ_UINT8();
+            print_line(vm, R(src));
+            DISPATCH();
+        }
+        TARGET(ROP_LOADK): {
+            dst = READ_UINT8();
+            index = READ_UINT8();
+        load_constant:
+            R(dst) = AS_NUM(code->cp.data[index]);
+            DISPATCH();
+        }
+        TARGET(ROP_LOADS): {
+            dst = READ_UINT8();
+            index = READ_UINT8();
+        load_string:
+            R(dst) = AS_STR(chunk->sp.data[index]);
+            DISPATCH();
+        }
+        TARGET(ROP_TRUE): {
+            dst = READ_UINT8();
+            R(dst) = TRUE_VAL;
+            DISPATCH();
+        }
+        TARGET(ROP_FALSE): {
+            dst = READ_UINT8();
+            R(dst) = FALSE_VAL;
+            DISPATCH();
+        }
+        TARGET(ROP_NULL): {
+            dst = READ_UINT8();
+            R(dst) = NULL_VAL;
+            DISPATCH();
+        }
+        TARGET(ROP_MOVE): {
+            dst = READ_UINT8();
+            src = READ_UINT8();
+            R(dst) = R(src);
+            DISPATCH();
+        }
+        TARGET(ROP_GETG): {
+            dst = READ_UINT8();
+            slot = READ_UINT8();
+        get_global:;
+            Object obj = vm->globals[slot];
+            if (obj == UNDEFINED_VAL) {
+                char msg[512];
+                snprintf(
+                    msg, sizeof(msg),
+                    "Variable '%s' is not defined",
+                    chunk->global_names.data[slot]->chars
+                );
+                runtime_error(msg);
+                goto error;
+            }
+            R(dst) = obj;
+            DISPATCH();
+        }
+        TARGET(ROP_SETG): {
+            slot = READ_UINT8();
+            src = READ_UINT8();
+        set_global:
+            vm->globals[slot] = R(src);
+            DISPATCH();
+        }
+        TARGET(ROP_ADD): ARITHMETIC_OP(+); DISPATCH();
+        TARGET(ROP_SUB): ARITHMETIC_OP(-); DISPATCH();
+        TARGET(ROP_MUL): ARITHMETIC_OP(*); DISPATCH();
+        TARGET(ROP_DIV): ARITHMETIC_OP(/); DISPATCH();
+        TARGET(ROP_MOD): {
+            dst = READ_UINT8();
+            uint8_t a = READ_UINT8();
+            uint8_t b = READ_UINT8();
+            CHECK_NUMBERS(R(a), R(b));
+            R(dst) = AS_NUM(fmod(NUM_VAL(R(a)), NUM_VAL(R(b))));
+            DISPATCH();
+        }
+        TARGET(ROP_EQ): {
+            dst = READ_UINT8();
+            uint8_t a = READ_UINT8();
+            uint8_t b = READ_UINT8();
+            R(dst) = AS_BOOL(objects_equal(R(a), R(b)));
+            DISPATCH();
+        }
+        TARGET(ROP_NE): {
+            dst = READ_UINT8();
+            uint8_t a = READ_UINT8();
+            uint8_t b = READ_UINT8();
+            R(dst) = AS_BOOL(!objects_equal(R(a), R(b)));
+            DISPATCH();
+        }
+        TARGET(ROP_GT): BINARY_OP(>, AS_BOOL); DISPATCH();
+        /* '>=' and '<=' are the negation of '<' and '>', as in the
+         * stack VM and the folder, so that NaN compares the same. */
+        TARGET(ROP_GE): BINARY_OP(<, AS_NOT_BOOL); DISPATCH();
+        TARGET(ROP_LT): BINARY_OP(<, AS_BOOL); DISPATCH();
+        TARGET(ROP_LE): BINARY_OP(>, AS_NOT_BOOL); DISPATCH();
+        TARGET(ROP_NOT): {
+            dst = READ_UINT8();
+            src = READ_UINT8();
+            R(dst) = AS_BOOL(!BOOL_VAL(R(src)));
+            DISPATCH();
+        }
+        TARGET(ROP_NEGATE): {
+            dst = READ_UINT8();
+            src = READ_UINT8();
+            if (!IS_NUM(R(src))) {
+                runtime_error("Operand must be a number");
+                goto error;
+            }
+            R(dst) = AS_NUM(-NUM_VAL(R(src)));
+            DISPATCH();
+        }
+        TARGET(ROP_JMP): {
+            offset = READ_INT16();
+        jump:
+            ip += offset;
+            DISPATCH();
+        }
+        TARGET(ROP_JZ): {
+            src = READ_UINT8();
+            offset = READ_INT16();
+        jump_if_zero:
+            if (!BOOL_VAL(R(src))) {
+                ip += offset;
+            }
+            DISPATCH();
+        }
+        TARGET(ROP_FUNC): {
+            slot = READ_UINT8();
+            index = READ_UINT8();
+        make_function:;
+
+            /* The registers of every frame up to the current one are
+             * roots if the allocation collects. */
+            vm->tos = &R(0) - vm->stack + code->max_stack;
+            Function *func = new_function(vm, chunk->global_names.data[slot], chunk->functions.data[index]);
+            vm->globals[slot] = AS_FUNC(func);
+            DISPATCH();
+        }
+        TARGET(ROP_CALL): {
+            dst = READ_UINT8();
+            slot = READ_UINT8();
+            argbase = READ_UINT8();
+            count = READ_UINT8();
+            cache_index = READ_UINT8();
+        call:;
+            if (vm->globals[slot] != chunk->caches.data[cache_index].callee
+                    && !resolve_callee(vm, chunk, slot, count, cache_index)) {
+                goto error;
+            }
+            InlineCache *cache = &chunk->caches.data[cache_index];
+
+            /* The callee's registers have to be committed above the
+             * new base. */
+            size_t top = &R(argbase) - vm->stack + cache->function->code->max_stack;
+            if (top > vm->stack_size || vm->frame_count == vm->frame_capacity) {
+                if (!reserve_frame(vm, top)) {
+                    runtime_error("Stack overflow");
+                    goto error;
+                }
+            }
+
+            /* The arguments are already in place: the callee's frame
+             * simply starts at the caller's 'argbase' register. */
+            CallFrame *frame = &vm->frames[vm->frame_count++];
+            frame->ip = ip;
+            frame->slots = &R(argbase);
+            frame->function = cache->function;
+            frame->dst = dst;
+            base = frame->slots;
+            code = cache->function->code;
+            ip = code->code.data;
+            DISPATCH();
+        }
+        TARGET(ROP_TAILCALL): {
+            slot = READ_UINT8();
+            argbase = READ_UINT8();
+            count = READ_UINT8();
+            cache_index = READ_UINT8();
+        tail_call:;
+            if (vm->globals[slot] != chunk->caches.data[cache_index].callee
+                    && !resolve_callee(vm, chunk, slot, count, cache_index)) {
+                goto error;
+            }
+            InlineCache *cache = &chunk->caches.data[cache_index];
+
+            /* The callee may need more registers than the function it
+             * replaces. */
+            size_t top = &R(0) - vm->stack + cache->function->code->max_stack;
+            if (top > vm->stack_size && !reserve_frame(vm, top)) {
+                runtime_error("Stack overflow");
+                goto error;
+            }
+
+            /* The new arguments become the first registers of the
+             * current frame, which keeps its return address. */
+            memmove(&R(0), &R(argbase), sizeof(Object) * count);
+            if (vm->frame_count > 0) {
+                vm->frames[vm->frame_count-1].function = cache->function;
+            }
+            code = cache->function->code;
+            ip = code->code.data;
+            DISPATCH();
+        }
+        TARGET(ROP_RET): {
+            src = READ_UINT8();
+            Object returnvalue = R(src);
+            CallFrame *frame = &vm->frames[--vm->frame_count];
+            if (vm->frame_count > 0) {
+                base = vm->frames[vm->frame_count-1].slots;
+                code = vm->frames[vm->frame_count-1].function->code;
+            } else {
+                base = vm->stack;
+                code = &chunk->main;
+            }
+            R(frame->dst) = returnvalue;
+            ip = frame->ip;
+            DISPATCH();
+        }
+        TARGET(ROP_WIDE): {
+            /* The next instruction has four-byte global, constant,
+             * string, cache and function operands, and a four-byte
+             * jump offset. */
+            switch (READ_UINT8()) {
+                case ROP_LOADK: {
+                    dst = READ_UINT8();
+                    index = READ_UINT32();
+                    goto load_constant;
+                }
+                case ROP_LOADS: {
+                    dst = READ_UINT8();
+                    index = READ_UINT32();
+                    goto load_string;
+                }
+                case ROP_GETG: {
+                    dst = READ_UINT8();
+                    slot = READ_UINT32();
+                    goto get_global;
+                }
+                case ROP_SETG: {
+                    slot = READ_UINT32();
+                    src = READ_UINT8();
+                    goto set_global;
+                }
+                case ROP_JMP: offset = READ_INT32(); goto jump;
+                case ROP_JZ: {
+                    src = READ_UINT8();
+                    offset = READ_INT32();
+                    goto jump_if_zero;
+                }
+                case ROP_FUNC: {
+                    slot = READ_UINT32();
+                    index = READ_UINT32();
+                    goto make_function;
+                }
+                case ROP_CALL: {
+                    dst = READ_UINT8();
+                    slot = READ_UINT32();
+                    argbase = READ_UINT8();
+                    count = READ_UINT8();
+                    cache_index = READ_UINT32();
+                    goto call;
+                }
+                case ROP_TAILCALL: {
+                    slot = READ_UINT32();
+                    argbase = READ_UINT8();
+                    count = READ_UINT8();
+                    cache_index = READ_UINT32();
+                    goto tail_call;
+                }
+                default: assert(0);
+            }
+        }
+        TARGET(ROP_EXIT): goto exit;
+#ifndef venom_computed_goto
+        default: assert(0);
+    }
+#endif
+
+error:
+    ok = false;
+exit:
+#ifdef venom_profile_ops
+    stop_profile(vm->profile);
+#endif
+    flush_output(vm);
+#ifdef venom_count_instructions
+    fprintf(stderr, "instructions executed: %llu\n", instruction_count);
+#endif
+    return ok;
+
+#undef READ_UINT8
+#undef READ_INT16
+#undef READ_UINT32
+#undef READ_INT32
+#undef R
+#undef BINARY_OP
+#undef AS_NOT_BOOL
+#undef CHECK_NUMBERS
+#undef ARITHMETIC_OP
+#undef TRACE
+#undef COUNT
+#undef DISPATCH
+#undef TARGET
+}
\ No newline at end of file
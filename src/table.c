@@ -3,85 +3,109 @@
 #include <stdint.h>
 #include <string.h>
 #include "table.h"
-#include "util.h"
 
-static void list_insert(Bucket **head, char *key, Object item) {
-    /* Create a new node. */
-    Bucket *new_node = malloc(sizeof(Bucket));
-    new_node->key = key;
-    new_node->obj = item;
-    new_node->next = NULL;
+uint32_t hash_string(const char *chars, size_t length) {
+    /* copy-paste from 'crafting interpreters' */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)chars[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
 
-    /* Handle the edge case when the list is empty. */
-    if (*head == NULL) {
-        *head = new_node;
-    } else {
-        /* Go to the end of the list. */
-        Bucket *current = *head;
-        while (current->next != NULL) {
-            current = current->next;
+static Entry *find_entry(const Table *table, String *key) {
+    /* Returns the entry that holds 'key', or the empty entry where
+     * it would be inserted. The capacity is a power of two, so the
+     * index wraps around with a mask instead of a division. The load
+     * factor guarantees that there is always an empty entry. */
+    size_t mask = table->capacity - 1;
+    for (size_t index = key->hash & mask;; index = (index + 1) & mask) {
+        Entry *entry = &table->entries[index];
+        if (entry->key == key || entry->key == NULL) {
+            return entry;
         }
-    
-        /* Store the new node at the end. */
-        current->next = new_node; 
     }
 }
 
-static void list_free(Bucket *head) {
-    Bucket *tmp;
-    while (head != NULL) {
-        tmp = head;
-        head = head->next;
-        free(tmp->key);
-        free(tmp);
+static void grow(Table *table) {
+    size_t capacity = table->capacity == 0 ? 8 : table->capacity * 2;
+    Entry *entries = calloc(capacity, sizeof(Entry));
+
+    /* The keys are distinct, so each entry just moves to the first
+     * free slot of its new probe sequence. */
+    for (size_t i = 0; i < table->capacity; i++) {
+        Entry *entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        size_t index = entry->key->hash & (capacity - 1);
+        while (entries[index].key != NULL) {
+            index = (index + 1) & (capacity - 1);
+        }
+        entries[index] = *entry;
     }
+
+    free(table->entries);
+    table->entries = entries;
+    table->capacity = capacity;
 }
 
-static Object *list_find(Bucket *head, const char *item) {
-    while (head != NULL) {
-        if (strcmp(head->key, item) == 0) return &head->obj;
-        head = head->next;
+void table_insert(Table *table, String *key, Object obj) {
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        grow(table);
     }
-    return NULL;
+    Entry *entry = find_entry(table, key);
+    if (entry->key == NULL) {
+        entry->key = key;
+        table->count++;
+    }
+    /* If the key is already in the table, change its value. */
+    entry->obj = obj;
 }
 
-static uint32_t hash(const char *key, int length) {
-    /* copy-paste from 'crafting interpreters' */
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++) {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
+Object *table_get(const Table *table, String *key) {
+    if (table->count == 0) {
+        return NULL;
     }
-    return hash;
+    Entry *entry = find_entry(table, key);
+    return entry->key == NULL ? NULL : &entry->obj;
 }
 
-void table_insert(Table *table, const char *key, Object obj) {
-    char *k = own_string(key);
-    int index = hash(k, strlen(k)) % 1024;
-    if (list_find(table->data[index], k) == NULL) {
-        list_insert(&table->data[index], k, obj);
-    } else {
-        /* If the key is already in the list, change its value. */
-        Bucket *head = table->data[index];
-        while (head != NULL) {
-            if (strcmp(head->key, k) == 0) {
-                table->data[index]->obj = obj;
-            }
-            head = head->next;
-        }
-        free(k);
-    }
+void table_free(const Table *table) {
+    free(table->entries);
 }
 
-Object *table_get(const Table *table, const char *key) {
-    int index = hash(key, strlen(key)) % 1024;
-    return list_find(table->data[index], key);
+String *table_find_string(const Table *table, const char *chars, size_t length, uint32_t hash) {
+    /* The probe checks the stored hash and length before calling
+     * memcmp, so it rarely compares characters that don't match. */
+    if (table->count == 0) {
+        return NULL;
+    }
+    size_t mask = table->capacity - 1;
+    for (size_t index = hash & mask;; index = (index + 1) & mask) {
+        String *key = table->entries[index].key;
+        if (key == NULL) {
+            return NULL;
+        }
+        if (key->hash == hash
+                && key->length == length
+                && memcmp(key->chars, chars, length) == 0) {
+            return key;
+        }
+    }
 }
 
-void table_free(const Table *table) {
-    for (size_t i = 0; i < sizeof(table->data) / sizeof(table->data[0]); i++) {
-        if (table->data[i] != NULL) {
-            list_free(table->data[i]);
+void table_remove_unmarked(Table *table) {
+    /* Removing an entry from the middle of a probe sequence would cut
+     * it short, so the surviving entries are inserted again into an
+     * emptied array of the same capacity. */
+    Entry *entries = table->entries;
+    size_t capacity = table->capacity;
+    table->entries = calloc(capacity, sizeof(Entry));
+    table->count = 0;
+    for (size_t i = 0; i < capacity; i++) {
+        if (entries[i].key != NULL && entries[i].key->obj.marked) {
+            table_insert(table, entries[i].key, entries[i].obj);
         }
     }
+    free(entries);
 }
@@ -1,20 +1,42 @@
 #ifndef venom_table_h
 #define venom_table_h
 
+#include <stddef.h>
+#include <stdint.h>
 #include "object.h"
 
-typedef struct Bucket {
-    char *key;
+/* A hash table keyed by interned strings, with open addressing and
+ * linear probing. The entries live inline in a single array whose
+ * capacity is a power of two, which doubles when the table is more
+ * than three quarters full. Keys are compared by address, and their
+ * hashes are stored in the strings themselves, so neither a lookup
+ * nor a resize ever hashes or compares the characters of a key. The
+ * table does not own its keys. */
+typedef struct Entry {
+    String *key;  /* NULL if the entry is empty */
     Object obj;
-    struct Bucket *next;
-} Bucket;
+} Entry;
 
 typedef struct Table {
-    Bucket *data[1024];
+    Entry *entries;
+    size_t count;
+    size_t capacity;
 } Table;
 
 void table_free(const Table *table);
-void table_insert(Table *table, const char *key, Object obj);
-Object *table_get(const Table *table, const char *key);
+void table_insert(Table *table, String *key, Object obj);
+
+/* The returned pointer is valid until the next insert. */
+Object *table_get(const Table *table, String *key);
+
+uint32_t hash_string(const char *chars, size_t length);
+
+/* Looks a key up by its contents rather than by address, which is
+ * how an intern table finds out whether a string already exists. */
+String *table_find_string(const Table *table, const char *chars, size_t length, uint32_t hash);
+
+/* Drops the entries whose keys the garbage collector has not marked,
+ * which makes the table hold its keys weakly. */
+void table_remove_unmarked(Table *table);
 
 #endif
\ No newline at end of file
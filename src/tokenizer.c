@@ -1,10 +1,47 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "tokenizer.h"
+#include "util.h"
 
-#define venom_debug
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Character classes, looked up by the value of a byte. */
+enum {
+    CLASS_SPACE = 1 << 0,
+    CLASS_DIGIT = 1 << 1,
+    CLASS_ALPHA = 1 << 2,  /* letters and '_' */
+};
+
+#define SPACE CLASS_SPACE
+#define DIGIT CLASS_DIGIT
+#define ALPHA CLASS_ALPHA
+
+static const uint8_t char_class[256] = {
+    ['\t'] = SPACE, ['\n'] = SPACE, ['\r'] = SPACE, [' '] = SPACE,
+    ['0'] = DIGIT, ['1'] = DIGIT, ['2'] = DIGIT, ['3'] = DIGIT, ['4'] = DIGIT,
+    ['5'] = DIGIT, ['6'] = DIGIT, ['7'] = DIGIT, ['8'] = DIGIT, ['9'] = DIGIT,
+    ['A'] = ALPHA, ['B'] = ALPHA, ['C'] = ALPHA, ['D'] = ALPHA, ['E'] = ALPHA,
+    ['F'] = ALPHA, ['G'] = ALPHA, ['H'] = ALPHA, ['I'] = ALPHA, ['J'] = ALPHA,
+    ['K'] = ALPHA, ['L'] = ALPHA, ['M'] = ALPHA, ['N'] = ALPHA, ['O'] = ALPHA,
+    ['P'] = ALPHA, ['Q'] = ALPHA, ['R'] = ALPHA, ['S'] = ALPHA, ['T'] = ALPHA,
+    ['U'] = ALPHA, ['V'] = ALPHA, ['W'] = ALPHA, ['X'] = ALPHA, ['Y'] = ALPHA,
+    ['Z'] = ALPHA, ['_'] = ALPHA,
+    ['a'] = ALPHA, ['b'] = ALPHA, ['c'] = ALPHA, ['d'] = ALPHA, ['e'] = ALPHA,
+    ['f'] = ALPHA, ['g'] = ALPHA, ['h'] = ALPHA, ['i'] = ALPHA, ['j'] = ALPHA,
+    ['k'] = ALPHA, ['l'] = ALPHA, ['m'] = ALPHA, ['n'] = ALPHA, ['o'] = ALPHA,
+    ['p'] = ALPHA, ['q'] = ALPHA, ['r'] = ALPHA, ['s'] = ALPHA, ['t'] = ALPHA,
+    ['u'] = ALPHA, ['v'] = ALPHA, ['w'] = ALPHA, ['x'] = ALPHA, ['y'] = ALPHA,
+    ['z'] = ALPHA,
+};
+
+#undef SPACE
+#undef DIGIT
+#undef ALPHA
 
 void init_tokenizer(Tokenizer *tokenizer, char *source) {
     tokenizer->current = source;
@@ -24,43 +61,105 @@ static void tokenizing_error(int line) {
     exit(1);
 }
 
-static void skip_whitespace(Tokenizer *tokenizer) {
-    for (;;) {
-        switch (peek(tokenizer, 0)) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance(tokenizer);
-                break;
-            case '\n':
-                tokenizer->line++;
-                advance(tokenizer);
-                break;
-            default: return;
-        }
-    }
+static bool is_digit(char c) {
+    return char_class[(uint8_t)c] & CLASS_DIGIT;
 }
 
-static bool is_digit(char c) {
-    return c >= '0' && c <= '9';
+static bool is_at_end(Tokenizer *tokenizer) {
+    return peek(tokenizer, 0) == '\0';
 }
 
-static bool is_alpha(char c) {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+/* The scanners below look at 16 bytes at a time with SSE2 where it
+ * is available. Each of them stops at the terminating NUL, but may
+ * read up to 15 bytes past it, which is what TOKENIZER_PADDING is
+ * for. */
+
+#ifdef __SSE2__
+static unsigned byte_mask(__m128i chunk, char c) {
+    /* Bit i is set if byte i of the chunk is 'c'. */
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(c)));
 }
 
-static bool is_at_end(Tokenizer *tokenizer) {
-    return peek(tokenizer, 0) == '\0';
+static unsigned range_mask(__m128i chunk, char low, int count) {
+    /* Bit i is set if byte i of the chunk is in [low, low + count).
+     * SSE2 only compares signed bytes, so the difference is biased
+     * by 128 to compare it as an unsigned one. */
+    __m128i bias = _mm_set1_epi8((char)0x80);
+    __m128i offset = _mm_xor_si128(_mm_sub_epi8(chunk, _mm_set1_epi8(low)), bias);
+    __m128i limit = _mm_xor_si128(_mm_set1_epi8((char)count), bias);
+    return _mm_movemask_epi8(_mm_cmplt_epi8(offset, limit));
 }
+#endif
 
-static bool lookahead(Tokenizer *tokenizer, int length, char *rest) {
-    if (strncmp(tokenizer->current, rest, length) == 0) {
-        for (int i = 0; i < length; i++) {
-            advance(tokenizer);
+static void skip_whitespace(Tokenizer *tokenizer) {
+    /* Most gaps between tokens are a space, or a newline and a little
+     * indentation, which are quicker to skip one byte at a time. Only
+     * longer runs are worth skipping 16 bytes at a time. */
+    for (int i = 0; i < 8; i++) {
+        char c = peek(tokenizer, 0);
+        if (!(char_class[(uint8_t)c] & CLASS_SPACE)) return;
+        if (c == '\n') tokenizer->line++;
+        advance(tokenizer);
+    }
+#ifdef __SSE2__
+    for (;;) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)tokenizer->current);
+        unsigned newlines = byte_mask(chunk, '\n');
+        unsigned space = newlines | byte_mask(chunk, ' ') | byte_mask(chunk, '\t') | byte_mask(chunk, '\r');
+        unsigned stop = ~space & 0xFFFF;
+        int length = stop != 0 ? __builtin_ctz(stop) : 16;
+        tokenizer->line += __builtin_popcount(newlines & ((1u << length) - 1));
+        tokenizer->current += length;
+        if (stop != 0) return;
+    }
+#else
+    while (char_class[(uint8_t)peek(tokenizer, 0)] & CLASS_SPACE) {
+        if (advance(tokenizer) == '\n') {
+            tokenizer->line++;
         }
-        return true;
     }
-    return false;
+#endif
+}
+
+static void skip_identifier_chars(Tokenizer *tokenizer) {
+#ifdef __SSE2__
+    for (;;) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)tokenizer->current);
+        /* Setting bit 5 turns upper case letters into lower case ones
+         * and moves no other byte into [a-z]. */
+        __m128i lower = _mm_or_si128(chunk, _mm_set1_epi8(0x20));
+        unsigned word = range_mask(lower, 'a', 26) | range_mask(chunk, '0', 10) | byte_mask(chunk, '_');
+        unsigned stop = ~word & 0xFFFF;
+        if (stop != 0) {
+            tokenizer->current += __builtin_ctz(stop);
+            return;
+        }
+        tokenizer->current += 16;
+    }
+#else
+    while (char_class[(uint8_t)peek(tokenizer, 0)] & (CLASS_ALPHA | CLASS_DIGIT)) {
+        advance(tokenizer);
+    }
+#endif
+}
+
+static void skip_string_chars(Tokenizer *tokenizer) {
+    /* Stops at the closing quote or at the end of the source. */
+#ifdef __SSE2__
+    for (;;) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)tokenizer->current);
+        unsigned stop = byte_mask(chunk, '"') | byte_mask(chunk, '\0');
+        if (stop != 0) {
+            tokenizer->current += __builtin_ctz(stop);
+            return;
+        }
+        tokenizer->current += 16;
+    }
+#else
+    while (peek(tokenizer, 0) != '"' && !is_at_end(tokenizer)) {
+        advance(tokenizer);
+    }
+#endif
 }
 
 static Token make_token(Tokenizer *tokenizer, TokenType type, int length) {
@@ -71,45 +170,112 @@ static Token make_token(Tokenizer *tokenizer, TokenType type, int length) {
     };
 }
 
-static Token number(Tokenizer *tokenizer) {
-    int length = 0;
+static bool lookahead(Tokenizer *tokenizer, char c) {
+    if (peek(tokenizer, 0) == c) {
+        advance(tokenizer);
+        return true;
+    }
+    return false;
+}
+
+static double parse_number(const char *start, int length) {
+    /* With at most 2^53 for the digits and at most 22 of them after
+     * the point, both the digits and the power of ten are exact
+     * doubles, and their quotient is correctly rounded. That covers
+     * every number short of 16 digits. */
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    uint64_t digits = 0;
+    int fraction = -1;  /* digits after the point, if there is one */
+    bool exact = true;
+    for (int i = 0; i < length; i++) {
+        if (start[i] == '.') {
+            fraction = 0;
+            continue;
+        }
+        if (digits > (UINT64_MAX - 9) / 10) {
+            exact = false;
+            break;
+        }
+        digits = digits * 10 + (start[i] - '0');
+        if (fraction != -1) fraction++;
+    }
+    if (fraction == -1) fraction = 0;
+    if (exact && digits <= (1ull << 53) && fraction <= 22) {
+        return (double)digits / powers_of_ten[fraction];
+    }
+
+    /* Otherwise, strtod gets a copy, since it would read on past the
+     * end of the token (into an exponent, say). */
+    char *copy = own_string_n(start, length);
+    double value = strtod(copy, NULL);
+    free(copy);
+    return value;
+}
+
+static Token number(Tokenizer *tokenizer, char *start) {
     while (is_digit(peek(tokenizer, 0))) {
         advance(tokenizer);
-        ++length;
     }
     if (peek(tokenizer, 0) == '.' && is_digit(peek(tokenizer, 1))) {
         advance(tokenizer);
-        ++length;
- 
         while (is_digit(peek(tokenizer, 0))) {
             advance(tokenizer);
-            ++length;
         }
     }
-    return make_token(tokenizer, TOKEN_NUMBER, length + 1);
+    Token token = make_token(tokenizer, TOKEN_NUMBER, tokenizer->current - start);
+    token.value = parse_number(token.start, token.length);
+    return token;
 }
 
 static Token string(Tokenizer *tokenizer) {
-    int length = 0;
-    while (peek(tokenizer, 0) != '"' && !is_at_end(tokenizer)) {
-        advance(tokenizer);
-        ++length;
-    }
+    /* The opening quote has been consumed. The token includes the
+     * closing one but not the opening one. */
+    char *start = tokenizer->current;
+    skip_string_chars(tokenizer);
     if (is_at_end(tokenizer)) {
         tokenizing_error(tokenizer->line);
     }
     advance(tokenizer);
-    ++length;
-    return make_token(tokenizer, TOKEN_STRING, length);
+    return make_token(tokenizer, TOKEN_STRING, tokenizer->current - start);
 }
 
-static Token identifier(Tokenizer *tokenizer) {
-    int length = 0;
-    while (is_digit(peek(tokenizer, 0)) || is_alpha(peek(tokenizer, 0))) {
-        advance(tokenizer);
-        ++length;
+static TokenType check_keyword(const char *start, int length, const char *keyword, TokenType type) {
+    int keyword_length = strlen(keyword);
+    if (length == keyword_length && memcmp(start, keyword, length) == 0) {
+        return type;
     }
-    return make_token(tokenizer, TOKEN_IDENTIFIER, length + 1);
+    return TOKEN_IDENTIFIER;
+}
+
+static TokenType identifier_type(const char *start, int length) {
+    /* The first character selects the only keyword (or two) the
+     * identifier could be, which is then compared in full, so that
+     * a name like 'letter' is not mistaken for 'let'. */
+    switch (start[0]) {
+        case 'c': return check_keyword(start, length, "const", TOKEN_CONST);
+        case 'e': return check_keyword(start, length, "else", TOKEN_ELSE);
+        case 'f': {
+            if (length == 2) return check_keyword(start, length, "fn", TOKEN_FN);
+            return check_keyword(start, length, "false", TOKEN_FALSE);
+        }
+        case 'i': return check_keyword(start, length, "if", TOKEN_IF);
+        case 'l': return check_keyword(start, length, "let", TOKEN_LET);
+        case 'n': return check_keyword(start, length, "null", TOKEN_NULL);
+        case 'p': return check_keyword(start, length, "print", TOKEN_PRINT);
+        case 'r': return check_keyword(start, length, "return", TOKEN_RETURN);
+        case 't': return check_keyword(start, length, "true", TOKEN_TRUE);
+        case 'w': return check_keyword(start, length, "while", TOKEN_WHILE);
+        default: return TOKEN_IDENTIFIER;
+    }
+}
+
+static Token identifier(Tokenizer *tokenizer, char *start) {
+    skip_identifier_chars(tokenizer);
+    int length = tokenizer->current - start;
+    return make_token(tokenizer, identifier_type(start, length), length);
 }
 
 #ifdef venom_debug
@@ -119,6 +285,7 @@ void print_token(Token token) {
     switch (token.type) {
         case TOKEN_PRINT: printf("TOKEN_PRINT"); break;
         case TOKEN_LET: printf("TOKEN_LET"); break;
+        case TOKEN_CONST: printf("TOKEN_CONST"); break;
         case TOKEN_IDENTIFIER: printf("TOKEN_IDENTIFIER"); break;
         case TOKEN_NUMBER: printf("TOKEN_NUMBER"); break;
         case TOKEN_LEFT_PAREN: printf("TOKEN_LEFT_PAREN"); break;
@@ -152,10 +319,13 @@ Token get_token(Tokenizer *tokenizer) {
 
     if (is_at_end(tokenizer)) return make_token(tokenizer, TOKEN_EOF, 0);
 
+    char *start = tokenizer->current;
     char c = advance(tokenizer);
 
-    if (is_digit(c)) return number(tokenizer);
     switch (c) {
+        case '0': case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9':
+            return number(tokenizer, start);
         case '+': return make_token(tokenizer, TOKEN_PLUS, 1);
         case '-': return make_token(tokenizer, TOKEN_MINUS, 1);
         case '*': return make_token(tokenizer, TOKEN_STAR, 1);
@@ -169,98 +339,42 @@ Token get_token(Tokenizer *tokenizer) {
         case '%': return make_token(tokenizer, TOKEN_MOD, 1);
         case '"': return string(tokenizer);
         case '>': {
-            if (lookahead(tokenizer, 1, "=")) {
+            if (lookahead(tokenizer, '=')) {
                 return make_token(tokenizer, TOKEN_GREATER_EQUAL, 2);
             }
             return make_token(tokenizer, TOKEN_GREATER, 1);
         }
         case '<': {
-            if (lookahead(tokenizer, 1, "=")) {
+            if (lookahead(tokenizer, '=')) {
                 return make_token(tokenizer, TOKEN_LESS_EQUAL, 2);
             }
             return make_token(tokenizer, TOKEN_LESS, 1);
         }
         case '!': {
-            if (lookahead(tokenizer, 1, "=")) {
+            if (lookahead(tokenizer, '=')) {
                 return make_token(tokenizer, TOKEN_BANG_EQUAL, 2);
             }
             return make_token(tokenizer, TOKEN_BANG, 1);
         }
         case '=': {
-            if (lookahead(tokenizer, 1, "=")) {
+            if (lookahead(tokenizer, '=')) {
                 return make_token(tokenizer, TOKEN_DOUBLE_EQUAL, 2);
             }
             return make_token(tokenizer, TOKEN_EQUAL, 1);
         }
         case '&': {
-            if (lookahead(tokenizer, 1, "&")) {
+            if (lookahead(tokenizer, '&')) {
                 return make_token(tokenizer, TOKEN_DOUBLE_AMPERSAND, 2);
             }
             return make_token(tokenizer, TOKEN_AMPERSAND, 1);
         }
         case '|': {
-            if (lookahead(tokenizer, 1, "|")) {
+            if (lookahead(tokenizer, '|')) {
                 return make_token(tokenizer, TOKEN_DOUBLE_PIPE, 2);
             }
             return make_token(tokenizer, TOKEN_PIPE, 1);
         }
-        case 'e': {
-            if (lookahead(tokenizer, 3, "lse")) {
-                return make_token(tokenizer, TOKEN_ELSE, 4);
-            }
-            return identifier(tokenizer);
-        }
-        case 'f': {
-            if (lookahead(tokenizer, 1, "n")) {
-                return make_token(tokenizer, TOKEN_FN, 2);
-            }
-            if (lookahead(tokenizer, 4, "alse")) {
-                return make_token(tokenizer, TOKEN_FALSE, 5);
-            }
-            return identifier(tokenizer);
-        }
-        case 'i': {
-            if (lookahead(tokenizer, 1, "f")) {
-                return make_token(tokenizer, TOKEN_IF, 2);
-            }
-            return identifier(tokenizer);
-        }
-        case 'l': {
-            if (lookahead(tokenizer, 2, "et")) {
-                return make_token(tokenizer, TOKEN_LET, 3);
-            }
-            return identifier(tokenizer);
-        }
-        case 'n': {
-            if (lookahead(tokenizer, 3, "ull")) {
-                return make_token(tokenizer, TOKEN_NULL, 4);
-            }
-            return identifier(tokenizer);
-        }
-        case 'p': {
-            if (lookahead(tokenizer, 4, "rint")) {
-                return make_token(tokenizer, TOKEN_PRINT, 5);
-            }
-            return identifier(tokenizer);
-        }
-        case 'r': {
-            if (lookahead(tokenizer, 5, "eturn")) {
-                return make_token(tokenizer, TOKEN_RETURN, 6);
-            }
-            return identifier(tokenizer);
-        }
-        case 't': {
-            if (lookahead(tokenizer, 3, "rue")) {
-                return make_token(tokenizer, TOKEN_TRUE, 4);
-            }
-            return identifier(tokenizer);
-        }
-        case 'w': {
-            if (lookahead(tokenizer, 4, "hile")) {
-                return make_token(tokenizer, TOKEN_WHILE, 5);
-            }
-            return identifier(tokenizer);
-        }
-        default: return identifier(tokenizer);
+        /* Anything else, letters included, starts an identifier. */
+        default: return identifier(tokenizer, start);
     }
-}
\ No newline at end of file
+}
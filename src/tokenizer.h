@@ -1,11 +1,10 @@
 #ifndef venom_tokenizer_h
 #define venom_tokenizer_h
 
-#define venom_debug
-
 typedef enum {
     TOKEN_PRINT,
     TOKEN_LET,
+    TOKEN_CONST,
     TOKEN_IDENTIFIER,
     TOKEN_NUMBER,
     TOKEN_STRING,
@@ -50,13 +49,30 @@ typedef struct {
     TokenType type;
     char *start;
     int length;
+    double value;  /* of a TOKEN_NUMBER */
 } Token;
 
+/* A piece of the source text, such as a name or the contents of a
+ * string literal. The AST refers to the source through slices instead
+ * of copying it, so the source must outlive the AST and the compiler,
+ * which interns every slice it needs. */
+typedef struct {
+    const char *start;
+    int length;
+} Slice;
+
+#define TOKEN_SLICE(token) ((Slice){ .start = (token).start, .length = (token).length })
+
 typedef struct {
     char *current;
     int line;
 } Tokenizer;
 
+/* The tokenizer scans the source several bytes at a time, so the
+ * NUL that terminates it must be followed by enough readable bytes
+ * to make up this many. */
+#define TOKENIZER_PADDING 16
+
 void init_tokenizer(Tokenizer *tokenizer, char *source);
 Token get_token(Tokenizer *tokenizer);
 
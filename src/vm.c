@@ -1,26 +1,237 @@
+#include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #include "math.h"
 #include "compiler.h"
+#include "lazy.h"
+#include "profile.h"
 #include "vm.h"
 #include "object.h"
 
-#define venom_debug
+/* profvm.c compiles this file a second time for the profiling loop,
+ * which only takes run() from it. */
+#ifndef venom_profile_ops
 
-void init_vm(VM *vm) {
+static size_t page_align(size_t bytes) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+static size_t stack_reservation(size_t max_stack_size) {
+    /* The maximum stack size plus one guard page that is never
+     * committed, in bytes. */
+    return page_align(max_stack_size * sizeof(Object)) + sysconf(_SC_PAGESIZE);
+}
+
+static bool commit_stack(VM *vm, size_t slots) {
+    size_t bytes = page_align(slots * sizeof(Object));
+    if (mprotect(vm->stack, bytes, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    vm->stack_size = bytes / sizeof(Object);
+    if (vm->stack_size > vm->max_stack_size) {
+        vm->stack_size = vm->max_stack_size;
+    }
+    return true;
+}
+
+void init_vm(VM *vm, VMOptions *options) {
     memset(vm, 0, sizeof(VM));
+
+    /* Small programs should never have to grow the stack, so at
+     * least one frame's worth is committed from the start. */
+    size_t stack_size = options->stack_size;
+    if (stack_size < FRAME_HEADROOM) {
+        stack_size = FRAME_HEADROOM;
+    }
+    vm->max_stack_size = options->max_stack_size;
+    if (vm->max_stack_size < stack_size) {
+        vm->max_stack_size = stack_size;
+    }
+
+    /* We reserve address space for the largest stack we allow, but
+     * leave it inaccessible, and commit only the initial part. That
+     * way, the stack grows in place, so pointers into it stay valid,
+     * and untouched pages cost no memory. Anything that writes past
+     * the committed part faults instead of corrupting the heap. */
+    vm->stack = mmap(
+        NULL, stack_reservation(vm->max_stack_size),
+        PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0
+    );
+    if (vm->stack == MAP_FAILED || !commit_stack(vm, stack_size)) {
+        fprintf(stderr, "Could not allocate the VM stack.\n");
+        exit(1);
+    }
+
+    vm->frame_capacity = FRAMES_INITIAL;
+    vm->frames = malloc(sizeof(CallFrame) * vm->frame_capacity);
+
+    init_heap(&vm->heap, &options->gc);
+
+    vm->output = malloc(OUTPUT_BUFFER_SIZE);
+    vm->output_count = 0;
+
+    if (options->profile_path != NULL) {
+        vm->profile = calloc(1, sizeof(Profile));
+    }
 }
 
 void free_vm(VM* vm) {
-    /* Free the globals table and its strings. */
-    table_free(&vm->globals); 
+    free(vm->profile);
+    free(vm->output);
+    munmap(vm->stack, stack_reservation(vm->max_stack_size));
+    free(vm->frames);
+    free(vm->globals);
+    free_heap(&vm->heap);
+}
+
+bool reserve_frame(VM *vm, size_t slots) {
+    /* The slow path of a call: commit the stack up to 'slots' slots
+     * and make room for one more frame. Both grow geometrically.
+     * Returns false if the stack would overflow its maximum size. */
+    if (slots > vm->max_stack_size) {
+        return false;
+    }
+    if (slots > vm->stack_size) {
+        size_t size = vm->stack_size * 2;
+        if (size < slots) size = slots;
+        if (size > vm->max_stack_size) size = vm->max_stack_size;
+        if (!commit_stack(vm, size)) {
+            return false;
+        }
+    }
+    if (vm->frame_count == vm->frame_capacity) {
+        if (vm->frame_capacity >= vm->max_stack_size) {
+            return false;
+        }
+        vm->frame_capacity *= 2;
+        vm->frames = realloc(vm->frames, sizeof(CallFrame) * vm->frame_capacity);
+    }
+    return true;
+}
+
+void reserve_globals(VM *vm, size_t count) {
+    /* Make room for 'count' global slots. New slots are undefined
+     * until the first OP_SET_GLOBAL or OP_FUNC stores into them. */
+    if (count <= vm->globals_count) {
+        return;
+    }
+    vm->globals = realloc(vm->globals, sizeof(Object) * count);
+    for (size_t i = vm->globals_count; i < count; i++) {
+        vm->globals[i] = UNDEFINED_VAL;
+    }
+    vm->globals_count = count;
 }
 
-static void runtime_error(const char *message) {
+void runtime_error(const char *message) {
     fprintf(stderr, "runtime error: %s.\n", message);
 }
 
+void flush_output(VM *vm) {
+    fwrite(vm->output, 1, vm->output_count, stdout);
+    vm->output_count = 0;
+}
+
+static void write_output(VM *vm, const char *chars, size_t length) {
+    if (vm->output_count + length > OUTPUT_BUFFER_SIZE) {
+        flush_output(vm);
+        if (length > OUTPUT_BUFFER_SIZE) {
+            fwrite(chars, 1, length, stdout);
+            return;
+        }
+    }
+    memcpy(vm->output + vm->output_count, chars, length);
+    vm->output_count += length;
+}
+
+void print_line(VM *vm, Object object) {
+    /* What OP_PRINT and ROP_PRINT print: the value on a line of its
+     * own. */
+#ifdef venom_debug
+    write_output(vm, "dbg print :: ", 13);
+#endif
+    if (IS_NUM(object)) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        write_output(vm, buffer, format_number(NUM_VAL(object), buffer));
+    } else if (IS_STRING(object)) {
+        write_output(vm, STR_VAL(object)->chars, STR_VAL(object)->length);
+    } else if (IS_BOOL(object)) {
+        if (BOOL_VAL(object)) {
+            write_output(vm, "true", 4);
+        } else {
+            write_output(vm, "false", 5);
+        }
+    } else if (IS_NULL(object)) {
+        write_output(vm, "null", 4);
+    } else if (IS_FUNC(object)) {
+        String *name = FUNC_VAL(object)->name;
+        write_output(vm, "<fn ", 4);
+        write_output(vm, name->chars, name->length);
+        write_output(vm, ">", 1);
+    }
+    write_output(vm, "\n", 1);
+#ifdef venom_debug
+    /* Keeps the output in order with the traces, which go through
+     * stdio directly. */
+    flush_output(vm);
+#endif
+}
+
+bool resolve_callee(VM *vm, BytecodeChunk *chunk, uint32_t slot, uint8_t argcount, uint32_t cache_index) {
+    /* The slow path of a call, taken when the global in 'slot' is not
+     * what the call site's inline cache saw last time. Checks that it
+     * holds a function that takes 'argcount' arguments and, if so,
+     * compiles it if this is its first call, and fills the cache.
+     * Otherwise, reports a runtime error. */
+    Object funcobj = vm->globals[slot];
+    if (!IS_FUNC(funcobj)) {
+        /* Runtime error if the function is not defined. */
+        char msg[512];
+        snprintf(
+            msg, sizeof(msg),
+            "Variable '%s' is not defined",
+            chunk->global_names.data[slot]->chars
+        );
+        runtime_error(msg);
+        return false;
+    }
+
+    /* If the number of arguments the function was called with
+     + does not match the number of parameters the function was
+     * declared to accept, raise a runtime error. */
+    if (argcount != FUNC_VAL(funcobj)->code->paramcount) {
+        char msg[512];
+        snprintf(
+            msg, sizeof(msg),
+            "Function '%s' requires '%d' arguments.",
+            chunk->global_names.data[slot]->chars, argcount
+        );
+        runtime_error(msg);
+        return false;
+    }
+
+    /* Compiling may add strings, globals and call sites to the
+     * chunk, so the caller has to look up its cache again. */
+    CodeObject *code = FUNC_VAL(funcobj)->code;
+    if (code->source.start != NULL) {
+        if (!compile_lazy(chunk, code)) {
+            return false;
+        }
+        reserve_globals(vm, chunk->global_names.count);
+    }
+
+    InlineCache *cache = &chunk->caches.data[cache_index];
+    cache->callee = funcobj;
+    cache->function = FUNC_VAL(funcobj);
+    return true;
+}
+
+#endif
+
 static void push(VM *vm, Object obj) {
     vm->stack[vm->tos++] = obj;
 }
@@ -29,7 +240,65 @@ static Object pop(VM *vm) {
     return vm->stack[--vm->tos];
 }
 
-void run(VM *vm, BytecodeChunk *chunk) {
+#ifdef venom_debug
+static void print_current_instruction(uint8_t *ip) {
+    printf("current instruction: ");
+    switch (*ip) {
+        case OP_PRINT: printf("OP_PRINT"); break;
+        case OP_ADD: printf("OP_ADD"); break;
+        case OP_SUB: printf("OP_SUB"); break;
+        case OP_MUL: printf("OP_MUL"); break;
+        case OP_DIV: printf("OP_DIV"); break;
+        case OP_MOD: printf("OP_MOD"); break;
+        case OP_EQ: printf("OP_EQ"); break;
+        case OP_GT: printf("OP_GT"); break;
+        case OP_LT: printf("OP_LT"); break;
+        case OP_NOT: printf("OP_NOT"); break;
+        case OP_NEGATE: printf("OP_NEGATE"); break;
+        case OP_JMP: printf("OP_JMP"); break;
+        case OP_JZ: printf("OP_JZ"); break;
+        case OP_JNZ: printf("OP_JNZ"); break;
+        case OP_FUNC: printf("OP_FUNC"); break;
+        case OP_INVOKE: printf("OP_INVOKE"); break;
+        case OP_TAIL_INVOKE: printf("OP_TAIL_INVOKE"); break;
+        case OP_RET: printf("OP_RET"); break;
+        case OP_CONST: printf("OP_CONST"); break;
+        case OP_STR: printf("OP_STR"); break;
+        case OP_TRUE: printf("OP_TRUE"); break;
+        case OP_FALSE: printf("OP_FALSE"); break;
+        case OP_SET_GLOBAL: printf("OP_SET_GLOBAL"); break;
+        case OP_GET_GLOBAL: printf("OP_GET_GLOBAL"); break;
+        case OP_DEEP_SET: {
+            printf("OP_DEEP_SET: %d", ip[1]);
+            break;
+        }
+        case OP_DEEP_GET: {
+            printf("OP_DEEP_GET: %d", ip[1]);
+            break;
+        }
+        case OP_NULL: printf("OP_NULL"); break;
+        case OP_POP: printf("OP_POP"); break;
+        case OP_WIDE: printf("OP_WIDE"); break;
+        case OP_EXIT: printf("OP_EXIT"); break;
+    }
+    printf("\n");
+}
+
+static void print_stack(VM *vm) {
+    printf("stack: [");
+    for (size_t i = 0; i < vm->tos; i++) {
+        print_object(&vm->stack[i]);
+        printf(", ");
+    }
+    printf("]\n");
+}
+#endif
+
+#ifdef venom_profile_ops
+bool run_profiled(VM *vm, BytecodeChunk *chunk, size_t start) {
+#else
+bool run(VM *vm, BytecodeChunk *chunk, size_t start) {
+#endif
 #define BINARY_OP(op, wrapper) \
 do { \
     /* Operands are already on the stack. */ \
@@ -38,338 +307,467 @@ do { \
     push(vm, wrapper(NUM_VAL(a) op NUM_VAL(b))); \
 } while (0)
 
-#define READ_UINT8() (*++ip)
+#define CHECK_NUMBERS(a, b) \
+do { \
+    /* Arithmetic on a boxed value would carry its payload, which may \
+     * be a heap pointer, into the result. */ \
+    if (!IS_NUM(a) || !IS_NUM(b)) { \
+        runtime_error("Operands must be numbers"); \
+        goto error; \
+    } \
+} while (0)
+
+#define ARITHMETIC_OP(op) \
+do { \
+    Object b = pop(vm); \
+    Object a = pop(vm); \
+    CHECK_NUMBERS(a, b); \
+    push(vm, AS_NUM(NUM_VAL(a) op NUM_VAL(b))); \
+} while (0)
+
+#define READ_UINT8() (*ip++)
 
 #define READ_INT16() \
-    /* ip points to one of the jump instructions and there \
-     * is a 2-byte operand (offset) that comes after the jump \
-     * instruction. We want to increment the ip so it points \
-     * to the last of the two operands, and construct a 16-bit \
-     * offset from the two bytes. Then ip is incremented in \
-     * the loop again so it points to the next instruction \
-     * (as opposed to pointing somewhere in the middle). */ \
+    /* ip points just past one of the jump instructions and \
+     * there is a 2-byte operand (offset) at ip. We want to \
+     * increment the ip so it points to the next instruction \
+     * (as opposed to pointing somewhere in the middle), and \
+     * construct a 16-bit offset from the two bytes. */ \
     (ip += 2, \
-    (int16_t)((ip[-1] << 8) | ip[0]))
+    (int16_t)((ip[-2] << 8) | ip[-1]))
 
-#define PRINT_STACK() \
-do { \
-    printf("stack: ["); \
-    for (size_t i = 0; i < vm->tos; i++) { \
-        print_object(&vm->stack[i]); \
-        printf(", "); \
-    } \
-    printf("]\n"); \
-} while(0)
+#define READ_UINT32() \
+    (ip += 4, \
+    (uint32_t)ip[-4] << 24 | ip[-3] << 16 | ip[-2] << 8 | ip[-1])
 
+#define READ_INT32() ((int32_t)READ_UINT32())
+
+/* Each handler finishes by dispatching the next instruction itself.
+ * With computed gotos, that is an indirect jump through 'dispatch_table'
+ * that lives at the end of every handler, so the branch predictor gets
+ * a separate history slot per opcode instead of one shared 'switch'.
+ * The portable fallback is a plain 'switch' inside an endless loop.
+ * Neither variant checks 'ip' against the end of the chunk: the compiler
+ * terminates every chunk with OP_EXIT instead. */
 #ifdef venom_debug
-    disassemble(chunk);
+#define TRACE() (print_stack(vm), print_current_instruction(ip))
+#else
+#define TRACE() ((void)0)
+#endif
+
+#if defined(venom_profile_ops)
+#define COUNT() profile_instruction(vm->profile, code, ip, OP_WIDE)
+#elif defined(venom_count_instructions)
+#define COUNT() (++instruction_count)
+#else
+#define COUNT() ((void)0)
+#endif
+
+#ifdef venom_computed_goto
+#define DISPATCH() do { TRACE(); COUNT(); goto *dispatch_table[*ip++]; } while (0)
+#define TARGET(op) op##_handler
+#else
+#define DISPATCH() do { TRACE(); COUNT(); goto dispatch; } while (0)
+#define TARGET(op) case op
 #endif
 
-    for (
-        uint8_t *ip = chunk->code.data;
-        ip < &chunk->code.data[chunk->code.count];  /* ip < addr of just beyond the last instruction */
-        ip++
-    ) {
+#ifdef venom_computed_goto
+    static void *dispatch_table[] = {
+        [OP_PRINT] = &&OP_PRINT_handler,
+        [OP_ADD] = &&OP_ADD_handler,
+        [OP_SUB] = &&OP_SUB_handler,
+        [OP_MUL] = &&OP_MUL_handler,
+        [OP_DIV] = &&OP_DIV_handler,
+        [OP_MOD] = &&OP_MOD_handler,
+        [OP_EQ] = &&OP_EQ_handler,
+        [OP_GT] = &&OP_GT_handler,
+        [OP_LT] = &&OP_LT_handler,
+        [OP_NOT] = &&OP_NOT_handler,
+        [OP_NEGATE] = &&OP_NEGATE_handler,
+        [OP_JMP] = &&OP_JMP_handler,
+        [OP_JZ] = &&OP_JZ_handler,
+        [OP_JNZ] = &&OP_JNZ_handler,
+        [OP_FUNC] = &&OP_FUNC_handler,
+        [OP_INVOKE] = &&OP_INVOKE_handler,
+        [OP_TAIL_INVOKE] = &&OP_TAIL_INVOKE_handler,
+        [OP_RET] = &&OP_RET_handler,
+        [OP_CONST] = &&OP_CONST_handler,
+        [OP_STR] = &&OP_STR_handler,
+        [OP_TRUE] = &&OP_TRUE_handler,
+        [OP_FALSE] = &&OP_FALSE_handler,
+        [OP_NULL] = &&OP_NULL_handler,
+        [OP_SET_GLOBAL] = &&OP_SET_GLOBAL_handler,
+        [OP_GET_GLOBAL] = &&OP_GET_GLOBAL_handler,
+        [OP_DEEP_SET] = &&OP_DEEP_SET_handler,
+        [OP_DEEP_GET] = &&OP_DEEP_GET_handler,
+        [OP_POP] = &&OP_POP_handler,
+        [OP_WIDE] = &&OP_WIDE_handler,
+        [OP_EXIT] = &&OP_EXIT_handler,
+    };
+#endif
+
+#ifdef venom_count_instructions
+    unsigned long long instruction_count = 0;
+#endif
 
 #ifdef venom_debug
-        printf("current instruction: ");
-        switch (*ip) {
-            case OP_PRINT: printf("OP_PRINT"); break;
-            case OP_ADD: printf("OP_ADD"); break;
-            case OP_SUB: printf("OP_SUB"); break;
-            case OP_MUL: printf("OP_MUL"); break;
-            case OP_DIV: printf("OP_DIV"); break;
-            case OP_MOD: printf("OP_MOD"); break;
-            case OP_EQ: printf("OP_EQ"); break;
-            case OP_GT: printf("OP_GT"); break;
-            case OP_LT: printf("OP_LT"); break;
-            case OP_NOT: printf("OP_NOT"); break;
-            case OP_NEGATE: printf("OP_NEGATE"); break;
-            case OP_JMP: printf("OP_JMP"); break;
-            case OP_JZ: printf("OP_JZ"); break;
-            case OP_FUNC: printf("OP_FUNC"); break;
-            case OP_INVOKE: printf("OP_INVOKE"); break;
-            case OP_RET: printf("OP_RET"); break;
-            case OP_CONST: printf("OP_CONST"); break;
-            case OP_STR: printf("OP_STR"); break;
-            case OP_SET_GLOBAL: printf("OP_SET_GLOBAL"); break;
-            case OP_GET_GLOBAL: printf("OP_GET_GLOBAL"); break;
-            case OP_DEEP_SET: {
-                printf("OP_DEEP_SET: %d", ip[1]);
-                break;
-            }
-            case OP_DEEP_GET: {
-                printf("OP_DEEP_GET: %d", ip[1]);
-                break;
-            }
-            case OP_NULL: printf("OP_NULL"); break;
-            case OP_EXIT: printf("OP_EXIT"); break;
-        }
-        printf("\n");
+    disassemble(chunk, start);
 #endif
 
-        switch (*ip) {  /* instruction pointer */
-            case OP_PRINT: {
-                Object object = pop(vm);
+    /* The code object being run, whose constants OP_CONST reads, and
+     * the base of the current frame, cached for OP_DEEP_GET and
+     * OP_DEEP_SET. Top-level code runs in a frame at the bottom of
+     * the stack. */
+    CodeObject *code = &chunk->main;
+    uint8_t *ip = code->code.data + start;
+    Object *slots = vm->stack;
+
+    /* Operands of the instructions that have a wide form. A narrow
+     * handler reads them and falls through into the code below its
+     * label, while OP_WIDE reads the four-byte forms and jumps to that
+     * label, so the common narrow case pays nothing for wide support. */
+    uint32_t slot, index, cache_index;
+    int32_t offset;
+    uint8_t count;
+
+    /* Whether the code ran to OP_EXIT rather than stopping at a
+     * runtime error. */
+    bool ok = true;
+
+#ifdef venom_profile_ops
+    start_profile(vm->profile);
+#endif
+
+    reserve_globals(vm, chunk->global_names.count);
+    vm->chunk = chunk;
+
+    /* Calls make room for the code they enter, and this makes room
+     * for the top level. */
+    if (vm->tos + code->max_stack > vm->stack_size
+            && !reserve_frame(vm, vm->tos + code->max_stack)) {
+        runtime_error("Stack overflow");
+        goto error;
+    }
+
 #ifdef venom_debug
-                printf("dbg print :: ");
+    print_current_instruction(ip);
 #endif
-                print_object(&object);
-                printf("\n");
-                break;
-            }
-            case OP_GET_GLOBAL: {
-                /* At this point, ip points to OP_GET_GLOBAL.
-                 * Since this is a 2-byte instruction with an
-                 * immediate operand (the index of the name of
-                 * the looked up variable in the string constant
-                 * pool), we want to increment the ip so it points
-                 * to the /index/ of the string in the string
-                 * constant pool that comes after the opcode.
-                 * We then look up the variable and push its value
-                 * on the stack. If we can't find the variable,
-                 * we bail out. */
-                uint8_t name_index = READ_UINT8();
-                Object *obj = table_get(&vm->globals, chunk->sp[name_index]);
-                if (obj == NULL) {
-                    char msg[512];
-                    snprintf(
-                        msg, sizeof(msg),
-                        "Variable '%s' is not defined",
-                        chunk->sp[name_index]
-                    );
-                    runtime_error(msg);
-                    return;
-                }
-                push(vm, *obj);
-                break;
-            }
-            case OP_SET_GLOBAL: {
-                /* At this point, ip points to OP_SET_GLOBAL.
-                 * This is a single-byte instruction that expects
-                 * two things to already be on the stack: the index
-                 * of the variable name in the string constant pool,
-                 * and the value of the double constant that the name
-                 * refers to. We pop these two and add the variable
-                 * to the globals table. */
-                uint8_t name_index = READ_UINT8();
-                Object constant = pop(vm);
-                table_insert(&vm->globals, chunk->sp[name_index], constant);
-                break;
-            }
-            case OP_CONST: {
-                /* At this point, ip points to OP_CONST.
-                 * Since this is a 2-byte instruction with an
-                 * immediate operand (the index of the double
-                 * constant in the constant pool), we want to
-                 * increment the ip to point to the index of
-                 * the constant in the constant pool that comes
-                 * after the opcode, and push the constant on
-                 * the stack. */
-                uint8_t index = READ_UINT8();
-                push(vm, AS_NUM(chunk->cp[index]));
-                break;
-            }
-            case OP_STR: {
-                /* At this point, ip points to OP_CONST.
-                 * Since this is a 2-byte instruction with an
-                 * immediate operand (the index of the double
-                 * constant in the constant pool), we want to
-                 * increment the ip to point to the index of
-                 * the constant in the constant pool that comes
-                 * after the opcode, and push the constant on
-                 * the stack. */
-                uint8_t index = READ_UINT8();
-                push(vm, AS_STR(chunk->sp[index]));
-                break;
-            }
-            case OP_DEEP_SET: {
-                uint8_t index = READ_UINT8();
-                Object obj = pop(vm);
-                int fp = vm->fp_stack[vm->fp_count-1];
-                vm->stack[fp+index] = obj;
-                break;
-            }
-            case OP_DEEP_GET: {
-                uint8_t index = READ_UINT8();
-                int fp = vm->fp_stack[vm->fp_count-1];
-                push(vm, vm->stack[fp+index]);
-                break;
-            }
-            case OP_ADD: BINARY_OP(+, AS_NUM); break;
-            case OP_SUB: BINARY_OP(-, AS_NUM); break;
-            case OP_MUL: BINARY_OP(*, AS_NUM); break;
-            case OP_DIV: BINARY_OP(/, AS_NUM); break;
-            case OP_MOD: {
-                Object b = pop(vm);
-                Object a = pop(vm);
-                push(vm, AS_NUM(fmod(NUM_VAL(a), NUM_VAL(b))));
-                break;
-            }
-            case OP_GT: BINARY_OP(>, AS_BOOL); break;
-            case OP_LT: BINARY_OP(<, AS_BOOL); break;
-            case OP_EQ: BINARY_OP(==, AS_BOOL); break;
-            case OP_JZ: {
-                /* Jump if zero. */
-                int16_t offset = READ_INT16();
-                if (!BOOL_VAL(pop(vm))) {
-                    ip += offset;
-                }
-                break;
+
+#ifdef venom_computed_goto
+    COUNT();
+    goto *dispatch_table[*ip++];
+#else
+    COUNT();
+dispatch:
+    switch (*ip++) {  /* instruction pointer */
+#endif
+        TARGET(OP_PRINT): {
+            print_line(vm, pop(vm));
+            DISPATCH();
+        }
+        TARGET(OP_GET_GLOBAL): {
+            /* At this point, ip points to the immediate operand
+             * of OP_GET_GLOBAL: the slot the compiler assigned to
+             * the variable. We push the value in that slot on the
+             * stack. If the variable has never been set, we bail
+             * out. */
+            slot = READ_UINT8();
+        get_global:;
+            Object obj = vm->globals[slot];
+            if (obj == UNDEFINED_VAL) {
+                char msg[512];
+                snprintf(
+                    msg, sizeof(msg),
+                    "Variable '%s' is not defined",
+                    chunk->global_names.data[slot]->chars
+                );
+                runtime_error(msg);
+                goto error;
             }
-            case OP_JMP: {
-                int16_t offset = READ_INT16();
+            push(vm, obj);
+            DISPATCH();
+        }
+        TARGET(OP_SET_GLOBAL): {
+            /* At this point, ip points to the immediate operand
+             * of OP_SET_GLOBAL: the slot of the variable. The value
+             * is already on the stack. We pop it into the slot. */
+            slot = READ_UINT8();
+        set_global:
+            vm->globals[slot] = pop(vm);
+            DISPATCH();
+        }
+        TARGET(OP_CONST): {
+            /* At this point, ip points to the immediate operand
+             * of OP_CONST (the index of the double constant in
+             * the constant pool). We read the index and push the
+             * constant on the stack. */
+            index = READ_UINT8();
+        load_constant:
+            push(vm, AS_NUM(code->cp.data[index]));
+            DISPATCH();
+        }
+        TARGET(OP_STR): {
+            /* At this point, ip points to the immediate operand
+             * of OP_STR (the index of the string in the string
+             * constant pool). We read the index and push the
+             * string on the stack. */
+            index = READ_UINT8();
+        load_string:
+            push(vm, AS_STR(chunk->sp.data[index]));
+            DISPATCH();
+        }
+        TARGET(OP_DEEP_SET): {
+            uint8_t local = READ_UINT8();
+            slots[local] = pop(vm);
+            DISPATCH();
+        }
+        TARGET(OP_DEEP_GET): {
+            uint8_t local = READ_UINT8();
+            push(vm, slots[local]);
+            DISPATCH();
+        }
+        TARGET(OP_ADD): ARITHMETIC_OP(+); DISPATCH();
+        TARGET(OP_SUB): ARITHMETIC_OP(-); DISPATCH();
+        TARGET(OP_MUL): ARITHMETIC_OP(*); DISPATCH();
+        TARGET(OP_DIV): ARITHMETIC_OP(/); DISPATCH();
+        TARGET(OP_MOD): {
+            Object b = pop(vm);
+            Object a = pop(vm);
+            CHECK_NUMBERS(a, b);
+            push(vm, AS_NUM(fmod(NUM_VAL(a), NUM_VAL(b))));
+            DISPATCH();
+        }
+        TARGET(OP_GT): BINARY_OP(>, AS_BOOL); DISPATCH();
+        TARGET(OP_LT): BINARY_OP(<, AS_BOOL); DISPATCH();
+        TARGET(OP_EQ): {
+            Object b = pop(vm);
+            Object a = pop(vm);
+            push(vm, AS_BOOL(objects_equal(a, b)));
+            DISPATCH();
+        }
+        TARGET(OP_JZ): {
+            /* Jump if zero. */
+            offset = READ_INT16();
+        jump_if_zero:
+            if (!BOOL_VAL(pop(vm))) {
                 ip += offset;
-                break;
-            }
-            case OP_NEGATE: {
-                Object obj = pop(vm);
-                push(vm, AS_NUM(-NUM_VAL(obj)));
-                break;
             }
-            case OP_NOT: {
-                Object obj = pop(vm);
-                push(vm, AS_BOOL(BOOL_VAL(obj) ^ 1));
-                break;
+            DISPATCH();
+        }
+        TARGET(OP_JNZ): {
+            /* Jump if not zero, which closes an inverted loop. */
+            offset = READ_INT16();
+        jump_if_not_zero:
+            if (BOOL_VAL(pop(vm))) {
+                ip += offset;
             }
-            case OP_FUNC: {
-                /* At this point, ip points to OP_FUNC. 
-                 * After the opcode, there is the index
-                 * of the function's name in the string
-                 * constant pool, followed by the number
-                 * of function parameters. */
-                uint8_t funcname_index = READ_UINT8();
-                uint8_t paramcount = READ_UINT8();
-
-                /* After the number of parameters, there
-                 * is one more byte: the location of the
-                 * function in the bytecode. */ 
-                uint8_t location = READ_UINT8();
-
-                /* We make the function object... */
-                char *funcname = chunk->sp[funcname_index];
-                Function func = {
-                    .location = location,
-                    .name = funcname,
-                    .paramcount = paramcount,
-                };
- 
-                Object funcobj = {
-                    .type = OBJ_FUNCTION,
-                    .as.func = func,
-                };
-
-                /* ...and insert it into the 'vm->globals' table. */
-                table_insert(&vm->globals, funcname, funcobj);
-
-                break;
+            DISPATCH();
+        }
+        TARGET(OP_JMP): {
+            offset = READ_INT16();
+        jump:
+            ip += offset;
+            DISPATCH();
+        }
+        TARGET(OP_NEGATE): {
+            Object obj = pop(vm);
+            if (!IS_NUM(obj)) {
+                runtime_error("Operand must be a number");
+                goto error;
             }
-            case OP_INVOKE: {
-                /* We first read the index of the function name and the argcount. */
-                uint8_t funcname = READ_UINT8();
-                uint8_t argcount = READ_UINT8();
-
-                /* Then, we look it up from the globals table. */ 
-                Object *funcobj = table_get(&vm->globals, chunk->sp[funcname]);
-                if (funcobj == NULL) {
-                    /* Runtime error if the function is not defined. */
-                    char msg[512];
-                    snprintf(
-                        msg, sizeof(msg),
-                        "Variable '%s' is not defined",
-                        chunk->sp[funcname]
-                    );
-                    runtime_error(msg);
-                    return;
-                }
+            push(vm, AS_NUM(-NUM_VAL(obj)));
+            DISPATCH();
+        }
+        TARGET(OP_NOT): {
+            Object obj = pop(vm);
+            push(vm, AS_BOOL(!BOOL_VAL(obj)));
+            DISPATCH();
+        }
+        TARGET(OP_FUNC): {
+            /* At this point, ip points to the first operand
+             * of OP_FUNC: the slot of the global the function
+             * is stored in. It is followed by the index of the
+             * function's code object in the chunk. */
+            slot = READ_UINT8();
+            index = READ_UINT8();
+        make_function:;
 
-                /* If the number of arguments the function was called with 
-                 + does not match the number of parameters the function was
-                 * declared to accept, raise a runtime error. */
-                if (argcount != funcobj->as.func.paramcount) {
-                    char msg[512];
-                    snprintf(
-                        msg, sizeof(msg),
-                        "Function '%s' requires '%d' arguments.",
-                        chunk->sp[funcname], argcount
-                    );
-                    runtime_error(msg);
-                    return;
-                }
+            /* We make the function object on the garbage-collected
+             * heap and store it in its global slot. */
+            Function *func = new_function(vm, chunk->global_names.data[slot], chunk->functions.data[index]);
+            vm->globals[slot] = AS_FUNC(func);
 
-                /* Since we need the arguments after the instruction pointer,
-                 * pop them into a temporary array so we can push them back
-                 * after we place the instruction pointer on the stack. */
-                Object arguments[256];
-                for (int i = 0; i < argcount; i++) {
-                    arguments[i] = pop(vm);
+            DISPATCH();
+        }
+        TARGET(OP_INVOKE): {
+            /* We first read the slot of the function, the argcount
+             * and the index of this call site's inline cache. */
+            slot = READ_UINT8();
+            count = READ_UINT8();
+            cache_index = READ_UINT8();
+        invoke:;
+            /* If the global still holds what this call site called
+             * last time, the function has been checked already. */
+            if (vm->globals[slot] != chunk->caches.data[cache_index].callee
+                    && !resolve_callee(vm, chunk, slot, count, cache_index)) {
+                goto error;
+            }
+            InlineCache *cache = &chunk->caches.data[cache_index];
+
+            /* Make sure the callee has room on the stack and in the
+             * frame stack before entering it. */
+            size_t top = vm->tos - count + cache->function->code->max_stack;
+            if (top > vm->stack_size || vm->frame_count == vm->frame_capacity) {
+                if (!reserve_frame(vm, top)) {
+                    runtime_error("Stack overflow");
+                    goto error;
                 }
-                
-                /* Then, we push the return address on the stack. */
-                push(vm, AS_POINTER(ip));
+            }
 
-                /* After that, we push the current frame pointer
-                 * on the frame pointer stack. */
-                vm->fp_stack[vm->fp_count++] = vm->tos;
+            /* The arguments stay where the caller pushed them and
+             * become the first slots of the new frame. We only record
+             * where to return to and where the frame starts. */
+            CallFrame *frame = &vm->frames[vm->frame_count++];
+            frame->ip = ip;
+            frame->slots = &vm->stack[vm->tos - count];
+            frame->function = cache->function;
+            slots = frame->slots;
 
-                /* Push the arguments back on the stack, but in reverse order. */
-                for (int i = argcount-1; i >= 0; i--) {
-                    push(vm, arguments[i]);
-                }
-                                
-                /* We modify ip so that it points to one instruction
-                 * just before the code we're invoking. */
-                ip = &chunk->code.data[funcobj->as.func.location-1];
+            /* We modify ip so that it points to the code we're invoking. */
+            code = frame->function->code;
+            ip = code->code.data;
 
-                break;
+            DISPATCH();
+        }
+        TARGET(OP_TAIL_INVOKE): {
+            /* 'return f(...)' reuses the current frame: the new
+             * arguments replace the old ones at the frame's base, and
+             * the frame keeps the return address of the original
+             * caller, so the stack does not grow no matter how deep
+             * the tail recursion goes. */
+            slot = READ_UINT8();
+            count = READ_UINT8();
+            cache_index = READ_UINT8();
+        tail_invoke:;
+            if (vm->globals[slot] != chunk->caches.data[cache_index].callee
+                    && !resolve_callee(vm, chunk, slot, count, cache_index)) {
+                goto error;
             }
-            case OP_RET: {
-                /* By the time we encounter OP_RET, the return
-                 * value is located on the stack. Beneath it are
-                 * the function arguments, followed by the return
-                 * address. */
-                Object returnvalue = pop(vm);
-
-                /* We pop the last frame pointer off the frame pointer stack. */
-                int fp = vm->fp_stack[--vm->fp_count];
-
-                /* Then, we clean up everything between the top of the stack
-                 * and the frame pointer we popped in the previous step. */
-                int to_pop = vm->tos - fp;
-                for (int i = 0; i < to_pop; i++) {
-                    pop(vm);
-                }
+            InlineCache *cache = &chunk->caches.data[cache_index];
 
-                /* After the arguments comes the return address which we'll
-                 * use to modify the instruction pointer ip and return to the
-                 * caller. */
-                Object returnaddr = pop(vm);
+            /* The callee may need more stack than the function it
+             * replaces. */
+            size_t top = (slots - vm->stack) + cache->function->code->max_stack;
+            if (top > vm->stack_size && !reserve_frame(vm, top)) {
+                runtime_error("Stack overflow");
+                goto error;
+            }
 
-                /* Then, we push the return value back on the stack.  */
-                push(vm, returnvalue);
+            memmove(slots, &vm->stack[vm->tos - count], sizeof(Object) * count);
+            vm->tos = (slots - vm->stack) + count;
+            if (vm->frame_count > 0) {
+                vm->frames[vm->frame_count-1].function = cache->function;
+            }
 
+            code = cache->function->code;
+            ip = code->code.data;
 
-                /* Finally, we modify the instruction pointer. */
-                ip = returnaddr.as.ptr;
+            DISPATCH();
+        }
+        TARGET(OP_RET): {
+            /* By the time we encounter OP_RET, the return value is
+             * located on the stack, above the frame's arguments and
+             * locals. Discarding the frame is a single reset of the
+             * top of the stack to where the arguments started. */
+            Object returnvalue = pop(vm);
+            CallFrame *frame = &vm->frames[--vm->frame_count];
+            vm->tos = frame->slots - vm->stack;
+            push(vm, returnvalue);
 
-                break;
-            }
-            case OP_TRUE: {
-                push(vm, AS_BOOL(true));
-                break;
+            /* Finally, we return to the caller and restore its frame. */
+            ip = frame->ip;
+            if (vm->frame_count > 0) {
+                slots = vm->frames[vm->frame_count-1].slots;
+                code = vm->frames[vm->frame_count-1].function->code;
+            } else {
+                slots = vm->stack;
+                code = &chunk->main;
             }
-            case OP_NULL: {
-                push(vm, (Object){ .type = OBJ_NULL });
-                break;
+
+            DISPATCH();
+        }
+        TARGET(OP_TRUE): {
+            push(vm, AS_BOOL(true));
+            DISPATCH();
+        }
+        TARGET(OP_FALSE): {
+            push(vm, AS_BOOL(false));
+            DISPATCH();
+        }
+        TARGET(OP_NULL): {
+            push(vm, NULL_VAL);
+            DISPATCH();
+        }
+        TARGET(OP_POP): {
+            pop(vm);
+            DISPATCH();
+        }
+        TARGET(OP_WIDE): {
+            /* The next instruction has four-byte operands in place of
+             * its one-byte indices and two-byte jump offset. We read
+             * them and continue in the instruction's own handler. */
+            switch (READ_UINT8()) {
+                case OP_GET_GLOBAL: slot = READ_UINT32(); goto get_global;
+                case OP_SET_GLOBAL: slot = READ_UINT32(); goto set_global;
+                case OP_CONST: index = READ_UINT32(); goto load_constant;
+                case OP_STR: index = READ_UINT32(); goto load_string;
+                case OP_JMP: offset = READ_INT32(); goto jump;
+                case OP_JZ: offset = READ_INT32(); goto jump_if_zero;
+                case OP_JNZ: offset = READ_INT32(); goto jump_if_not_zero;
+                case OP_FUNC: {
+                    slot = READ_UINT32();
+                    index = READ_UINT32();
+                    goto make_function;
+                }
+                case OP_INVOKE:
+                case OP_TAIL_INVOKE: {
+                    uint8_t op = ip[-1];
+                    slot = READ_UINT32();
+                    count = READ_UINT8();
+                    cache_index = READ_UINT32();
+                    if (op == OP_INVOKE) goto invoke;
+                    goto tail_invoke;
+                }
+                default: assert(0);
             }
-            case OP_EXIT: return;
-            default: break;
         }
-#ifdef venom_debug
-        PRINT_STACK();
-#endif
+        TARGET(OP_EXIT): goto exit;
+#ifndef venom_computed_goto
+        default: assert(0);
     }
+#endif
+
+error:
+    ok = false;
+exit:
+#ifdef venom_profile_ops
+    stop_profile(vm->profile);
+#endif
+    flush_output(vm);
+#ifdef venom_count_instructions
+    fprintf(stderr, "instructions executed: %llu\n", instruction_count);
+#endif
+    return ok;
+
 #undef BINARY_OP
+#undef CHECK_NUMBERS
+#undef ARITHMETIC_OP
 #undef READ_UINT8
 #undef READ_INT16
-}
\ No newline at end of file
+#undef READ_UINT32
+#undef READ_INT32
+#undef TRACE
+#undef COUNT
+#undef DISPATCH
+#undef TARGET
+}
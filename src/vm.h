@@ -1,25 +1,100 @@
 #ifndef venom_vm_h
 #define venom_vm_h
 
-#define STACK_MAX 256
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Default stack sizes, in slots. The stack is reserved up to its
+ * maximum size when the VM starts, but only the initial part is
+ * committed; the rest is committed as calls need it. */
+#define STACK_INITIAL 512
+#define STACK_MAX (1024 * 1024)
+#define FRAMES_INITIAL 64
+
+/* A frame's worth of stack, in slots: the number of locals a stack VM
+ * frame can address, and of registers a register VM frame can. At
+ * least this much is committed up front. Beyond that, calls commit
+ * what the code they enter needs, as told by its max_stack. */
+#define FRAME_HEADROOM 256
+
+/* What the program prints is gathered in a buffer of this many bytes
+ * and handed to stdio in one piece when it fills up, and whenever the
+ * VM stops running, at the end of the program or at an error. */
+#define OUTPUT_BUFFER_SIZE 65536
+
+#if defined(__GNUC__) && !defined(venom_no_computed_goto)
+#define venom_computed_goto
+#endif
 
 #include "compiler.h"
 #include "dynarray.h"
+#include "gc.h"
 #include "object.h"
 #include "table.h"
 
 typedef struct {
-    Object stack[STACK_MAX];
-    size_t tos; /* top of stack */
-    Table globals;
-    int fp_stack[STACK_MAX]; /* a stack for frame pointers */
-    size_t fp_count;
-} VM;
+    uint8_t *ip;  /* return address */
+    Object *slots;  /* the first argument of the call */
+    Function *function;
+    uint8_t dst;  /* register backend: the caller's register for the return value */
+} CallFrame;
+
+typedef struct {
+    size_t stack_size;  /* slots committed up front */
+    size_t max_stack_size;  /* slots reserved; the stack never grows past this */
+    GCOptions gc;
+    /* With --profile-ops, the file the profile goes to, after the VM
+     * has run in the profiling loops (see profile.h). */
+    const char *profile_path;
+} VMOptions;
+
+#define DEFAULT_VM_OPTIONS ((VMOptions){ \
+    .stack_size = STACK_INITIAL, \
+    .max_stack_size = STACK_MAX, \
+    .gc = DEFAULT_GC_OPTIONS, \
+})
 
 typedef struct BytecodeChunk BytecodeChunk;
 
-void init_vm(VM *vm);
+typedef struct VM {
+    Object *stack;
+    /* Top of stack. The register VM sets it to the end of the current
+     * frame's registers before it allocates, since everything below
+     * is a root for the garbage collector. */
+    size_t tos;
+    size_t stack_size;  /* committed slots */
+    size_t max_stack_size;  /* reserved slots */
+    Object *globals;  /* indexed by the slots assigned by the compiler */
+    size_t globals_count;
+    CallFrame *frames;
+    size_t frame_count;
+    size_t frame_capacity;
+    Heap heap;
+    BytecodeChunk *chunk;  /* the running chunk, whose pools are roots */
+    char *output;  /* printed, but not yet written to stdout */
+    size_t output_count;
+    struct Profile *profile;  /* NULL unless the VM runs in the profiling loops */
+} VM;
+
+void init_vm(VM *vm, VMOptions *options);
 void free_vm(VM *vm);
-void run(VM *vm, BytecodeChunk *chunk);
+bool reserve_frame(VM *vm, size_t slots);
+void reserve_globals(VM *vm, size_t count);
+void runtime_error(const char *message);
+void print_line(VM *vm, Object object);
+void flush_output(VM *vm);
+bool resolve_callee(VM *vm, BytecodeChunk *chunk, uint32_t slot, uint8_t argcount, uint32_t cache_index);
+
+/* Both run the chunk from offset 'start' up to the next OP_EXIT (or
+ * ROP_EXIT), so code appended to a chunk after it ran can be run on
+ * the same VM, whose globals persist. They return false if execution
+ * stopped at a runtime error instead. */
+bool run(VM *vm, BytecodeChunk *chunk, size_t start);
+bool run_registers(VM *vm, BytecodeChunk *chunk, size_t start);
+
+/* The same two with profiling, which are run instead when the VM has
+ * a profile. */
+bool run_profiled(VM *vm, BytecodeChunk *chunk, size_t start);
+bool run_registers_profiled(VM *vm, BytecodeChunk *chunk, size_t start);
 
 #endif
\ No newline at end of file
@@ -23,3 +23,18 @@ def test_block(x, y):
 
     assert f"dbg print :: {x + y:.2f}\n".encode('utf-8') in process.stdout
     assert process.returncode == 0
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_long_jumps(backend):
+    # Loop and if bodies of more than 32KB of code need jumps with
+    # four-byte offsets, forwards as well as backwards.
+    body = "    s = s + 1;\n" * 6000
+    source = f"let i = 0;\nlet s = 0;\nwhile (i < 3) {{\n{body}    i = i + 1;\n}}\nif (s > 0) {{\n{body}}}\nprint s;\n"
+    process = subprocess.run(
+        VALGRIND_CMD + backend,
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+    assert b"dbg print :: 24000.00\n" in process.stdout
+    assert process.returncode == 0
@@ -0,0 +1,113 @@
+import struct
+import subprocess
+import pytest
+
+from tests.util import VALGRIND_CMD
+
+
+def cache_of(path, backend):
+    return path.with_suffix(".vnmrc" if "--registers" in backend else ".vnmc")
+
+
+def run(path, backend):
+    process = subprocess.run(
+        VALGRIND_CMD + backend + [str(path)],
+        capture_output=True
+    )
+    assert process.returncode == 0
+    return [line for line in process.stdout.split(b"\n") if line.startswith(b"dbg print :: ")]
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_cache(backend, tmp_path):
+    path = tmp_path / "program.vnm"
+    cache = cache_of(path, backend)
+    path.write_text('fn f(x) { return x + 1; }\nprint f(1);\nprint "cached";\n')
+
+    # The first run writes the cache, and the second one loads it.
+    assert run(path, backend) == [b"dbg print :: 2.00", b"dbg print :: cached"]
+    assert cache.exists()
+    assert run(path, backend) == [b"dbg print :: 2.00", b"dbg print :: cached"]
+
+    # A changed script makes the cache stale.
+    path.write_text('print "changed";\n')
+    assert run(path, backend) == [b"dbg print :: changed"]
+
+    # So does a damaged cache.
+    cache.write_bytes(cache.read_bytes()[:40])
+    assert run(path, backend) == [b"dbg print :: changed"]
+    assert run(path, backend) == [b"dbg print :: changed"]
+
+
+def test_cache_per_backend(tmp_path):
+    # Each backend has a cache of its own, so running them in turn
+    # doesn't make either one rebuild its cache.
+    path = tmp_path / "program.vnm"
+    path.write_text('print 1;\n')
+    run(path, [])
+    run(path, ["--registers"])
+    stack = cache_of(path, []).stat().st_ino
+    registers = cache_of(path, ["--registers"]).stat().st_ino
+    assert run(path, []) == [b"dbg print :: 1.00"]
+    assert run(path, ["--registers"]) == [b"dbg print :: 1.00"]
+    assert cache_of(path, []).stat().st_ino == stack
+    assert cache_of(path, ["--registers"]).stat().st_ino == registers
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+@pytest.mark.parametrize("verify", [[], ["--verify-cache"]])
+def test_corrupted_cache(backend, verify, tmp_path):
+    # A cache whose 56-byte header is intact but whose body has been
+    # changed, at a few places all through it, is rebuilt rather than
+    # run, with or without --verify-cache.
+    path = tmp_path / "program.vnm"
+    cache = cache_of(path, backend)
+    path.write_text('let s = "text";\nfn f(x) { return x * 2; }\nprint f(21);\nprint s;\n')
+    expected = [b"dbg print :: 42.00", b"dbg print :: text"]
+    assert run(path, backend) == expected
+    good = cache.read_bytes()
+
+    for offset in range(56, len(good), (len(good) - 56) // 8):
+        damaged = bytearray(good)
+        damaged[offset] ^= 0xFF
+        cache.write_bytes(damaged)
+        assert run(path, backend + verify) == expected
+        assert cache.read_bytes() == good
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_corrupted_constant(backend, tmp_path):
+    # A changed constant still makes valid code, so only the hash of
+    # the body tells it apart.
+    path = tmp_path / "program.vnm"
+    cache = cache_of(path, backend)
+    path.write_text('let x = 9;\nprint x * 7;\n')
+    assert run(path, backend) == [b"dbg print :: 63.00"]
+    good = cache.read_bytes()
+    offset = good.index(struct.pack("=d", 7.0))
+
+    damaged = bytearray(good)
+    damaged[offset + 6] ^= 0x01
+    cache.write_bytes(damaged)
+    assert run(path, backend) == [b"dbg print :: 63.00"]
+    assert cache.read_bytes() == good
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_parallel_front_end(backend, tmp_path):
+    # Functions compiled on several threads make the same bytecode
+    # as when they are compiled one after another.
+    path = tmp_path / "program.vnm"
+    cache = cache_of(path, backend)
+    functions = "".join(
+        'fn f%d(x) { fn g(y) { return y + %d; } if (x > 0) { print "f%d"; return f%d(x - 1); } return g(x); }\n'
+        % (i, i, i, max(i - 1, 0))
+        for i in range(300)
+    )
+    path.write_text('const K = 1;\n' + functions + 'print f299(2) + K;\n')
+
+    assert run(path, backend) == [b"dbg print :: f299", b"dbg print :: f298", b"dbg print :: 298.00"]
+    serial = cache.read_bytes()
+    cache.unlink()
+    assert run(path, backend + ["--jobs=4"]) == [b"dbg print :: f299", b"dbg print :: f298", b"dbg print :: 298.00"]
+    assert cache.read_bytes() == serial
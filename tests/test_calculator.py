@@ -56,3 +56,69 @@ def test_calculator_grouping_nested():
     assert "dbg print :: 5.00\n".encode('utf-8') in process.stdout
     assert process.returncode == 0
 
+
+def nested_sum(depth):
+    # 'x + (x + (... (1)))' keeps one more temporary live per level.
+    expression = "1"
+    for _ in range(depth):
+        expression = f"x + ({expression})"
+    return f"let x = 1; fn f(a) {{ return a + ({expression}); }} print f(1);"
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_calculator_deep_nesting(backend):
+    process = subprocess.run(
+        VALGRIND_CMD + backend,
+        capture_output=True,
+        input=nested_sum(100).encode('utf-8')
+    )
+    assert b"dbg print :: 102.00\n" in process.stdout
+    assert process.returncode == 0
+
+
+def test_calculator_too_many_registers():
+    # Register operands are one byte, so an expression that needs more
+    # than 256 registers must be rejected rather than wrap around. The
+    # stack VM has no such limit.
+    source = nested_sum(200).encode('utf-8')
+    process = subprocess.run(VALGRIND_CMD, capture_output=True, input=source)
+    assert b"dbg print :: 202.00\n" in process.stdout
+    assert process.returncode == 0
+
+    process = subprocess.run(VALGRIND_CMD + ["--registers"], capture_output=True, input=source)
+    assert b"compile error" in process.stderr
+    assert process.returncode != 0
+
+
+@pytest.mark.parametrize("mode", [["--jobs=2"], None])
+def test_calculator_too_many_registers_on_first_call(mode, tmp_path):
+    # From standard input, 'f' is compiled on its first call, after the
+    # program has printed, and that output must survive the error. With
+    # --jobs, it is compiled on a worker before anything runs.
+    source = "print 1;\n" + nested_sum(300)
+    path = tmp_path / "program.vnm"
+    path.write_text(source)
+    process = subprocess.run(
+        VALGRIND_CMD + ["--registers"] + (mode + [str(path)] if mode is not None else []),
+        capture_output=True,
+        input=source.encode('utf-8') if mode is None else None
+    )
+    assert b"compile error" in process.stderr
+    assert process.returncode != 0
+    if mode is None:
+        assert b"dbg print :: 1.00\n" in process.stdout
+    else:
+        assert b"dbg print :: 1.00\n" not in process.stdout
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+@pytest.mark.parametrize(
+    "source",
+    ["print true + 1;", "print 1 + true;", 'print "abc" + 1;', "print null % 2;", 'print -"abc";'],
+)
+def test_calculator_non_numbers(backend, source):
+    # Both backends reject arithmetic on anything but numbers.
+    process = subprocess.run(VALGRIND_CMD + backend, capture_output=True, input=source.encode('utf-8'))
+    assert b"runtime error" in process.stderr
+    assert b"dbg print" not in process.stdout
+    assert process.returncode != 0
@@ -29,3 +29,32 @@ def test_comparison(x, y):
 
         assert f"dbg print :: {expected}\n".encode('utf-8') in process.stdout
         assert process.returncode == 0
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+@pytest.mark.parametrize("value", ["0/0", "null", "true"])
+def test_comparison_not_a_number(backend, value):
+    # '>=' and '<=' are the negation of '<' and '>' on both backends,
+    # as when they are folded, so a NaN or a value that is not a number
+    # compares the same everywhere. The value is held in a variable so
+    # that it is not folded.
+    source = textwrap.dedent(
+        f"""\
+        let x = {value};
+        print x > 1;
+        print x < 1;
+        print x >= 1;
+        print x <= 1;
+        print 1 >= x;
+        print 1 <= x;
+        """
+    )
+    process = subprocess.run(
+        VALGRIND_CMD + backend,
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+    prints = [line for line in process.stdout.split(b"\n") if line.startswith(b"dbg print :: ")]
+    expected = ["false", "false", "true", "true", "true", "true"]
+    assert prints == [f"dbg print :: {e}".encode('utf-8') for e in expected]
+    assert process.returncode == 0
@@ -0,0 +1,46 @@
+import textwrap
+import subprocess
+import pytest
+
+from tests.util import VALGRIND_CMD
+from tests.util import TWO_OPERANDS_GROUP
+
+
+@pytest.mark.parametrize(
+    "x, y",
+    TWO_OPERANDS_GROUP,
+)
+def test_constants(x, y):
+    source = textwrap.dedent(
+        f"""\
+        const X = {x};
+        const Y = X + {y};
+        fn f(a) {{ return a * Y; }}
+        print f(2);"""
+    )
+    expected = '%.2f' % (2 * (x + y))
+    process = subprocess.run(
+        VALGRIND_CMD,
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+    assert f"dbg print :: {expected}\n".encode('utf-8') in process.stdout
+    assert process.returncode == 0
+
+
+@pytest.mark.parametrize(
+    "source",
+    [
+        "const X = 1; X = 2;",
+        "const X = 1; let X = 2;",
+        "let y = 1; const X = y;",
+    ],
+)
+def test_invalid_constants(source):
+    process = subprocess.run(
+        VALGRIND_CMD,
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+    assert b"compile error" in process.stderr
+    assert process.returncode != 0
@@ -28,3 +28,36 @@ def test_equality(x, y):
 
     assert f"dbg print :: {expected}\n".encode('utf-8') in process.stdout
     assert process.returncode == 0
+
+
+@pytest.mark.parametrize(
+    "x, y",
+    [
+        ["hello", "hello"],
+        ["hello", "world"],
+        ["", ""],
+        ["", "hello"],
+    ],
+)
+def test_string_equality(x, y):
+    source = textwrap.dedent(
+        f"""\
+        fn id(s) {{ return s; }}
+        let x = "{x}";
+        print id(x) == "{y}";
+        print x != "{y}";
+        """
+    )
+
+    process = subprocess.run(
+        VALGRIND_CMD,
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+
+    equal = 'true' if x == y else 'false'
+    not_equal = 'false' if x == y else 'true'
+
+    prints = [line for line in process.stdout.split(b"\n") if line.startswith(b"dbg print :: ")]
+    assert prints == [f"dbg print :: {equal}".encode('utf-8'), f"dbg print :: {not_equal}".encode('utf-8')]
+    assert process.returncode == 0
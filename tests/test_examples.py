@@ -5,7 +5,7 @@ from pathlib import Path
 EXAMPLES_PATH = Path('examples')
 
 def test_examples():
-    for file in EXAMPLES_PATH.iterdir():
+    for file in EXAMPLES_PATH.glob('*.vnm'):
         process = subprocess.run(
             [
                 "valgrind",
@@ -0,0 +1,151 @@
+import subprocess
+import pytest
+import textwrap
+
+from tests.util import VALGRIND_CMD
+
+
+def run(source, backend):
+    process = subprocess.run(
+        VALGRIND_CMD + backend,
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+    assert process.returncode == 0
+    return [line for line in process.stdout.split(b"\n") if line.startswith(b"dbg print :: ")]
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_nested_function(backend):
+    # The inner declaration must not disturb the locals of the outer
+    # function, which are still used after it.
+    source = textwrap.dedent(
+        """\
+        fn outer(a) {
+            let b = a * 2;
+            fn inner(x) { return x + 1; }
+            print inner(b);
+            return a + b;
+        }
+        print outer(3);
+        print outer;
+        """
+    )
+    assert run(source, backend) == [b"dbg print :: 7.00", b"dbg print :: 9.00", b"dbg print :: <fn outer>"]
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_function_without_return(backend):
+    source = textwrap.dedent(
+        """\
+        fn f(x) { if (x) { return 1; } }
+        fn g() {}
+        print f(false);
+        print g();
+        print f(true);
+        """
+    )
+    assert run(source, backend) == [b"dbg print :: null", b"dbg print :: null", b"dbg print :: 1.00"]
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_lazy_function(backend):
+    # Without a cache, a function body is only compiled when it is
+    # first called, seeing the constants declared before it.
+    source = textwrap.dedent(
+        """\
+        const K = 10;
+        fn unused(x) { return x / K; }
+        fn scale(x) { fn inner(y) { return y * K; } return inner(x) + 1; }
+        print scale(2);
+        print scale(3);
+        """
+    )
+    assert run(source, backend) == [b"dbg print :: 21.00", b"dbg print :: 31.00"]
+
+    # So a body that parses but doesn't compile is only reported once
+    # the function is called, after what the program printed before.
+    process = subprocess.run(
+        VALGRIND_CMD + backend,
+        capture_output=True,
+        input=(source + "fn broken(x) { const J = K + x; }\nprint 1;\nbroken(1);\nprint 2;\n").encode('utf-8')
+    )
+    assert b"dbg print :: 1.00" in process.stdout
+    assert b"compile error" in process.stderr
+    assert b"dbg print :: 2.00" not in process.stdout
+    assert process.returncode != 0
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+@pytest.mark.parametrize(
+    "body, error",
+    [
+        ("this is not valid", b"parse error"),
+        ("const J = K + x;", b"compile error"),
+    ],
+)
+@pytest.mark.parametrize(
+    "mode",
+    [["--no-cache"], ["--stream"], [], ["--jobs=2"], None],
+)
+def test_broken_function_never_called(backend, body, error, mode, tmp_path):
+    # A syntax error in a body is an error whether or not the function
+    # is called, however the program is run. Other errors are too when
+    # every function is compiled up front, for the cache or with --jobs,
+    # but not when bodies are compiled on their first call. 'None' reads
+    # the program from standard input.
+    source = f"const K = 10;\nfn unused(x) {{ {body} }}\nprint 1;\n"
+    path = tmp_path / "program.vnm"
+    path.write_text(source)
+    process = subprocess.run(
+        VALGRIND_CMD + backend + (mode + [str(path)] if mode is not None else []),
+        capture_output=True,
+        input=source.encode('utf-8') if mode is None else None
+    )
+    if error == b"compile error" and mode in (["--no-cache"], ["--stream"], None):
+        assert process.returncode == 0
+        assert b"dbg print :: 1.00" in process.stdout
+    else:
+        assert process.returncode != 0
+        assert error in process.stderr
+        assert b"dbg print :: 1.00" not in process.stdout
+
+
+def test_too_many_locals_and_arguments():
+    # Locals and argument counts are one-byte operands, so code that
+    # needs more is rejected rather than overflowing or wrapping around.
+    lets = "".join(f"let v{i} = {i};\n" for i in range(300))
+    arguments = ", ".join(str(i) for i in range(260))
+    for source in [f"fn f() {{\n{lets}return v299;\n}}\nprint f();\n", f"fn g(a) {{ return a; }}\nprint g({arguments});\n"]:
+        process = subprocess.run(VALGRIND_CMD, capture_output=True, input=source.encode('utf-8'))
+        assert b"compile error" in process.stderr
+        assert process.returncode != 0
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+@pytest.mark.parametrize("mode", [["--no-cache"], ["--stream"], None])
+def test_too_many_locals_on_first_call(backend, mode, tmp_path):
+    # A body compiled on its first call fails like any other body that
+    # doesn't compile: what the program printed before the call is not
+    # lost, and the program stops there.
+    lets = "".join(f"let v{i} = {i};\n" for i in range(300))
+    arguments = ", ".join(str(i) for i in range(260))
+    parameters = ", ".join(f"p{i}" for i in range(260))
+    bodies = [
+        f"fn f() {{\n{lets}return v299;\n}}\n",
+        f"fn f() {{ return g({arguments}); }}\nfn g({parameters}) {{ return p0; }}\n",
+    ]
+    for body in bodies:
+        source = "print 1;\nprint 2;\nprint 3;\n" + body + "print f();\nprint 4;\n"
+        path = tmp_path / "program.vnm"
+        path.write_text(source)
+        process = subprocess.run(
+            VALGRIND_CMD + backend + (mode + [str(path)] if mode is not None else []),
+            capture_output=True,
+            input=source.encode('utf-8') if mode is None else None
+        )
+        assert b"compile error" in process.stderr
+        assert process.stdout.count(b"dbg print :: ") == 3
+        assert b"dbg print :: 3.00" in process.stdout
+        assert b"dbg print :: 4.00" not in process.stdout
+        assert process.returncode != 0
@@ -0,0 +1,84 @@
+import re
+import subprocess
+import pytest
+import textwrap
+
+from tests.util import VALGRIND_CMD
+
+
+SOURCE = textwrap.dedent(
+    """\
+    fn keep(x) { return x * 2; }
+    let held = keep;
+    let i = 0;
+    let total = 0;
+    while (i < 500) {
+        fn f(x) { return x + 1; }
+        total = f(total);
+        i = i + 1;
+    }
+    print total;
+    print held(21);
+    print held == keep;
+    """
+)
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+@pytest.mark.parametrize("promotion_age", [1, 3])
+def test_gc(backend, promotion_age):
+    # A tiny nursery and old generation force both kinds of collection
+    # while functions are being made, called and held in globals.
+    flags = [
+        "--nursery-size=64",
+        f"--promotion-age={promotion_age}",
+        "--heap-size=256",
+        "--gc-stats",
+    ]
+    process = subprocess.run(
+        VALGRIND_CMD + backend + flags,
+        capture_output=True,
+        input=SOURCE.encode('utf-8')
+    )
+
+    prints = [line for line in process.stdout.split(b"\n") if line.startswith(b"dbg print :: ")]
+    assert prints == [b"dbg print :: 500.00", b"dbg print :: 42.00", b"dbg print :: true"]
+
+    minor = re.search(rb"gc: (\d+) minor, (\d+) major collections", process.stderr)
+    assert minor is not None
+    assert int(minor.group(1)) > 0
+    if promotion_age == 1:
+        assert int(minor.group(2)) > 0
+    assert process.returncode == 0
+
+
+HIDDEN_POINTER_SOURCE = textwrap.dedent(
+    """\
+    fn h() { return 1; }
+    let neg = -h;
+    h = 0;
+    let i = 0;
+    while (i < 500) {
+        fn f(x) { return x + 1; }
+        i = f(i);
+    }
+    print -neg;
+    """
+)
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_gc_arithmetic_on_pointer(backend):
+    # Negating a function would keep its address in a value the
+    # collector takes for a number, and negating that again would
+    # bring back a pointer to whatever took its place. Arithmetic on
+    # anything but numbers is an error instead.
+    flags = ["--nursery-size=256", "--promotion-age=1", "--heap-size=64"]
+    process = subprocess.run(
+        VALGRIND_CMD + backend + flags,
+        capture_output=True,
+        input=HIDDEN_POINTER_SOURCE.encode('utf-8')
+    )
+    assert b"runtime error: Operand must be a number." in process.stderr
+    assert b"dbg print" not in process.stdout
+    assert process.returncode != 0
@@ -30,4 +30,17 @@ def test_assignment(x):
             # the result is going to have a minus in front. 
             f"{'-' if (x == 0 and minus_count % 2 != 0) else ''}" +
             f"{eval('-' * minus_count + str(x)):.2f}\n").encode('utf-8') in process.stdout
-        assert process.returncode == 0
\ No newline at end of file
+        assert process.returncode == 0
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_negative_zero_constant(backend):
+    # -0 folds to a constant that compares equal to 0, but it must not
+    # share 0's slot in the constant pool.
+    process = subprocess.run(
+        VALGRIND_CMD + backend,
+        capture_output=True,
+        input=b"print 0;\nprint -0;\n"
+    )
+    assert b"dbg print :: 0.00\n" in process.stdout
+    assert b"dbg print :: -0.00\n" in process.stdout
+    assert process.returncode == 0
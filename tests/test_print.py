@@ -0,0 +1,54 @@
+import subprocess
+import pytest
+import textwrap
+
+from tests.util import VALGRIND_CMD
+
+
+def run(source, backend):
+    process = subprocess.run(
+        VALGRIND_CMD + backend,
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+    assert process.returncode == 0
+    return [line for line in process.stdout.split(b"\n") if line.startswith(b"dbg print :: ")]
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_number_format(backend):
+    # Numbers print as with "%.2f", rounded from their exact binary
+    # value, ties to even.
+    numbers = ["0.125", "0.375", "2.675", "0.005", "1 / 3", "0 - 0.001", "123456789.125", "100000000000000000000"]
+    source = "".join(f"print {number};\n" for number in numbers)
+    expected = [("dbg print :: %.2f" % eval(number.replace(" - ", "-"))).encode('utf-8') for number in numbers]
+    assert run(source, backend) == expected
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_output_larger_than_buffer(backend):
+    source = textwrap.dedent(
+        """\
+        let i = 0;
+        while (i < 20000) {
+            print i;
+            print "line";
+            i = i + 1;
+        }
+        print true;
+        """
+    )
+    lines = run(source, backend)
+    assert len(lines) == 40001
+    assert lines[-3:] == [b"dbg print :: 19999.00", b"dbg print :: line", b"dbg print :: true"]
+
+
+def test_output_before_runtime_error():
+    process = subprocess.run(
+        VALGRIND_CMD,
+        capture_output=True,
+        input=b"let i = 0;\nwhile (i < 3) { print i; i = i + 1; }\nprint x;\n"
+    )
+    assert process.returncode != 0
+    assert process.stdout.count(b"dbg print :: ") == 3
+    assert b"runtime error" in process.stderr
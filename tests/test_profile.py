@@ -0,0 +1,85 @@
+import json
+import subprocess
+import pytest
+import textwrap
+
+from tests.util import VALGRIND_CMD
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_profile_ops(backend, tmp_path):
+    source = textwrap.dedent(
+        """\
+        fn square(x) {
+            return x * x;
+        }
+        let i = 0;
+        while (i < 10) {
+            print square(i);
+            i = i + 1;
+        }
+        """
+    )
+    profile = tmp_path / "profile.json"
+    process = subprocess.run(
+        VALGRIND_CMD + backend + ["--profile-ops=" + str(profile)],
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+    assert process.returncode == 0
+
+    # Profiling doesn't change what the program does.
+    lines = [line for line in process.stdout.split(b"\n") if line.startswith(b"dbg print :: ")]
+    assert lines[-1] == b"dbg print :: 81.00"
+    assert b"profile written to" in process.stderr
+
+    data = json.loads(profile.read_text())
+    assert data["backend"] == ("registers" if backend else "stack")
+    opcodes = {op["opcode"]: op for op in data["opcodes"]}
+    mul = "ROP_MUL" if backend else "OP_MUL"
+    assert opcodes[mul]["count"] == 10
+
+    # Each offset is counted in the function it belongs to, and the
+    # offsets add up to the opcodes.
+    instructions = data["instructions"]
+    assert [i["count"] for i in instructions if i["opcode"] == mul] == [10]
+    assert [i["function"] for i in instructions if i["opcode"] == mul] == ["square"]
+    assert sum(i["count"] for i in instructions) == sum(op["count"] for op in data["opcodes"])
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_profile_ops_wide(backend, tmp_path):
+    # Past 256 globals, global and call operands are wide, and the
+    # wide prefix must not take the counts of the opcodes after it.
+    lets = "".join(f"let g{i} = {i};\n" for i in range(300))
+    source = lets + textwrap.dedent(
+        """\
+        fn inc(x) { return x + 1; }
+        let i = 0;
+        while (i < 10) {
+            g299 = inc(g299);
+            i = i + 1;
+        }
+        print g299;
+        """
+    )
+    profile = tmp_path / "profile.json"
+    process = subprocess.run(
+        VALGRIND_CMD + backend + ["--profile-ops=" + str(profile)],
+        capture_output=True,
+        input=source.encode('utf-8')
+    )
+    assert process.returncode == 0
+
+    data = json.loads(profile.read_text())
+    opcodes = {op["opcode"]: op for op in data["opcodes"]}
+    wide, call, set_global = ("ROP_WIDE", "ROP_CALL", "ROP_SETG") if backend else ("OP_WIDE", "OP_INVOKE", "OP_SET_GLOBAL")
+    assert wide not in opcodes
+    assert opcodes[call]["count"] == 10
+    assert opcodes[set_global]["count"] == 300 + 10 + 11
+    assert opcodes[call]["cycles"] > 0
+
+    instructions = data["instructions"]
+    assert all(i["opcode"] != wide for i in instructions)
+    assert [i["count"] for i in instructions if i["opcode"] == call] == [10]
+    assert sum(i["count"] for i in instructions) == sum(op["count"] for op in data["opcodes"])
@@ -0,0 +1,83 @@
+import select
+import subprocess
+import pytest
+import textwrap
+
+from tests.util import VALGRIND_CMD
+
+
+SOURCE = textwrap.dedent(
+    """\
+    const GREETING = "{ not a block; }";
+    fn twice(x) {
+        return x * 2;
+    }
+    if (twice(2) == 4) {
+        print GREETING;
+    }
+    else {
+        print "wrong";
+    }
+    let i = 0;
+    while (i < 2) if (i == 0) i = i + 1; else i = twice(i);
+    print i;
+    """
+)
+
+
+@pytest.mark.parametrize("backend", [[], ["--registers"]])
+def test_stream_matches_batch(backend, tmp_path):
+    # The same program, run at once, statement by statement from a
+    # file, and from standard input.
+    path = tmp_path / "program.vnm"
+    path.write_text(SOURCE)
+    outputs = []
+    for args, source in [([str(path)], None), (["--stream", str(path)], None), ([], SOURCE)]:
+        process = subprocess.run(
+            VALGRIND_CMD + backend + args,
+            capture_output=True,
+            input=source.encode('utf-8') if source is not None else None
+        )
+        assert process.returncode == 0
+        outputs.append([line for line in process.stdout.split(b"\n") if line.startswith(b"dbg print :: ")])
+
+    assert outputs[0] == [b"dbg print :: { not a block; }", b"dbg print :: 2.00"]
+    assert outputs[1] == outputs[0]
+    assert outputs[2] == outputs[0]
+
+
+def test_stream_stops_at_runtime_error():
+    process = subprocess.run(
+        VALGRIND_CMD,
+        capture_output=True,
+        input=b"print 1;\nprint x;\nprint 3;\n"
+    )
+    assert b"dbg print :: 1.00\n" in process.stdout
+    assert b"dbg print :: 3.00\n" not in process.stdout
+    assert b"runtime error" in process.stderr
+    assert process.returncode != 0
+
+
+def test_stream_output_before_end_of_input():
+    # The first statement runs before standard input is closed.
+    process = subprocess.Popen(
+        VALGRIND_CMD,
+        stdin=subprocess.PIPE,
+        stdout=subprocess.PIPE,
+        stderr=subprocess.DEVNULL
+    )
+    process.stdin.write(b"print 1;\n")
+    process.stdin.flush()
+
+    output = b""
+    while b"dbg print :: 1.00\n" not in output:
+        ready, _, _ = select.select([process.stdout], [], [], 60)
+        assert ready
+        chunk = process.stdout.read1(4096)
+        assert chunk
+        output += chunk
+
+    process.stdin.write(b"print 2;\n")
+    process.stdin.close()
+    assert b"dbg print :: 2.00\n" in process.stdout.read()
+    assert process.wait() == 0